@@ -0,0 +1,330 @@
+#include <batch_scheduler.h>
+
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+
+namespace
+{
+    // Pool and deque of the pool thread this is, if any
+    thread_local const WorkStealingPool* current_pool = nullptr;
+    thread_local size_t current_queue = 0;
+}
+
+WorkStealingPool::WorkStealingPool(const int num_threads)
+{
+    const int n = std::max(num_threads, 1);
+    for (int t = 0; t < n; ++t)
+    {
+        queues.emplace_back(new Queue());
+    }
+    for (int t = 0; t < n; ++t)
+    {
+        threads.push_back(std::thread(&WorkStealingPool::work, this, t));
+    }
+}
+
+WorkStealingPool::~WorkStealingPool()
+{
+    wait();
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+void WorkStealingPool::submit(Task task)
+{
+    const size_t id = current_pool == this ? current_queue : next_queue++ % queues.size();
+    // Counted before it is queued, so it can never be taken before it has been counted
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        ++queued;
+        ++pending;
+    }
+    {
+        std::lock_guard<std::mutex> lock (queues[id]->mutex);
+        queues[id]->tasks.push_back(std::move(task));
+    }
+    wake.notify_one();
+}
+
+void WorkStealingPool::wait()
+{
+    std::unique_lock<std::mutex> lock (mutex);
+    idle.wait(lock, [this]{ return pending == 0; });
+}
+
+bool WorkStealingPool::take(const size_t id, Task& task)
+{
+    // The newest task of this thread's own deque, or else the oldest of the first other deque with any
+    bool found = false;
+    for (size_t i = 0; i < queues.size() && !found; ++i)
+    {
+        Queue& queue = *queues[(id + i) % queues.size()];
+        std::lock_guard<std::mutex> lock (queue.mutex);
+        if (queue.tasks.empty())
+        {
+            continue;
+        }
+        if (i == 0)
+        {
+            task = std::move(queue.tasks.back());
+            queue.tasks.pop_back();
+        }
+        else
+        {
+            task = std::move(queue.tasks.front());
+            queue.tasks.pop_front();
+        }
+        found = true;
+    }
+    if (found)
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        --queued;
+    }
+    return found;
+}
+
+void WorkStealingPool::work(const size_t id)
+{
+    current_pool = this;
+    current_queue = id;
+    Task task;
+    while (true)
+    {
+        if (take(id, task))
+        {
+            task();
+            task = nullptr;
+            std::lock_guard<std::mutex> lock (mutex);
+            if (--pending == 0)
+            {
+                idle.notify_all();
+            }
+            continue;
+        }
+        std::unique_lock<std::mutex> lock (mutex);
+        wake.wait(lock, [this]{ return stopping || queued > 0; });
+        if (stopping && queued == 0)
+        {
+            return;
+        }
+    }
+}
+
+BatchScheduler::BatchScheduler(const int num_threads, const size_t memory_budget, const size_t max_ahead)
+    : memory_budget(memory_budget), max_ahead(std::max<size_t>(max_ahead, 1)), pool(num_threads)
+{
+}
+
+size_t BatchScheduler::estimateMemory(const DatasetJob& job) const
+{
+    // The map never holds more points than went into it, and besides the map each dataset has the clouds being
+    // prepared, the one being added and its first cloud in memory
+    // Sizes on disk stand in for sizes in memory; binary PCD files are close, ASCII ones overestimate
+    size_t largest = 0;
+    const size_t total = job.inputBytes(&largest);
+    return total + (max_ahead + 2) * largest;
+}
+
+void BatchScheduler::add(const std::string& directory, const StitchingOptions& options)
+{
+    std::unique_ptr<Dataset> dataset (new Dataset());
+    dataset->directory = directory;
+    dataset->result.directory = directory;
+    try
+    {
+        // Listing the clouds and reading the transformations is cheap; the first cloud is only read once it starts
+        dataset->job.reset(new DatasetJob(directory, options));
+        dataset->result.clouds = dataset->job->size();
+        dataset->result.memory_estimate = estimateMemory(*dataset->job);
+    }
+    catch (const std::exception& e)
+    {
+        dataset->failed = true;
+        dataset->result.error = e.what();
+    }
+    std::lock_guard<std::mutex> lock (mutex);
+    datasets.push_back(std::move(dataset));
+}
+
+std::vector<BatchScheduler::Result> BatchScheduler::run()
+{
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        admit();
+    }
+    // Finishing a dataset admits the next ones from inside its last task, so the pool only runs dry at the very end
+    pool.wait();
+
+    std::vector<Result> results;
+    for (const std::unique_ptr<Dataset>& dataset : datasets)
+    {
+        results.push_back(dataset->result);
+    }
+    return results;
+}
+
+void BatchScheduler::admit()
+{
+    // First fit in the order the datasets were added, so a large dataset waiting for room does not hold up
+    // smaller ones behind it
+    for (const std::unique_ptr<Dataset>& dataset : datasets)
+    {
+        if (!dataset->job || dataset->failed || dataset->tasks > 0)
+        {
+            continue;
+        }
+        const size_t estimate = dataset->result.memory_estimate;
+        if (running > 0 && memory_budget > 0 && memory_in_use + estimate > memory_budget)
+        {
+            continue;
+        }
+        ++running;
+        memory_in_use += estimate;
+        std::cout << "Starting " << dataset->directory << " (" << dataset->job->size() << " clouds, about "
+                  << estimate / (1 << 20) << " MB)" << std::endl;
+        start(*dataset);
+    }
+}
+
+void BatchScheduler::spawn(Dataset& dataset, std::function<void()> task)
+{
+    // Called with 'mutex' held; the dataset is closed once its last task has finished with nothing left to spawn
+    ++dataset.tasks;
+    pool.submit([this, &dataset, task]
+    {
+        std::string error;
+        try
+        {
+            task();
+        }
+        catch (const std::exception& e)
+        {
+            error = e.what();
+        }
+        catch (...)
+        {
+            error = "Unknown error";
+        }
+
+        // The map and the dataset's clouds are freed once the lock has been let go
+        std::unique_ptr<DatasetJob> finished_job;
+        std::unique_ptr<CloudPool<PointT> > finished_clouds;
+        std::lock_guard<std::mutex> lock (mutex);
+        if (!error.empty())
+        {
+            fail(dataset, error);
+        }
+        if (--dataset.tasks == 0)
+        {
+            finished_job = std::move(dataset.job);
+            finished_clouds = std::move(dataset.clouds);
+            release(dataset);
+        }
+    });
+}
+
+void BatchScheduler::start(Dataset& dataset)
+{
+    dataset.clouds.reset(new CloudPool<PointT>());
+    spawn(dataset, [this, &dataset]
+    {
+        dataset.job->begin();
+        std::lock_guard<std::mutex> lock (mutex);
+        dataset.next_to_prepare = dataset.job->firstNew();
+        dataset.next_to_add = dataset.job->firstNew();
+        schedule(dataset);
+    });
+}
+
+void BatchScheduler::schedule(Dataset& dataset)
+{
+    // Called with 'mutex' held, whenever a cloud of the dataset has been prepared or added
+    if (dataset.failed)
+    {
+        return;
+    }
+    const size_t size = dataset.job->size();
+    if (dataset.next_to_add == size)
+    {
+        // Every cloud has been added; nothing else of this dataset is running
+        spawn(dataset, [this, &dataset]{ finish(dataset); });
+        return;
+    }
+    while (dataset.next_to_prepare < size && dataset.next_to_prepare <= dataset.next_to_add + max_ahead)
+    {
+        const size_t index = dataset.next_to_prepare++;
+        spawn(dataset, [this, &dataset, index]{ prepare(dataset, index); });
+    }
+    auto next = dataset.prepared.find(dataset.next_to_add);
+    if (!dataset.adding && next != dataset.prepared.end())
+    {
+        const size_t index = next->first;
+        PointCloudT::Ptr cloud = next->second;
+        dataset.prepared.erase(next);
+        dataset.adding = true;
+        spawn(dataset, [this, &dataset, index, cloud]{ add(dataset, index, cloud); });
+    }
+}
+
+void BatchScheduler::prepare(Dataset& dataset, const size_t index)
+{
+    PointCloudT::Ptr cloud = dataset.clouds->acquire();
+    dataset.job->prepareCloud(index, cloud);
+    std::lock_guard<std::mutex> lock (mutex);
+    dataset.prepared[index] = cloud;
+    schedule(dataset);
+}
+
+void BatchScheduler::add(Dataset& dataset, const size_t index, PointCloudT::Ptr cloud)
+{
+    dataset.job->addCloud(index, cloud);
+    std::lock_guard<std::mutex> lock (mutex);
+    dataset.adding = false;
+    ++dataset.next_to_add;
+    schedule(dataset);
+}
+
+void BatchScheduler::finish(Dataset& dataset)
+{
+    dataset.job->finish();
+    std::lock_guard<std::mutex> lock (mutex);
+    dataset.result.times = dataset.job->map().timeBreakdown;
+    dataset.result.succeeded = true;
+}
+
+void BatchScheduler::fail(Dataset& dataset, const std::string& error)
+{
+    // Tasks of the dataset already queued or running finish, but spawn nothing more
+    if (!dataset.failed)
+    {
+        dataset.failed = true;
+        dataset.result.error = error;
+    }
+}
+
+void BatchScheduler::release(Dataset& dataset)
+{
+    // Called with 'mutex' held, once the last task of the dataset has finished
+    dataset.prepared.clear();
+    --running;
+    memory_in_use -= dataset.result.memory_estimate;
+    if (dataset.result.succeeded)
+    {
+        std::cout << "Finished " << dataset.directory << " in " << std::fixed << std::setprecision(1)
+                  << dataset.result.times.total_time.count() << "s" << std::endl;
+    }
+    else
+    {
+        std::cout << "Failed " << dataset.directory << ": " << dataset.result.error << std::endl;
+    }
+    admit();
+}
@@ -0,0 +1,124 @@
+#ifndef BATCH_SCHEDULER_H
+#define BATCH_SCHEDULER_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <cloud_pool.h>
+#include <stitching.h>
+
+// Fixed set of threads, each with its own deque of tasks
+// A thread runs the newest task of its own deque first and, once that is empty, steals the oldest task of another,
+// so work a task spawns stays on the thread that spawned it while idle threads take whatever is waiting elsewhere
+class WorkStealingPool
+{
+public:
+    typedef std::function<void()> Task;
+
+    WorkStealingPool(const int num_threads);
+    // Finishes every task, including any they spawn, before returning
+    ~WorkStealingPool();
+    WorkStealingPool(const WorkStealingPool&) = delete;
+    WorkStealingPool& operator=(const WorkStealingPool&) = delete;
+
+    // Called from one of the pool's tasks, 'task' goes on the deque of the thread running it; from anywhere else, on
+    // the deques in turn
+    void submit(Task task);
+    // Blocks until there are no tasks left, queued or running
+    void wait();
+    size_t size() const { return threads.size(); }
+
+private:
+    struct Queue
+    {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+    };
+
+    void work(const size_t id);
+    bool take(const size_t id, Task& task);
+
+    std::vector<std::unique_ptr<Queue> > queues;
+    std::mutex mutex;
+    std::condition_variable wake;       // Signalled when a task is submitted or the pool stops
+    std::condition_variable idle;       // Signalled when the last task has finished
+    size_t queued = 0;                  // Tasks submitted but not yet taken
+    size_t pending = 0;                 // Tasks submitted but not yet finished
+    bool stopping = false;
+    std::atomic<size_t> next_queue {0};
+    std::vector<std::thread> threads;
+};
+
+// Stitches many datasets at once within a fixed number of threads and a memory budget
+// Each dataset is split into tasks on one shared WorkStealingPool: preparing each cloud, which can run anywhere, and
+// adding it to the map, which runs one cloud at a time in order, so no thread ever waits on another dataset
+// A dataset is only started once its estimated peak memory fits into what the running datasets leave of the budget;
+// one that would not fit even on its own is run by itself
+class BatchScheduler
+{
+public:
+    struct Result
+    {
+        std::string directory;
+        bool succeeded = false;
+        std::string error;
+        size_t clouds = 0;
+        size_t memory_estimate = 0;
+        TimeBreakdown times;
+    };
+
+    // A 'memory_budget' of 0 bytes places no limit on how many datasets run at once
+    // Each dataset prepares up to 'max_ahead' clouds beyond the one being added to its map
+    BatchScheduler(const int num_threads, const size_t memory_budget, const size_t max_ahead = 2);
+
+    // Queues a dataset, to be started in the order they were added as the budget allows
+    void add(const std::string& directory, const StitchingOptions& options);
+    // Stitches every queued dataset and returns once they have all finished or failed
+    std::vector<Result> run();
+
+private:
+    struct Dataset
+    {
+        std::string directory;
+        Result result;
+        std::unique_ptr<DatasetJob> job;
+        size_t next_to_prepare = 0;
+        size_t next_to_add = 0;
+        bool adding = false;
+        bool failed = false;
+        int tasks = 0;                  // Tasks of this dataset queued or running
+        std::map<size_t, PointCloudT::Ptr> prepared;
+        std::unique_ptr<CloudPool<PointT> > clouds;
+    };
+
+    size_t estimateMemory(const DatasetJob& job) const;
+    void admit();
+    void spawn(Dataset& dataset, std::function<void()> task);
+    void start(Dataset& dataset);
+    void prepare(Dataset& dataset, const size_t index);
+    void add(Dataset& dataset, const size_t index, PointCloudT::Ptr cloud);
+    void schedule(Dataset& dataset);
+    void finish(Dataset& dataset);
+    void fail(Dataset& dataset, const std::string& error);
+    void release(Dataset& dataset);
+
+    const size_t memory_budget;
+    const size_t max_ahead;
+    WorkStealingPool pool;
+
+    // Everything below is guarded by 'mutex'; the datasets' jobs are only touched by their own tasks
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Dataset> > datasets;
+    size_t running = 0;
+    size_t memory_in_use = 0;
+};
+
+#endif
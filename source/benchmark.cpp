@@ -0,0 +1,481 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cmath>
+#include <iomanip>
+#include <iostream>
+#include <numeric>
+#include <sstream>
+
+#include "tunnel_generator.h"
+
+void helpMessage();
+std::vector<size_t> parseList(const std::string& list);
+
+/*          Allocation Counting         */
+// malloc and its relatives are replaced for the whole process, so allocations made inside PCL, FLANN and Eigen's
+// aligned allocator are counted along with operator new; glibc's allocator still does the work
+namespace
+{
+    std::atomic<size_t> allocation_count (0);
+    std::atomic<size_t> allocation_bytes (0);
+
+    void countAllocation(const size_t size)
+    {
+        allocation_count.fetch_add(1, std::memory_order_relaxed);
+        allocation_bytes.fetch_add(size, std::memory_order_relaxed);
+    }
+}
+
+extern "C"
+{
+    void* __libc_malloc(size_t size);
+    void* __libc_calloc(size_t count, size_t size);
+    void* __libc_realloc(void* p, size_t size);
+    void* __libc_memalign(size_t alignment, size_t size);
+    void __libc_free(void* p);
+
+    void* malloc(size_t size) { countAllocation(size); return __libc_malloc(size); }
+    void* calloc(size_t count, size_t size) { countAllocation(count * size); return __libc_calloc(count, size); }
+    void* realloc(void* p, size_t size) { countAllocation(size); return __libc_realloc(p, size); }
+    void* memalign(size_t alignment, size_t size) { countAllocation(size); return __libc_memalign(alignment, size); }
+    void* aligned_alloc(size_t alignment, size_t size) { countAllocation(size); return __libc_memalign(alignment, size); }
+    int posix_memalign(void** p, size_t alignment, size_t size)
+    {
+        countAllocation(size);
+        *p = __libc_memalign(alignment, size);
+        return *p ? 0 : ENOMEM;
+    }
+    void free(void* p) { __libc_free(p); }
+}
+
+// Gives the benchmark access to the individual stages of StitchedCloud
+class StitchedCloudBenchmark
+{
+public:
+    StitchedCloudBenchmark(PointCloudT::Ptr first_cloud) : map (first_cloud) {}
+
+    void downSample(PointCloudT::Ptr cloud) { map.downSample(cloud, 500); }
+    void removeOutliers(PointCloudT::Ptr cloud) { map.removeOutliers(cloud, 500, 2); }
+    void transform(PointCloudT::Ptr cloud, const TransformData& t) { map.transform(cloud, t); }
+    void smoothSurface(PointCloudT::Ptr cloud) { map.smoothSurface(cloud, 500); }
+
+    // Appends a registered cloud to the map without filtering or smoothing any of it
+    void appendCloud(const PointCloudT& cloud)
+    {
+        map.reserveMap(cloud.size());
+        *map.stitched_cloud += cloud;
+        map.map_index->setInputCloud(map.stitched_cloud);
+        map.extendMapFeatures();
+    }
+    // One outlier removal and smoothing pass over the whole map, with the settings integrateCloud uses
+    void postProcessMap()
+    {
+        map.removeMapOutliers(map.dirtyRegion(map.stitched_cloud, true), 100, 2);
+        map.smoothMapRegion(map.dirtyRegion(map.stitched_cloud, true), 500);
+    }
+
+    // Registers 'cloud' against the map and returns the transformation applied to it
+    Eigen::Matrix4f registerWithICP(PointCloudT::Ptr cloud)
+    {
+        map.last_registration = Eigen::Matrix4f::Identity();
+        map.registerWithICP(cloud, map.stitched_cloud, 100);
+        return map.last_registration;
+    }
+    // As above, but against a copy of the map, so the target gets a new FLANN kd-tree as any unindexed cloud would
+    Eigen::Matrix4f registerWithFLANN(PointCloudT::Ptr cloud)
+    {
+        map.last_registration = Eigen::Matrix4f::Identity();
+        PointCloudT::Ptr target (new PointCloudT(*map.stitched_cloud));
+        map.registerWithICP(cloud, target, 100);
+        return map.last_registration;
+    }
+    Eigen::Matrix4f registerWithSAC(PointCloudT::Ptr cloud)
+    {
+        map.last_registration = Eigen::Matrix4f::Identity();
+        map.registerWithSAC(cloud, map.stitched_cloud, 100);
+        return map.last_registration;
+    }
+
+    StitchedCloud map;
+};
+
+// Times 'stage' on a fresh copy of 'input' 'repeats' times and returns the median, in seconds
+// Making the copy is not timed
+template <typename Stage>
+double timeStage(const PointCloudT& input, const int repeats, Stage stage)
+{
+    std::vector<double> times;
+    for (int r = 0; r < repeats; ++r)
+    {
+        PointCloudT::Ptr cloud (new PointCloudT(input));
+        auto start = Clock::now();
+        stage(cloud);
+        times.push_back(Seconds(Clock::now() - start).count());
+    }
+    std::sort(times.begin(), times.end());
+    return times[times.size() / 2];
+}
+
+// Quantizes 'input' at 1 mm 'repeats' times, leaving the decoded points in 'decoded', and returns the bytes it took
+// The median encode and decode times are returned in seconds
+template <typename Coord>
+size_t timeQuantized(const PointCloudT& input, const int repeats, double& encode_seconds, double& decode_seconds,
+                     PointCloudT& decoded)
+{
+    std::vector<int> all (input.size());
+    std::iota(all.begin(), all.end(), 0);
+    QuantizedCloud<Coord> store;
+    decoded.points.resize(input.size());
+    decoded.width = input.size();
+    decoded.height = 1;
+    std::vector<double> encode_times, decode_times;
+    for (int r = 0; r < repeats; ++r)
+    {
+        auto encode_start = Clock::now();
+        store.encode(input, all, 1);
+        encode_times.push_back(Seconds(Clock::now() - encode_start).count());
+        auto decode_start = Clock::now();
+        store.decode(0, store.size(), decoded.points.data());
+        decode_times.push_back(Seconds(Clock::now() - decode_start).count());
+    }
+    std::sort(encode_times.begin(), encode_times.end());
+    std::sort(decode_times.begin(), decode_times.end());
+    encode_seconds = encode_times[repeats / 2];
+    decode_seconds = decode_times[repeats / 2];
+    return store.bytes();
+}
+
+void printRow(const std::string& stage, const size_t points, const double seconds, const std::string& error = "")
+{
+    std::cout << std::setw(16) << stage << std::setw(10) << points
+              << std::setw(12) << std::fixed << std::setprecision(2) << 1000 * seconds
+              << std::setw(12) << std::setprecision(3) << points / seconds / 1e6
+              << "  " << error << "\n";
+}
+
+std::string errorText(const double translation, const double rotation)
+{
+    std::ostringstream text;
+    text << std::fixed << std::setprecision(1) << translation << " mm, " << std::setprecision(4) << rotation << " rad";
+    return text.str();
+}
+
+int main(int argc, char** argv)
+{
+    std::vector<size_t> sizes {20000, 50000, 100000};
+    std::vector<size_t> frame_counts {5, 10, 20};
+    int repeats = 3;
+    TunnelParameters params;
+    for (int i = 1; i < argc; i += 2)
+    {
+        if (i + 1 >= argc)
+        {
+            std::cout << "Command \"" << argv[i] << "\" is missing a value." << std::endl;
+            helpMessage();
+            return -1;
+        }
+        if (!std::strcmp(argv[i], "-p"))
+        {
+            sizes = parseList(argv[i+1]);
+        }
+        else if (!std::strcmp(argv[i], "-n"))
+        {
+            frame_counts = parseList(argv[i+1]);
+        }
+        else if (!std::strcmp(argv[i], "-r"))
+        {
+            repeats = std::max(1, std::stoi(argv[i+1]));
+        }
+        else if (!std::strcmp(argv[i], "-s"))
+        {
+            params.seed = std::stoul(argv[i+1]);
+        }
+        else
+        {
+            std::cout << "Command \"" << argv[i] << "\" not recognised." << std::endl;
+            helpMessage();
+            return -1;
+        }
+    }
+
+#ifndef __OPTIMIZE__
+    std::cout << "WARNING: built without optimisation, so the distance kernels are not vectorised and these timings\n"
+              << "do not reflect a real build; configure with -DCMAKE_BUILD_TYPE=Release (the default).\n\n";
+#endif
+
+    /*          Individual Stages           */
+    // Each stage is fed what it would see in registerClouds: raw sweeps for the preprocessing stages,
+    // preprocessed sweeps for registration and smoothing
+    std::cout << "Stages (median of " << repeats << " runs; registration error is against the ground truth)\n"
+              << std::setw(16) << "stage" << std::setw(10) << "points" << std::setw(12) << "ms"
+              << std::setw(12) << "Mpoints/s" << "  error\n";
+    for (const size_t size : sizes)
+    {
+        params.points_per_frame = size;
+        PointCloudT::Ptr first (new PointCloudT());
+        generateTunnelSweep(params, 0, *first);
+        std::vector<int> finite;
+        pcl::removeNaNFromPointCloud(*first, *first, finite);
+        StitchedCloudBenchmark bench (first);
+
+        PointCloudT raw;
+        generateTunnelSweep(params, 1, raw);
+        pcl::removeNaNFromPointCloud(raw, raw, finite);
+        const TransformData prior = priorPose(params, 1);
+        const Eigen::Matrix4f truth = groundTruthPose(params, 1).affine().matrix();
+
+        PointCloudT::Ptr prepared (new PointCloudT(raw));
+        bench.map.preprocessCloud(prepared, prior);
+        PointCloudT::Ptr downsampled (new PointCloudT(raw));
+        bench.transform(downsampled, prior);
+        bench.downSample(downsampled);
+
+        printRow("transform", raw.size(), timeStage(raw, repeats, [&](PointCloudT::Ptr c) { bench.transform(c, prior); }));
+        printRow("downSample", raw.size(), timeStage(raw, repeats, [&](PointCloudT::Ptr c) { bench.downSample(c); }));
+        printRow("removeOutliers", downsampled->size(),
+                 timeStage(*downsampled, repeats, [&](PointCloudT::Ptr c) { bench.removeOutliers(c); }));
+
+        Eigen::Matrix4f icp_correction, flann_correction, voxel_correction, pyramid_correction, plane_correction, sac_correction;
+        const double icp_seconds = timeStage(*prepared, repeats, [&](PointCloudT::Ptr c) { icp_correction = bench.registerWithICP(c); });
+        const double flann_seconds = timeStage(*prepared, repeats, [&](PointCloudT::Ptr c) { flann_correction = bench.registerWithFLANN(c); });
+        bench.map.setCorrespondenceSearch(CorrespondenceSearch::VoxelHash, 1000);
+        const double voxel_seconds = timeStage(*prepared, repeats, [&](PointCloudT::Ptr c) { voxel_correction = bench.registerWithICP(c); });
+        bench.map.setCorrespondenceSearch(CorrespondenceSearch::Tree);
+        bench.map.setRegistrationPyramid({2000, 1000});
+        const double pyramid_seconds = timeStage(*prepared, repeats, [&](PointCloudT::Ptr c) { pyramid_correction = bench.registerWithICP(c); });
+        bench.map.setRegistrationPyramid({});
+        // The map's normals are computed once here, as they would be while it was built
+        bench.map.setRegistrationBackend(RegistrationBackend::PointToPlane);
+        const double plane_seconds = timeStage(*prepared, repeats, [&](PointCloudT::Ptr c) { plane_correction = bench.registerWithICP(c); });
+        bench.map.setRegistrationBackend(RegistrationBackend::PointToPoint);
+        const double sac_seconds = timeStage(*prepared, repeats, [&](PointCloudT::Ptr c) { sac_correction = bench.registerWithSAC(c); });
+        double translation, rotation;
+        poseError(icp_correction * prior.affine().matrix(), truth, translation, rotation);
+        printRow("registerWithICP", prepared->size(), icp_seconds, errorText(translation, rotation));
+        poseError(flann_correction * prior.affine().matrix(), truth, translation, rotation);
+        printRow("  FLANN kd-tree", prepared->size(), flann_seconds, errorText(translation, rotation));
+        poseError(voxel_correction * prior.affine().matrix(), truth, translation, rotation);
+        printRow("  voxel hash corr", prepared->size(), voxel_seconds, errorText(translation, rotation));
+        poseError(pyramid_correction * prior.affine().matrix(), truth, translation, rotation);
+        printRow("  with pyramid", prepared->size(), pyramid_seconds, errorText(translation, rotation));
+        poseError(plane_correction * prior.affine().matrix(), truth, translation, rotation);
+        printRow("  point-to-plane", prepared->size(), plane_seconds, errorText(translation, rotation));
+        poseError(sac_correction * prior.affine().matrix(), truth, translation, rotation);
+        printRow("registerWithSAC", prepared->size(), sac_seconds, errorText(translation, rotation));
+        poseError(prior.affine().matrix(), truth, translation, rotation);
+        std::cout << std::setw(16) << "(prior)" << std::setw(46) << "" << errorText(translation, rotation) << "\n";
+
+        printRow("smoothSurface", prepared->size(), timeStage(*prepared, repeats, [&](PointCloudT::Ptr c) { bench.smoothSurface(c); }));
+        std::cout << "\n";
+    }
+
+    /*          Post-Processing         */
+    // The same sweeps, placed at their true poses so registration plays no part, are either integrated one at a time,
+    // filtering and smoothing only the region each touches, or appended and filtered and smoothed once at the end
+    // Each point of the incremental map is compared with the nearest point of the one-shot map
+    params.num_frames = frame_counts.front();
+    std::cout << "Post-processing (" << params.num_frames << " frames, incremental against one pass at the end)\n"
+              << std::setw(10) << "points" << std::setw(14) << "incr points" << std::setw(14) << "final points"
+              << std::setw(12) << "incr ms" << std::setw(12) << "final ms"
+              << std::setw(14) << "mean offset" << std::setw(14) << "max offset\n";
+    for (const size_t size : sizes)
+    {
+        params.points_per_frame = size;
+        PointCloudT::Ptr first (new PointCloudT());
+        generateTunnelSweep(params, 0, *first);
+        std::vector<int> finite;
+        pcl::removeNaNFromPointCloud(*first, *first, finite);
+        StitchedCloudBenchmark incremental (PointCloudT::Ptr(new PointCloudT(*first)));
+        StitchedCloudBenchmark one_shot (first);
+
+        // Only outlier removal and smoothing are timed; both record into the map's own time breakdown
+        Seconds incremental_time (0);
+        for (size_t frame = 1; frame < params.num_frames; ++frame)
+        {
+            PointCloudT::Ptr cloud (new PointCloudT());
+            generateTunnelSweep(params, frame, *cloud);
+            one_shot.map.preprocessCloud(cloud, groundTruthPose(params, frame));
+            one_shot.appendCloud(*cloud);
+            const Seconds before = incremental.map.timeBreakdown.sor_time + incremental.map.timeBreakdown.smooth_time;
+            incremental.map.integrateCloud(cloud);
+            incremental_time += incremental.map.timeBreakdown.sor_time + incremental.map.timeBreakdown.smooth_time - before;
+        }
+        const Seconds before = one_shot.map.timeBreakdown.sor_time + one_shot.map.timeBreakdown.smooth_time;
+        one_shot.postProcessMap();
+        const Seconds one_shot_time = one_shot.map.timeBreakdown.sor_time + one_shot.map.timeBreakdown.smooth_time - before;
+
+        const PointCloudT& incremental_map = *incremental.map.stitched_cloud;
+        VoxelHashIndex final_index (1000);
+        final_index.setInputCloud(one_shot.map.stitched_cloud);
+        std::vector<int> nn_indices;
+        std::vector<float> nn_sqr_distances;
+        double offset_sum = 0, offset_max = 0;
+        for (const PointT& p : incremental_map.points)
+        {
+            if (final_index.nearestKSearch(p, 1, nn_indices, nn_sqr_distances) > 0)
+            {
+                const double offset = std::sqrt(nn_sqr_distances[0]);
+                offset_sum += offset;
+                offset_max = std::max(offset_max, offset);
+            }
+        }
+        std::cout << std::setw(10) << size << std::setw(14) << incremental_map.size()
+                  << std::setw(14) << one_shot.map.stitched_cloud->size()
+                  << std::setw(12) << std::fixed << std::setprecision(2) << 1000 * incremental_time.count()
+                  << std::setw(12) << 1000 * one_shot_time.count()
+                  << std::setw(11) << std::setprecision(1) << offset_sum / std::max<size_t>(incremental_map.size(), 1) << " mm"
+                  << std::setw(11) << offset_max << " mm\n";
+    }
+    std::cout << "\n";
+
+    /*          Map Storage         */
+    // Finished tiles can be kept as quantized offsets instead of floats; each layout of the map of the first sweep is
+    // decoded again and the second sweep registered against it, to show what the rounding costs in accuracy
+    // Registration only ever sees decoded floats, so its speed does not depend on the layout and is not shown
+    std::cout << "Map storage (median of " << repeats << " runs)\n"
+              << std::setw(16) << "layout" << std::setw(10) << "points" << std::setw(10) << "B/point"
+              << std::setw(12) << "encode ms" << std::setw(12) << "decode ms" << std::setw(12) << "rounding"
+              << "  ICP error\n";
+    for (const size_t size : sizes)
+    {
+        params.points_per_frame = size;
+        PointCloudT::Ptr first (new PointCloudT());
+        generateTunnelSweep(params, 0, *first);
+        std::vector<int> finite;
+        pcl::removeNaNFromPointCloud(*first, *first, finite);
+        StitchedCloudBenchmark reference (first);
+        const PointCloudT map_cloud = *reference.map.stitched_cloud;
+
+        PointCloudT::Ptr prepared (new PointCloudT());
+        generateTunnelSweep(params, 1, *prepared);
+        pcl::removeNaNFromPointCloud(*prepared, *prepared, finite);
+        const TransformData prior = priorPose(params, 1);
+        const Eigen::Matrix4f truth = groundTruthPose(params, 1).affine().matrix();
+        reference.map.preprocessCloud(prepared, prior);
+
+        auto row = [&](const std::string& layout, const double bytes, const double encode_seconds,
+                       const double decode_seconds, const PointCloudT& decoded)
+        {
+            double rounding = 0;
+            for (size_t i = 0; i < map_cloud.size(); ++i)
+            {
+                rounding = std::max(rounding, static_cast<double>((decoded.points[i].getVector3fMap() -
+                                                                   map_cloud.points[i].getVector3fMap()).norm()));
+            }
+            PointCloudT::Ptr target (new PointCloudT(decoded));
+            StitchedCloudBenchmark bench (target);
+            PointCloudT::Ptr cloud (new PointCloudT(*prepared));
+            const Eigen::Matrix4f correction = bench.registerWithICP(cloud);
+            double translation, rotation;
+            poseError(correction * prior.affine().matrix(), truth, translation, rotation);
+            std::cout << std::setw(16) << layout << std::setw(10) << map_cloud.size()
+                      << std::setw(10) << std::fixed << std::setprecision(1) << bytes / std::max<size_t>(map_cloud.size(), 1)
+                      << std::setw(12) << std::setprecision(2) << 1000 * encode_seconds
+                      << std::setw(12) << 1000 * decode_seconds
+                      << std::setw(9) << std::setprecision(2) << rounding << " mm"
+                      << "  " << errorText(translation, rotation) << "\n";
+        };
+
+        // Floats are the baseline: nothing to encode, and the points are used as they are
+        row("float", map_cloud.size() * sizeof(PointT), 0, 0, map_cloud);
+        double encode_seconds, decode_seconds;
+        PointCloudT decoded;
+        const size_t wide_bytes = timeQuantized<int32_t>(map_cloud, repeats, encode_seconds, decode_seconds, decoded);
+        row("int32 offsets", wide_bytes, encode_seconds, decode_seconds, decoded);
+        const size_t narrow_bytes = timeQuantized<int16_t>(map_cloud, repeats, encode_seconds, decode_seconds, decoded);
+        row("int16 offsets", narrow_bytes, encode_seconds, decode_seconds, decoded);
+        std::cout << "\n";
+    }
+
+    /*          End to End          */
+    // Every frame goes through addCloud, as registerClouds does without -p
+    // Allocations are averaged over the second half of the frames, once the reused buffers have grown to size
+    std::cout << "End to end\n"
+              << std::setw(10) << "points" << std::setw(8) << "frames" << std::setw(10) << "s"
+              << std::setw(10) << "frames/s" << std::setw(12) << "Mpoints/s"
+              << std::setw(14) << "mean error" << std::setw(14) << "max error" << std::setw(12) << "map points"
+              << std::setw(14) << "allocs/frame" << std::setw(12) << "MB/frame\n";
+    for (const size_t size : sizes)
+    {
+        params.points_per_frame = size;
+        for (const size_t frames : frame_counts)
+        {
+            params.num_frames = frames;
+            auto start = Clock::now();
+            PointCloudT::Ptr first (new PointCloudT());
+            generateTunnelSweep(params, 0, *first);
+            std::vector<int> finite;
+            pcl::removeNaNFromPointCloud(*first, *first, finite);
+            StitchedCloud map (first);
+
+            // Generating the sweeps is not part of the timing or the allocation counts
+            Clock::duration generation (0);
+            double error_sum = 0, error_max = 0;
+            CloudPool<PointT> frame_clouds;
+            const size_t steady_frame = std::max<size_t>(1, frames / 2);
+            size_t steady_allocations = 0, steady_bytes = 0;
+            for (size_t frame = 1; frame < frames; ++frame)
+            {
+                auto generate_start = Clock::now();
+                PointCloudT::Ptr cloud = frame_clouds.acquire();
+                generateTunnelSweep(params, frame, *cloud);
+                generation += Clock::now() - generate_start;
+
+                const size_t allocations_before = allocation_count;
+                const size_t bytes_before = allocation_bytes;
+
+                const TransformData prior = priorPose(params, frame);
+                map.addCloud(cloud, prior);
+                if (frame >= steady_frame)
+                {
+                    steady_allocations += allocation_count - allocations_before;
+                    steady_bytes += allocation_bytes - bytes_before;
+                }
+                double translation, rotation;
+                poseError(map.lastRegistration() * prior.affine().matrix(), groundTruthPose(params, frame).affine().matrix(),
+                          translation, rotation);
+                error_sum += translation;
+                error_max = std::max(error_max, translation);
+            }
+            const double seconds = Seconds(Clock::now() - start - generation).count();
+            const size_t registered = std::max<size_t>(frames, 2) - 1;
+            const size_t steady_frames = std::max<size_t>(frames, steady_frame + 1) - steady_frame;
+            std::cout << std::setw(10) << size << std::setw(8) << frames
+                      << std::setw(10) << std::fixed << std::setprecision(2) << seconds
+                      << std::setw(10) << frames / seconds
+                      << std::setw(12) << std::setprecision(3) << frames * size / seconds / 1e6
+                      << std::setw(11) << std::setprecision(1) << error_sum / registered << " mm"
+                      << std::setw(11) << error_max << " mm"
+                      << std::setw(12) << map.stitched_cloud->size()
+                      << std::setw(14) << steady_allocations / steady_frames
+                      << std::setw(11) << std::setprecision(2) << steady_bytes / 1e6 / steady_frames << "\n";
+        }
+    }
+    std::cout << std::endl;
+    return 0;
+}
+
+std::vector<size_t> parseList(const std::string& list)
+{
+    // Comma separated, e.g. "10000,50000"
+    std::vector<size_t> values;
+    std::istringstream iss (list);
+    std::string val;
+    while (std::getline(iss, val, ','))
+    {
+        values.push_back(std::stoul(val));
+    }
+    return values;
+}
+
+void helpMessage()
+{
+    std::cout << "Usage: benchmarkStitching [options]\n"
+              << "Timings are only meaningful from an optimised build (CMAKE_BUILD_TYPE Release, the default).\n"
+              << "\t-p <points,...>" << "\tCloud sizes to benchmark. (OPTIONAL)\n"
+              << "\t-n <frames,...>" << "\tNumbers of frames to stitch end to end. (OPTIONAL)\n"
+              << "\t-r <repeats>" << "\t\tRuns of each stage; the median is reported. (OPTIONAL)\n"
+              << "\t-s <seed>" << "\t\tSeed of the synthetic tunnel. (OPTIONAL)"
+              << std::endl;
+}
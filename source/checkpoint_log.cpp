@@ -0,0 +1,161 @@
+#include <checkpoint_log.h>
+
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <vector>
+
+namespace
+{
+    const uint32_t record_magic = 0x4B435054;   // "TPCK"
+
+    struct RecordHeader
+    {
+        uint32_t magic;
+        uint32_t checksum;      // Of the header, with this field zeroed, and the points
+        uint64_t index;
+        uint64_t num_points;
+        float pose[16];         // Column major
+    };
+
+    uint32_t fnv1a(const void* data, const size_t size, uint32_t hash = 2166136261u)
+    {
+        const unsigned char* bytes = static_cast<const unsigned char*>(data);
+        for (size_t i = 0; i < size; ++i)
+        {
+            hash = (hash ^ bytes[i]) * 16777619u;
+        }
+        return hash;
+    }
+
+    uint32_t recordChecksum(RecordHeader header, const std::vector<float>& xyz)
+    {
+        header.checksum = 0;
+        return fnv1a(xyz.data(), xyz.size() * sizeof(float), fnv1a(&header, sizeof(header)));
+    }
+}
+
+CheckpointLog::CheckpointLog(const std::string& path, const int interval)
+    : path(path), interval(std::max(interval, 1))
+{
+    // Trim a partly written record from a crashed run so new records follow straight on from the last good one
+    size_t count = 0;
+    const long length = validLength(path, ReplayFunction(), count);
+    if (length >= 0 && truncate(path.c_str(), length) != 0)
+    {
+        throw std::runtime_error("Could not trim checkpoint " + path + ".");
+    }
+    file = std::fopen(path.c_str(), "ab");
+    if (!file)
+    {
+        throw std::runtime_error("Could not open checkpoint " + path + " for writing.");
+    }
+}
+
+CheckpointLog::~CheckpointLog()
+{
+    // Errors can no longer be reported here; append() and sync() will have thrown for any earlier ones
+    if (file)
+    {
+        std::fflush(file);
+        fsync(fileno(file));
+        std::fclose(file);
+    }
+}
+
+void CheckpointLog::append(const size_t index, const Eigen::Matrix4f& pose, const PointCloudT& cloud)
+{
+    // Points are stored as packed x, y, z
+    std::vector<float> xyz (3 * cloud.size());
+    for (size_t i = 0; i < cloud.size(); ++i)
+    {
+        std::memcpy(&xyz[3 * i], cloud.points[i].data, 3 * sizeof(float));
+    }
+
+    RecordHeader header;
+    header.magic = record_magic;
+    header.index = index;
+    header.num_points = cloud.size();
+    Eigen::Map<Eigen::Matrix4f> (header.pose) = pose;
+    header.checksum = recordChecksum(header, xyz);
+
+    // A disk that fills up must stop the run rather than leave it going on without checkpoints
+    if (std::fwrite(&header, sizeof(header), 1, file) != 1 ||
+        std::fwrite(xyz.data(), sizeof(float), xyz.size(), file) != xyz.size())
+    {
+        throw std::runtime_error("Could not write checkpoint " + path + ".");
+    }
+    if (++unsynced >= interval)
+    {
+        sync();
+    }
+}
+
+void CheckpointLog::sync()
+{
+    // A checkpoint only counts once it has reached the disk
+    if (std::fflush(file) != 0 || fsync(fileno(file)) != 0)
+    {
+        throw std::runtime_error("Could not write checkpoint " + path + " to disk.");
+    }
+    unsynced = 0;
+}
+
+size_t CheckpointLog::replay(const std::string& path, ReplayFunction replay)
+{
+    size_t count = 0;
+    validLength(path, replay, count);
+    return count;
+}
+
+long CheckpointLog::validLength(const std::string& path, ReplayFunction replay, size_t& count)
+{
+    // Reads records until the end of the file or the first one that is incomplete or corrupt
+    // Returns the length of the good records, or -1 if there is no log
+    FILE* in = std::fopen(path.c_str(), "rb");
+    if (!in)
+    {
+        return -1;
+    }
+    std::fseek(in, 0, SEEK_END);
+    const long size = std::ftell(in);
+    std::fseek(in, 0, SEEK_SET);
+
+    long length = 0;
+    RecordHeader header;
+    std::vector<float> xyz;
+    while (std::fread(&header, sizeof(header), 1, in) == 1 && header.magic == record_magic)
+    {
+        // A damaged point count must not turn into a huge allocation
+        if (header.num_points > static_cast<uint64_t>(size - std::ftell(in)) / (3 * sizeof(float)))
+        {
+            break;
+        }
+        xyz.resize(3 * header.num_points);
+        if (std::fread(xyz.data(), sizeof(float), xyz.size(), in) != xyz.size() ||
+            recordChecksum(header, xyz) != header.checksum)
+        {
+            break;
+        }
+        if (replay)
+        {
+            Entry entry;
+            entry.index = header.index;
+            entry.pose = Eigen::Map<const Eigen::Matrix4f> (header.pose);
+            entry.cloud.reset(new PointCloudT());
+            entry.cloud->resize(header.num_points);
+            for (size_t i = 0; i < header.num_points; ++i)
+            {
+                entry.cloud->points[i] = PointT(xyz[3 * i], xyz[3 * i + 1], xyz[3 * i + 2]);
+            }
+            replay(entry);
+        }
+        length = std::ftell(in);
+        ++count;
+    }
+    std::fclose(in);
+    return length;
+}
@@ -0,0 +1,54 @@
+#ifndef CHECKPOINT_LOG_H
+#define CHECKPOINT_LOG_H
+
+#include <cstdio>
+#include <functional>
+#include <string>
+
+#include <Eigen/Core>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+typedef pcl::PointXYZ PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+
+// Append-only binary log of the registered clouds that make up the stitched map
+// Each record holds the index of the input cloud, the correction registration applied to it and its registered points,
+// so the map can be rebuilt exactly by integrating the logged clouds again, in order, on top of the first cloud
+// Nothing already written is ever rewritten; a record cut short by a crash fails its checksum and is discarded
+class CheckpointLog
+{
+public:
+    struct Entry
+    {
+        size_t index = 0;
+        Eigen::Matrix4f pose = Eigen::Matrix4f::Identity();
+        PointCloudT::Ptr cloud;
+    };
+    typedef std::function<void(const Entry& entry)> ReplayFunction;
+
+    // Opens 'path' for appending, after dropping anything past the last complete record
+    // 'interval' is the number of records between forcing the log to disk
+    CheckpointLog(const std::string& path, const int interval);
+    ~CheckpointLog();
+    CheckpointLog(const CheckpointLog&) = delete;
+    CheckpointLog& operator=(const CheckpointLog&) = delete;
+
+    // Both throw std::runtime_error if the log cannot be written
+    void append(const size_t index, const Eigen::Matrix4f& pose, const PointCloudT& cloud);
+    void sync();
+
+    // Calls 'replay' for every complete record in 'path', one at a time, and returns the number of records
+    static size_t replay(const std::string& path, ReplayFunction replay);
+
+private:
+    static long validLength(const std::string& path, ReplayFunction replay, size_t& count);
+
+    std::string path;
+    FILE* file = nullptr;
+    int interval;
+    int unsynced = 0;
+};
+
+#endif
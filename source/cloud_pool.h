@@ -0,0 +1,47 @@
+#ifndef CLOUD_POOL_H
+#define CLOUD_POOL_H
+
+#include <mutex>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+
+// Recycles the storage of per-frame working clouds, so the steady-state frame loop stops allocating them
+// A cloud is free again once nothing outside the pool holds a pointer to it; acquire() hands it back out emptied
+// but with its capacity, so after the first few frames clouds of a similar size fit without reallocating
+// Safe to use from several threads
+template <typename PointType>
+class CloudPool
+{
+public:
+    typedef typename pcl::PointCloud<PointType>::Ptr CloudPtr;
+
+    CloudPtr acquire()
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        for (const CloudPtr& cloud : clouds)
+        {
+            // Only the pool holds it, and only the pool can hand out another pointer to it
+            if (cloud.unique())
+            {
+                cloud->clear();
+                return cloud;
+            }
+        }
+        clouds.push_back(CloudPtr(new pcl::PointCloud<PointType>()));
+        return clouds.back();
+    }
+
+    // Number of clouds the pool has ever had to create
+    size_t size()
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        return clouds.size();
+    }
+
+private:
+    std::mutex mutex;
+    std::vector<CloudPtr> clouds;
+};
+
+#endif
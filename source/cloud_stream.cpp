@@ -0,0 +1,366 @@
+#include <cloud_stream.h>
+
+#include <cstdio>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+
+namespace
+{
+    // Index of a cloud file named PCD<n>.pcd; false for any other file
+    bool cloudIndex(const std::string& name, size_t& index)
+    {
+        const std::string prefix = "PCD";
+        const std::string suffix = ".pcd";
+        if (name.size() <= prefix.size() + suffix.size() || name.compare(0, prefix.size(), prefix) ||
+            name.compare(name.size() - suffix.size(), suffix.size(), suffix))
+        {
+            return false;
+        }
+        const std::string digits = name.substr(prefix.size(), name.size() - prefix.size() - suffix.size());
+        if (digits.find_first_not_of("0123456789") != std::string::npos)
+        {
+            return false;
+        }
+        index = std::stoul(digits);
+        return true;
+    }
+
+    // One row of the transformations file, in the order frame;rotx;roty;rotz;dx;dy;dz;confidence
+    TransformData parsePoseRow(const std::string& line)
+    {
+        std::vector<double> values;
+        std::istringstream iss (line);
+        std::string val;
+        for (int col = 0; std::getline(iss, val, ';'); ++col)
+        {
+            if (col > 0)
+            {
+                values.push_back(std::stod(val));
+            }
+        }
+        if (values.size() < 6)
+        {
+            throw std::domain_error("Input transformations file has fewer than 6 columns.");
+        }
+        TransformData t;
+        t.rotx = values[0];
+        t.roty = values[1];
+        t.rotz = values[2];
+        t.dx = values[3];
+        t.dy = values[4];
+        t.dz = values[5];
+        t.confidence = values.size() > 6 ? values[6] : 0;
+        return t;
+    }
+}
+
+CloudStream::CloudStream(const std::string& directory, const std::string& transform_file, const int rows_per_cloud,
+                         const Clock::duration& max_wait)
+    : directory(directory), transform_file(transform_file), rows_per_cloud(std::max(rows_per_cloud, 1)), max_wait(max_wait)
+{
+    // The watch is set up before the directory is listed, so no cloud written in between is missed
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0 || inotify_add_watch(inotify_fd, directory.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0)
+    {
+        if (inotify_fd >= 0)
+        {
+            close(inotify_fd);
+        }
+        throw std::runtime_error("Could not watch " + directory + " for new clouds.");
+    }
+    scanDirectory();
+    last_arrival = Clock::now();
+}
+
+CloudStream::~CloudStream()
+{
+    close(inotify_fd);
+}
+
+void CloudStream::scanDirectory()
+{
+    // Clouds already in the directory are taken to be complete
+    DIR* dp = opendir(directory.c_str());
+    if (!dp)
+    {
+        return;
+    }
+    while (struct dirent* dirp = readdir(dp))
+    {
+        addFile(dirp->d_name);
+    }
+    closedir(dp);
+}
+
+void CloudStream::addFile(const std::string& name)
+{
+    size_t index;
+    if (name == "done")
+    {
+        done = true;
+    }
+    else if (cloudIndex(name, index) && (!started || index >= next_index))
+    {
+        // The name is kept as it is, since the number may be written with leading zeros
+        last_arrival = Clock::now();
+        Arrival& arrival = arrived[index];
+        arrival.name = name;
+        arrival.time = last_arrival;
+    }
+}
+
+void CloudStream::readEvents(const int timeout_ms)
+{
+    struct pollfd pfd = {inotify_fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout_ms) <= 0)
+    {
+        return;
+    }
+    alignas(struct inotify_event) char buffer[4096];
+    ssize_t length;
+    while ((length = read(inotify_fd, buffer, sizeof(buffer))) > 0)
+    {
+        for (char* p = buffer; p < buffer + length; )
+        {
+            const struct inotify_event* event = reinterpret_cast<const struct inotify_event*>(p);
+            if (event->mask & IN_Q_OVERFLOW)
+            {
+                // Events were lost, so look at the directory itself
+                scanDirectory();
+            }
+            else if (event->len > 0)
+            {
+                addFile(event->name);
+            }
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+}
+
+void CloudStream::readPoses()
+{
+    // Picks up whatever rows have been appended since the last call
+    if (transform_file.empty())
+    {
+        return;
+    }
+    if (!poses.is_open())
+    {
+        poses.open(transform_file);
+        if (!poses)
+        {
+            poses.close();
+            return;
+        }
+    }
+    poses.clear();
+    std::string line;
+    while (std::getline(poses, line))
+    {
+        if (poses.eof())
+        {
+            // The writer is part way through this row; the rest of it comes with the next read
+            partial_line += line;
+            break;
+        }
+        line = partial_line + line;
+        partial_line.clear();
+        if (!header_read)
+        {
+            header_read = true;
+            continue;
+        }
+        if (line.empty())
+        {
+            continue;
+        }
+        try
+        {
+            pose_rows.push_back(parsePoseRow(line));
+        }
+        catch (const std::exception& e)
+        {
+            // A bad row must not end the flight; the row before it takes its place with no confidence, so the rows
+            // after it still line up with their clouds and this cloud's pose is trusted less
+            std::cerr << "Ignoring pose row " << pose_rows.size() + 1 << " of " << transform_file << ": "
+                      << e.what() << std::endl;
+            TransformData t = pose_rows.empty() ? TransformData() : pose_rows.back();
+            t.confidence = 0;
+            pose_rows.push_back(t);
+        }
+    }
+}
+
+bool CloudStream::poseFor(const size_t index, TransformData& t) const
+{
+    // The average of the cloud's readings, as for a complete transformations file
+    if (transform_file.empty())
+    {
+        t = TransformData();
+        return true;
+    }
+    const size_t first = (index - first_index) * rows_per_cloud;
+    if (pose_rows.size() < first + rows_per_cloud)
+    {
+        return false;
+    }
+    t = pose_rows[first];
+    for (int j = 1; j < rows_per_cloud; ++j)
+    {
+        t = t + pose_rows[first + j];
+    }
+    t.dx /= rows_per_cloud;
+    t.dy /= rows_per_cloud;
+    t.dz /= rows_per_cloud;
+    t.rotx /= rows_per_cloud;
+    t.roty /= rows_per_cloud;
+    t.rotz /= rows_per_cloud;
+    t.confidence /= rows_per_cloud;
+    return true;
+}
+
+void CloudStream::skipTo(const size_t index)
+{
+    num_skipped += index - next_index;
+    arrived.erase(arrived.begin(), arrived.lower_bound(index));
+    next_index = index;
+}
+
+bool CloudStream::next(Frame& frame, const Clock::duration& idle_timeout, const size_t max_backlog)
+{
+    while (true)
+    {
+        readPoses();
+        const Clock::time_point now = Clock::now();
+
+        // Whatever number the drone starts from, the first cloud to arrive is the first of the stream
+        if (!started && !arrived.empty())
+        {
+            first_index = next_index = arrived.begin()->first;
+            started = true;
+        }
+
+        // Falling too far behind; keep only the newest clouds
+        if (max_backlog > 0 && arrived.size() > max_backlog)
+        {
+            skipTo(std::prev(arrived.end(), max_backlog)->first);
+        }
+
+        if (!arrived.empty())
+        {
+            auto first = arrived.begin();
+            const bool waited = done || now - first->second.time >= max_wait;
+            if (first->first != next_index && waited)
+            {
+                // The clouds before it have not turned up in time
+                skipTo(first->first);
+            }
+            TransformData pose;
+            const bool have_pose = poseFor(next_index, pose);
+            if (first->first == next_index && (have_pose || waited))
+            {
+                if (!have_pose)
+                {
+                    // Carry on from the last pose, and let registration do all the work
+                    pose = last_pose;
+                    pose.confidence = 0;
+                }
+                frame.index = next_index;
+                frame.path = directory + "/" + first->second.name;
+                frame.transformation = pose;
+                frame.arrived = first->second.time;
+                last_pose = pose;
+                arrived.erase(first);
+                ++next_index;
+                return true;
+            }
+        }
+        else if (done)
+        {
+            return false;
+        }
+
+        if (idle_timeout > Clock::duration::zero() && now - last_arrival >= idle_timeout)
+        {
+            return false;
+        }
+        readEvents(50);
+    }
+}
+
+SnapshotWriter::SnapshotWriter(const std::string& path, const PCDFormat format)
+    : path(path), format(format), writer(&SnapshotWriter::work, this)
+{
+}
+
+SnapshotWriter::~SnapshotWriter()
+{
+    // Any snapshot already handed over is finished first
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    writer.join();
+}
+
+bool SnapshotWriter::publish(const PointCloudT& map)
+{
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        if (writing || pending)
+        {
+            return false;
+        }
+    }
+    // Only this thread hands over snapshots, so the copy can be made outside the lock
+    PointCloudT::Ptr copy (new PointCloudT(map));
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        pending = copy;
+    }
+    wake.notify_one();
+    return true;
+}
+
+void SnapshotWriter::work()
+{
+    while (true)
+    {
+        PointCloudT::Ptr cloud;
+        {
+            std::unique_lock<std::mutex> lock (mutex);
+            wake.wait(lock, [this]{ return stopping || pending; });
+            if (!pending)
+            {
+                return;
+            }
+            cloud.swap(pending);
+            writing = true;
+        }
+
+        const std::string temporary = path + ".tmp";
+        try
+        {
+            writePCD(temporary, *cloud, format);
+            if (std::rename(temporary.c_str(), path.c_str()) != 0)
+            {
+                throw std::runtime_error("Could not replace " + path + " with the new snapshot.");
+            }
+        }
+        catch (const std::exception& e)
+        {
+            std::cerr << e.what() << std::endl;
+        }
+
+        std::lock_guard<std::mutex> lock (mutex);
+        writing = false;
+    }
+}
@@ -0,0 +1,104 @@
+#ifndef CLOUD_STREAM_H
+#define CLOUD_STREAM_H
+
+#include <condition_variable>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include <stitched_cloud.h>
+
+// Clouds written into a directory while the drone is still flying, handed out in order as they arrive
+// Clouds are PCD<n>.pcd files, picked up through inotify once the writer closes them or renames them into place
+// Poses are rows appended to a transformations file in the format of registerClouds -t, 'rows_per_cloud' to each cloud
+// and matched to clouds by number as readTransformations does, counting from the first cloud to arrive
+// The stream ends once a file called "done" appears in the directory
+class CloudStream
+{
+public:
+    struct Frame
+    {
+        size_t index = 0;
+        std::string path;
+        TransformData transformation;
+        Clock::time_point arrived;      // When the cloud was complete on disk
+    };
+
+    // A frame is held back for at most 'max_wait' while its poses, or an earlier missing cloud, are still to come
+    // Past that it goes ahead with the last known pose (with no confidence) or the missing cloud is skipped
+    CloudStream(const std::string& directory, const std::string& transform_file, const int rows_per_cloud = 10,
+                const Clock::duration& max_wait = std::chrono::seconds(1));
+    ~CloudStream();
+    CloudStream(const CloudStream&) = delete;
+    CloudStream& operator=(const CloudStream&) = delete;
+
+    // Blocks until the next frame is ready and returns true, or returns false once the stream has ended
+    // or nothing has arrived for 'idle_timeout' (zero waits indefinitely)
+    // When more than 'max_backlog' clouds are waiting the oldest are skipped, bounding how far behind the stream
+    // processing can fall (zero never skips)
+    bool next(Frame& frame, const Clock::duration& idle_timeout, const size_t max_backlog);
+
+    size_t skipped() const { return num_skipped; }
+
+private:
+    void scanDirectory();
+    void readEvents(const int timeout_ms);
+    void addFile(const std::string& name);
+    void readPoses();
+    bool poseFor(const size_t index, TransformData& t) const;
+    void skipTo(const size_t index);
+
+    std::string directory;
+    std::string transform_file;
+    int rows_per_cloud;
+    Clock::duration max_wait;
+
+    int inotify_fd = -1;
+    bool done = false;
+    struct Arrival
+    {
+        std::string name;
+        Clock::time_point time;
+    };
+    std::map<size_t, Arrival> arrived;  // Clouds on disk that have not been handed out, by index
+    bool started = false;               // Whether the first cloud has arrived and set where the numbering starts
+    size_t first_index = 0;
+    size_t next_index = 0;
+    size_t num_skipped = 0;
+    TransformData last_pose;
+    Clock::time_point last_arrival;
+
+    std::ifstream poses;
+    std::string partial_line;       // Last row read, if the writer had not finished it
+    bool header_read = false;
+    std::vector<TransformData> pose_rows;
+};
+
+// Publishes copies of the map to a PCD file on a background thread, so writing never holds up registration
+// The file is written under a temporary name and renamed over the last snapshot, so readers always see a complete cloud
+class SnapshotWriter
+{
+public:
+    SnapshotWriter(const std::string& path, const PCDFormat format);
+    ~SnapshotWriter();
+
+    // Starts writing a copy of 'map', unless the previous snapshot is still being written
+    // Returns whether a snapshot was started
+    bool publish(const PointCloudT& map);
+
+private:
+    void work();
+
+    std::string path;
+    PCDFormat format;
+    std::mutex mutex;
+    std::condition_variable wake;
+    PointCloudT::Ptr pending;
+    bool writing = false;
+    bool stopping = false;
+    std::thread writer;
+};
+
+#endif
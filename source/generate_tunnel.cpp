@@ -0,0 +1,67 @@
+#include <iostream>
+
+#include <sys/stat.h>
+
+#include "tunnel_generator.h"
+
+void helpMessage();
+
+// Writes a synthetic tunnel dataset that registerClouds can process:
+// PCD<i>.pcd for each frame, transforms.txt with noisy poses and ground_truth.txt with the true ones
+int main(int argc, char** argv)
+{
+    if (argc < 2)
+    {
+        helpMessage();
+        return -1;
+    }
+    std::string directory = argv[1];
+
+    TunnelParameters params;
+    for (int i = 2; i < argc; i += 2)
+    {
+        if (i + 1 >= argc)
+        {
+            std::cout << "Command \"" << argv[i] << "\" is missing a value." << std::endl;
+            helpMessage();
+            return -1;
+        }
+        if (!std::strcmp(argv[i], "-n"))
+        {
+            params.num_frames = std::stoul(argv[i+1]);
+        }
+        else if (!std::strcmp(argv[i], "-p"))
+        {
+            params.points_per_frame = std::stoul(argv[i+1]);
+        }
+        else if (!std::strcmp(argv[i], "-s"))
+        {
+            params.seed = std::stoul(argv[i+1]);
+        }
+        else if (!std::strcmp(argv[i], "-e"))
+        {
+            params.prior_noise = std::stod(argv[i+1]);
+        }
+        else
+        {
+            std::cout << "Command \"" << argv[i] << "\" not recognised." << std::endl;
+            helpMessage();
+            return -1;
+        }
+    }
+
+    mkdir(directory.c_str(), 0755);
+    writeTunnelDataset(params, directory);
+    std::cout << "Wrote " << params.num_frames << " clouds of " << params.points_per_frame << " points to " << directory << std::endl;
+    return 0;
+}
+
+void helpMessage()
+{
+    std::cout << "Usage: generateTunnel <directory> [options]\n"
+              << "\t-n <frames>" << "\t\tNumber of clouds to generate. (OPTIONAL)\n"
+              << "\t-p <points>" << "\t\tPoints in each cloud. (OPTIONAL)\n"
+              << "\t-s <seed>" << "\t\tRandom seed; the same seed always gives the same dataset. (OPTIONAL)\n"
+              << "\t-e <noise>" << "\t\tStandard deviation of the error in the supplied translations. (OPTIONAL)"
+              << std::endl;
+}
@@ -0,0 +1,97 @@
+#include <ingest_pipeline.h>
+
+IngestPipeline::IngestPipeline(const size_t first, const size_t last, PrepareFunction prepare, const int num_workers, const size_t max_ahead)
+    : last(last), max_ahead(std::max<size_t>(max_ahead, 1)), prepare(prepare), next_to_claim(first), next_to_consume(first)
+{
+    for (int i = 0; i < num_workers; ++i)
+    {
+        workers.push_back(std::thread(&IngestPipeline::work, this));
+    }
+}
+
+IngestPipeline::~IngestPipeline()
+{
+    {
+        std::lock_guard<std::mutex> lock (mutex);
+        stopping = true;
+    }
+    space.notify_all();
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void IngestPipeline::work()
+{
+    while (true)
+    {
+        // Claim the next cloud once it is within max_ahead of the consumer
+        size_t index;
+        {
+            std::unique_lock<std::mutex> lock (mutex);
+            space.wait(lock, [this]{ return stopping || next_to_claim >= last || next_to_claim < next_to_consume + max_ahead; });
+            if (stopping || next_to_claim >= last)
+            {
+                return;
+            }
+            index = next_to_claim++;
+        }
+
+        PointCloudT::Ptr cloud = pool.acquire();
+        std::exception_ptr error;
+        try
+        {
+            prepare(index, cloud);
+        }
+        catch (...)
+        {
+            error = std::current_exception();
+        }
+
+        {
+            std::lock_guard<std::mutex> lock (mutex);
+            if (error)
+            {
+                failed[index] = error;
+            }
+            else
+            {
+                prepared[index] = cloud;
+            }
+        }
+        ready.notify_all();
+    }
+}
+
+PointCloudT::Ptr IngestPipeline::next()
+{
+    if (next_to_consume >= last)
+    {
+        return PointCloudT::Ptr();
+    }
+
+    if (workers.empty())
+    {
+        PointCloudT::Ptr cloud = pool.acquire();
+        prepare(next_to_consume++, cloud);
+        return cloud;
+    }
+
+    std::unique_lock<std::mutex> lock (mutex);
+    const size_t index = next_to_consume;
+    ready.wait(lock, [this, index]{ return prepared.count(index) || failed.count(index); });
+
+    ++next_to_consume;
+    space.notify_all();
+    auto error = failed.find(index);
+    if (error != failed.end())
+    {
+        std::exception_ptr e = error->second;
+        failed.erase(error);
+        std::rethrow_exception(e);
+    }
+    PointCloudT::Ptr cloud = prepared[index];
+    prepared.erase(index);
+    return cloud;
+}
@@ -0,0 +1,57 @@
+#ifndef INGEST_PIPELINE_H
+#define INGEST_PIPELINE_H
+
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include <cloud_pool.h>
+
+typedef pcl::PointXYZ PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+
+// Bounded producer/consumer pipeline that loads and preprocesses clouds ahead of registration
+// Worker threads prepare up to 'max_ahead' clouds beyond the one being consumed, while next()
+// hands them out strictly in order so that stitching stays deterministic
+// Clouds come from a pool, so once the consumer lets go of one its storage is used for a later cloud
+class IngestPipeline
+{
+public:
+    // Fills 'cloud' with the prepared cloud for item 'index'
+    typedef std::function<void(const size_t index, PointCloudT::Ptr cloud)> PrepareFunction;
+
+    // With no workers each cloud is prepared on the calling thread inside next()
+    IngestPipeline(const size_t first, const size_t last, PrepareFunction prepare, const int num_workers, const size_t max_ahead);
+    ~IngestPipeline();
+
+    // Blocks until the next cloud in order is ready; returns a null pointer once every cloud has been handed out
+    // Rethrows anything thrown while preparing that cloud
+    PointCloudT::Ptr next();
+
+private:
+    void work();
+
+    const size_t last;
+    const size_t max_ahead;
+    PrepareFunction prepare;
+
+    std::mutex mutex;
+    std::condition_variable ready;      // Signalled when a cloud has been prepared
+    std::condition_variable space;      // Signalled when a cloud has been consumed
+    size_t next_to_claim;
+    size_t next_to_consume;
+    bool stopping = false;
+    std::map<size_t, PointCloudT::Ptr> prepared;
+    std::map<size_t, std::exception_ptr> failed;
+    CloudPool<PointT> pool;
+    std::vector<std::thread> workers;
+};
+
+#endif
@@ -0,0 +1,122 @@
+#include <instrumentation.h>
+
+#include <sys/resource.h>
+
+#include <fstream>
+#include <stdexcept>
+
+namespace
+{
+    // Stage timings, in column order
+    struct StageColumn
+    {
+        const char* name;
+        Seconds StageTimes::* time;
+    };
+    const StageColumn stage_columns[] =
+    {
+        {"read_s", &StageTimes::read_time},
+        {"write_s", &StageTimes::write_time},
+        {"nan_s", &StageTimes::nan_time},
+        {"transform_s", &StageTimes::transform_time},
+        {"passthrough_s", &StageTimes::passthrough_time},
+        {"downsample_s", &StageTimes::downsample_time},
+        {"sor_s", &StageTimes::sor_time},
+        {"normal_s", &StageTimes::normal_time},
+        {"icp_s", &StageTimes::icp_time},
+        {"sac_s", &StageTimes::sac_time},
+        {"smooth_s", &StageTimes::smooth_time}
+    };
+
+    void openStats(std::ofstream& out, const std::string& path)
+    {
+        out.open(path);
+        if (!out)
+        {
+            throw std::runtime_error("Could not open " + path + " for writing.");
+        }
+        out.precision(9);
+    }
+}
+
+long peakRSS()
+{
+    // Linux reports ru_maxrss in kilobytes
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+    {
+        return 0;
+    }
+    return usage.ru_maxrss;
+}
+
+void writeCloudStats(const std::string& path, const std::vector<CloudStats>& stats)
+{
+    const std::string extension = ".json";
+    if (path.size() >= extension.size() && !path.compare(path.size() - extension.size(), extension.size(), extension))
+    {
+        writeCloudStatsJSON(path, stats);
+    }
+    else
+    {
+        writeCloudStatsCSV(path, stats);
+    }
+}
+
+void writeCloudStatsCSV(const std::string& path, const std::vector<CloudStats>& stats)
+{
+    std::ofstream out;
+    openStats(out, path);
+    out << "index";
+    for (const StageColumn& column : stage_columns)
+    {
+        out << "," << column.name;
+    }
+    out << ",wait_s,frame_s,latency_s"
+        << ",points_read,points_finite,points_in_range,points_downsampled,points_preprocessed"
+        << ",icp_iterations,icp_fitness,icp_converged"
+        << ",map_outliers,map_smoothed,map_flushed,map_points,peak_rss_kb\n";
+
+    for (const CloudStats& s : stats)
+    {
+        out << s.index;
+        for (const StageColumn& column : stage_columns)
+        {
+            out << "," << (s.times.*column.time).count();
+        }
+        out << "," << s.wait_time.count() << "," << s.frame_time.count() << "," << s.latency.count()
+            << "," << s.points_read << "," << s.points_finite << "," << s.points_in_range
+            << "," << s.points_downsampled << "," << s.points_preprocessed
+            << "," << s.icp_iterations << "," << s.icp_fitness << "," << s.icp_converged
+            << "," << s.map_outliers << "," << s.map_smoothed << "," << s.map_flushed << "," << s.map_points
+            << "," << s.peak_rss_kb << "\n";
+    }
+}
+
+void writeCloudStatsJSON(const std::string& path, const std::vector<CloudStats>& stats)
+{
+    // An array of flat objects, one per cloud, with the same fields as the CSV columns
+    std::ofstream out;
+    openStats(out, path);
+    out << "[";
+    for (size_t i = 0; i < stats.size(); ++i)
+    {
+        const CloudStats& s = stats[i];
+        out << (i ? ",\n " : "\n ") << "{\"index\": " << s.index;
+        for (const StageColumn& column : stage_columns)
+        {
+            out << ", \"" << column.name << "\": " << (s.times.*column.time).count();
+        }
+        out << ", \"wait_s\": " << s.wait_time.count() << ", \"frame_s\": " << s.frame_time.count()
+            << ", \"latency_s\": " << s.latency.count()
+            << ", \"points_read\": " << s.points_read << ", \"points_finite\": " << s.points_finite
+            << ", \"points_in_range\": " << s.points_in_range << ", \"points_downsampled\": " << s.points_downsampled
+            << ", \"points_preprocessed\": " << s.points_preprocessed
+            << ", \"icp_iterations\": " << s.icp_iterations << ", \"icp_fitness\": " << s.icp_fitness
+            << ", \"icp_converged\": " << (s.icp_converged ? "true" : "false")
+            << ", \"map_outliers\": " << s.map_outliers << ", \"map_smoothed\": " << s.map_smoothed
+            << ", \"map_flushed\": " << s.map_flushed << ", \"map_points\": " << s.map_points
+            << ", \"peak_rss_kb\": " << s.peak_rss_kb << "}";
+    }
+    out << "\n]\n";
+}
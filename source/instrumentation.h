@@ -0,0 +1,73 @@
+#ifndef INSTRUMENTATION_H
+#define INSTRUMENTATION_H
+
+#include <chrono>
+#include <string>
+#include <vector>
+
+// Clock used for every timing; monotonic, so timings are unaffected by changes to the system time
+typedef std::chrono::steady_clock Clock;
+typedef std::chrono::duration<double> Seconds;
+
+// Time spent in each processing stage
+struct StageTimes
+{
+    Seconds read_time {0};
+    Seconds write_time {0};
+    Seconds nan_time {0};
+    Seconds downsample_time {0};
+    Seconds sor_time {0};
+    Seconds transform_time {0};
+    Seconds passthrough_time {0};
+    Seconds normal_time {0};
+    Seconds icp_time {0};
+    Seconds sac_time {0};
+    Seconds smooth_time {0};
+
+    Seconds sum() const
+    {
+        return read_time + write_time + nan_time + downsample_time + sor_time + transform_time + passthrough_time
+             + normal_time + icp_time + sac_time + smooth_time;
+    }
+};
+
+// Everything measured while one input cloud was processed
+// Counts are zero for steps a cloud did not go through
+struct CloudStats
+{
+    size_t index = 0;
+    StageTimes times;
+    Seconds wait_time {0};          // Spent waiting for the cloud to be read and preprocessed
+    Seconds frame_time {0};         // Spent registering and integrating the cloud once it was ready
+    Seconds latency {0};            // When streaming, from the cloud arriving on disk to it being in the map
+
+    // Input cloud through preprocessing
+    size_t points_read = 0;
+    size_t points_finite = 0;
+    size_t points_in_range = 0;
+    size_t points_downsampled = 0;
+    size_t points_preprocessed = 0;     // After outlier removal
+
+    // Registration
+    int icp_iterations = 0;
+    double icp_fitness = 0;
+    bool icp_converged = false;
+
+    // Stitched map
+    size_t map_outliers = 0;        // Removed by outlier removal after the cloud was added
+    size_t map_smoothed = 0;        // Points passed through surface smoothing
+    size_t map_flushed = 0;         // Moved out to disk as finished tiles
+    size_t map_points = 0;          // Held in memory once the cloud was integrated
+
+    long peak_rss_kb = 0;           // Peak resident set size of the process so far
+};
+
+// Peak resident set size of this process, in kilobytes
+long peakRSS();
+
+// One row or object per cloud; the format is picked from the extension of 'path' (.json, otherwise CSV)
+void writeCloudStats(const std::string& path, const std::vector<CloudStats>& stats);
+void writeCloudStatsCSV(const std::string& path, const std::vector<CloudStats>& stats);
+void writeCloudStatsJSON(const std::string& path, const std::vector<CloudStats>& stats);
+
+#endif
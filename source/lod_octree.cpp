@@ -0,0 +1,461 @@
+#include <lod_octree.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <limits>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+#include <sys/stat.h>
+
+namespace
+{
+    const int sample_bits = 7;      // Each node samples its points on a grid of 2^7 cells a side
+    const int count_level = 7;      // Level of the grid the points are counted on to cut the cube into chunks
+    const int max_level = 24;       // Nodes this deep keep all of their points
+    const size_t block_size = 65536;
+    const size_t chunk_buffer_points = 1 << 22;     // Points held back for all the chunk files together
+
+    uint64_t cellKey(const int level, const uint32_t x, const uint32_t y, const uint32_t z)
+    {
+        return static_cast<uint64_t>(level) << 60 | static_cast<uint64_t>(x) << 40 | static_cast<uint64_t>(y) << 20 | z;
+    }
+
+    void writePoints(FILE* file, const PointT* points, const size_t count, std::vector<float>& buffer)
+    {
+        buffer.resize(3 * count);
+        for (size_t i = 0; i < count; ++i)
+        {
+            buffer[3 * i] = points[i].x;
+            buffer[3 * i + 1] = points[i].y;
+            buffer[3 * i + 2] = points[i].z;
+        }
+        if (std::fwrite(buffer.data(), sizeof(float), buffer.size(), file) != buffer.size())
+        {
+            throw std::runtime_error("Could not write octree points.");
+        }
+    }
+
+    // Reads up to 'count' points from 'file'; returns the number read
+    size_t readPoints(FILE* file, std::vector<PointT>& points, const size_t count, std::vector<float>& buffer)
+    {
+        buffer.resize(3 * count);
+        const size_t read = std::fread(buffer.data(), 3 * sizeof(float), count, file);
+        points.resize(read);
+        for (size_t i = 0; i < read; ++i)
+        {
+            points[i] = PointT(buffer[3 * i], buffer[3 * i + 1], buffer[3 * i + 2]);
+        }
+        return read;
+    }
+}
+
+LodOctreeWriter::LodOctreeWriter(const std::string& directory, const size_t max_node_points, const int num_threads)
+    : directory(directory), max_node_points(std::max<size_t>(max_node_points, 1)), num_threads(std::max(num_threads, 1)),
+      lo(Eigen::Vector3f::Constant(std::numeric_limits<float>::max())),
+      hi(Eigen::Vector3f::Constant(std::numeric_limits<float>::lowest()))
+{
+    mkdir(directory.c_str(), 0755);
+    spill = std::fopen((directory + "/points.tmp").c_str(), "w+b");
+    if (!spill)
+    {
+        throw std::runtime_error("Could not create " + directory + "/points.tmp.");
+    }
+}
+
+LodOctreeWriter::~LodOctreeWriter()
+{
+    if (spill)
+    {
+        std::fclose(spill);
+        std::remove((directory + "/points.tmp").c_str());
+    }
+}
+
+void LodOctreeWriter::add(const PointT* points, const size_t count)
+{
+    std::vector<PointT> finite;
+    finite.reserve(count);
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (std::isfinite(points[i].x) && std::isfinite(points[i].y) && std::isfinite(points[i].z))
+        {
+            finite.push_back(points[i]);
+            lo = lo.cwiseMin(points[i].getVector3fMap());
+            hi = hi.cwiseMax(points[i].getVector3fMap());
+        }
+    }
+    std::vector<float> buffer;
+    writePoints(spill, finite.data(), finite.size(), buffer);
+    num_points += finite.size();
+}
+
+double LodOctreeWriter::cellCoordinate(const float value, const int axis, const int level) const
+{
+    // Position along 'axis' in cells of 'level', which has 2^level cells a side
+    return (value - cube_min[axis]) / cube_size * static_cast<double>(1u << level);
+}
+
+LodOctreeWriter::Cell LodOctreeWriter::cellOf(const PointT& p, const int level) const
+{
+    const double last = (1u << level) - 1;
+    Cell cell;
+    cell.level = level;
+    cell.x = std::min(std::max(std::floor(cellCoordinate(p.x, 0, level)), 0.0), last);
+    cell.y = std::min(std::max(std::floor(cellCoordinate(p.y, 1, level)), 0.0), last);
+    cell.z = std::min(std::max(std::floor(cellCoordinate(p.z, 2, level)), 0.0), last);
+    return cell;
+}
+
+void LodOctreeWriter::writeNode(const std::string& name, const std::vector<PointT>& points) const
+{
+    FILE* file = std::fopen((directory + "/" + name + ".bin").c_str(), "wb");
+    if (!file)
+    {
+        throw std::runtime_error("Could not create octree node " + directory + "/" + name + ".bin.");
+    }
+    std::vector<float> buffer;
+    writePoints(file, points.data(), points.size(), buffer);
+    std::fclose(file);
+}
+
+void LodOctreeWriter::buildChunk(const std::string& name, const Cell& cell, std::vector<PointT>& points,
+                                 std::vector<NodeInfo>& nodes) const
+{
+    NodeInfo info;
+    info.name = name;
+    info.level = cell.level;
+    if (points.size() <= max_node_points || cell.level >= max_level)
+    {
+        writeNode(name, points);
+        info.count = points.size();
+        nodes.push_back(info);
+        return;
+    }
+
+    // The first point in each cell of the node's sampling grid stays here; the rest go on to the children
+    std::vector<std::pair<uint32_t, uint32_t> > keys (points.size());
+    for (size_t j = 0; j < points.size(); ++j)
+    {
+        const Cell s = cellOf(points[j], cell.level + sample_bits);
+        const uint32_t key = (s.x - (cell.x << sample_bits)) << (2 * sample_bits) |
+                             (s.y - (cell.y << sample_bits)) << sample_bits | (s.z - (cell.z << sample_bits));
+        keys[j] = std::make_pair(key, j);
+    }
+    std::sort(keys.begin(), keys.end());
+    std::vector<PointT> kept;
+    std::vector<PointT> children[8];
+    for (size_t j = 0; j < keys.size(); ++j)
+    {
+        const PointT& p = points[keys[j].second];
+        if (j == 0 || keys[j].first != keys[j - 1].first)
+        {
+            kept.push_back(p);
+            continue;
+        }
+        const Cell c = cellOf(p, cell.level + 1);
+        children[(c.x & 1) << 2 | (c.y & 1) << 1 | (c.z & 1)].push_back(p);
+    }
+    writeNode(name, kept);
+    info.count = kept.size();
+    nodes.push_back(info);
+
+    // Let go of this level before going down to the next
+    std::vector<PointT>().swap(points);
+    std::vector<std::pair<uint32_t, uint32_t> >().swap(keys);
+    for (int i = 0; i < 8; ++i)
+    {
+        if (children[i].empty())
+        {
+            continue;
+        }
+        Cell child;
+        child.level = cell.level + 1;
+        child.x = 2 * cell.x + (i >> 2 & 1);
+        child.y = 2 * cell.y + (i >> 1 & 1);
+        child.z = 2 * cell.z + (i & 1);
+        buildChunk(name + static_cast<char>('0' + i), child, children[i], nodes);
+    }
+}
+
+void LodOctreeWriter::close()
+{
+    if (!spill)
+    {
+        return;
+    }
+    std::fflush(spill);
+    std::vector<NodeInfo> nodes;
+    if (num_points == 0)
+    {
+        std::fclose(spill);
+        spill = nullptr;
+        std::remove((directory + "/points.tmp").c_str());
+        writeIndex(nodes);
+        return;
+    }
+    // A cube around the points, a little larger so the highest points fall inside the last cell
+    cube_min = lo.cast<double>();
+    cube_size = std::max(1e-3, 1.000001 * static_cast<double>((hi - lo).maxCoeff()));
+
+    // Count the points on a coarse grid, and add the counts up level by level to the root
+    std::vector<std::vector<uint32_t> > counts (count_level + 1);
+    for (int level = 0; level <= count_level; ++level)
+    {
+        counts[level].assign(static_cast<size_t>(1) << (3 * level), 0);
+    }
+    auto flatIndex = [](const Cell& c)
+    {
+        return (static_cast<size_t>(c.x) << (2 * c.level)) | (static_cast<size_t>(c.y) << c.level) | c.z;
+    };
+    std::vector<PointT> block;
+    std::vector<float> buffer;
+    std::rewind(spill);
+    while (readPoints(spill, block, block_size, buffer) > 0)
+    {
+        for (const PointT& p : block)
+        {
+            ++counts[count_level][flatIndex(cellOf(p, count_level))];
+        }
+    }
+    for (int level = count_level; level > 0; --level)
+    {
+        const uint32_t side = 1u << level;
+        for (uint32_t x = 0; x < side; ++x)
+        {
+            for (uint32_t y = 0; y < side; ++y)
+            {
+                for (uint32_t z = 0; z < side; ++z)
+                {
+                    const Cell c {level, x, y, z};
+                    const Cell parent {level - 1, x / 2, y / 2, z / 2};
+                    counts[level - 1][flatIndex(parent)] += counts[level][flatIndex(c)];
+                }
+            }
+        }
+    }
+
+    // Cells with few enough points become chunks, each built in memory on its own; the nodes above them are
+    // sampled from every point as the points are sorted into chunks
+    struct UpperNode
+    {
+        std::string name;
+        Cell cell;
+        std::vector<uint64_t> taken;    // One bit per cell of the sampling grid, 256 KiB
+        std::vector<PointT> points;
+    };
+    struct Chunk
+    {
+        std::string name;
+        Cell cell;
+        std::string file;
+        std::vector<PointT> buffer;
+    };
+    std::vector<UpperNode> upper;
+    std::vector<Chunk> chunks;
+    std::unordered_map<uint64_t, size_t> upper_of;
+    std::unordered_map<uint64_t, size_t> chunk_of;
+    const size_t chunk_limit = std::max<size_t>(1 << 20, 8 * max_node_points);
+    std::function<void(const std::string&, const Cell&)> split = [&](const std::string& name, const Cell& cell)
+    {
+        const uint32_t count = counts[cell.level][flatIndex(cell)];
+        if (count == 0)
+        {
+            return;
+        }
+        const uint64_t key = cellKey(cell.level, cell.x, cell.y, cell.z);
+        if (count <= chunk_limit || cell.level == count_level)
+        {
+            chunk_of[key] = chunks.size();
+            chunks.push_back(Chunk());
+            chunks.back().name = name;
+            chunks.back().cell = cell;
+            chunks.back().file = directory + "/chunk_" + std::to_string(chunk_of[key]) + ".tmp";
+            std::remove(chunks.back().file.c_str());
+            return;
+        }
+        upper_of[key] = upper.size();
+        upper.push_back(UpperNode());
+        upper.back().name = name;
+        upper.back().cell = cell;
+        upper.back().taken.assign((static_cast<size_t>(1) << (3 * sample_bits)) / 64, 0);
+        for (int i = 0; i < 8; ++i)
+        {
+            const Cell child {cell.level + 1, 2 * cell.x + (i >> 2 & 1), 2 * cell.y + (i >> 1 & 1), 2 * cell.z + (i & 1)};
+            split(name + static_cast<char>('0' + i), child);
+        }
+    };
+    split("r", Cell {0, 0, 0, 0});
+
+    auto flushChunk = [&](Chunk& chunk)
+    {
+        FILE* file = std::fopen(chunk.file.c_str(), "ab");
+        if (!file)
+        {
+            throw std::runtime_error("Could not write " + chunk.file + ".");
+        }
+        writePoints(file, chunk.buffer.data(), chunk.buffer.size(), buffer);
+        std::fclose(file);
+        std::vector<PointT>().swap(chunk.buffer);
+    };
+    // However many chunks there are, only so many points wait in memory before every buffer goes to its file
+    size_t buffered = 0;
+    auto flushChunks = [&]()
+    {
+        for (Chunk& chunk : chunks)
+        {
+            if (!chunk.buffer.empty())
+            {
+                flushChunk(chunk);
+            }
+        }
+        buffered = 0;
+    };
+    std::rewind(spill);
+    while (readPoints(spill, block, block_size, buffer) > 0)
+    {
+        for (const PointT& p : block)
+        {
+            const Cell fine = cellOf(p, count_level);
+            for (int level = 0; level <= count_level; ++level)
+            {
+                const int shift = count_level - level;
+                const uint64_t key = cellKey(level, fine.x >> shift, fine.y >> shift, fine.z >> shift);
+                auto chunk = chunk_of.find(key);
+                if (chunk != chunk_of.end())
+                {
+                    chunks[chunk->second].buffer.push_back(p);
+                    if (++buffered >= chunk_buffer_points)
+                    {
+                        flushChunks();
+                    }
+                    break;
+                }
+                UpperNode& node = upper[upper_of.at(key)];
+                const Cell s = cellOf(p, level + sample_bits);
+                const uint32_t sample = (s.x - (node.cell.x << sample_bits)) << (2 * sample_bits) |
+                                        (s.y - (node.cell.y << sample_bits)) << sample_bits |
+                                        (s.z - (node.cell.z << sample_bits));
+                uint64_t& word = node.taken[sample / 64];
+                const uint64_t bit = static_cast<uint64_t>(1) << (sample % 64);
+                if (!(word & bit))
+                {
+                    word |= bit;
+                    node.points.push_back(p);
+                    break;
+                }
+            }
+        }
+    }
+    flushChunks();
+    std::fclose(spill);
+    spill = nullptr;
+    std::remove((directory + "/points.tmp").c_str());
+
+    for (UpperNode& node : upper)
+    {
+        writeNode(node.name, node.points);
+        NodeInfo info;
+        info.name = node.name;
+        info.level = node.cell.level;
+        info.count = node.points.size();
+        nodes.push_back(info);
+        std::vector<PointT>().swap(node.points);
+        std::vector<uint64_t>().swap(node.taken);
+    }
+
+    // Chunks are independent, so each thread builds whichever chunk is next until there are none left
+    std::atomic<size_t> next_chunk (0);
+    std::vector<std::vector<NodeInfo> > chunk_nodes (num_threads);
+    std::vector<std::string> errors (num_threads);
+    auto work = [&](const int t)
+    {
+        try
+        {
+            std::vector<PointT> points;
+            std::vector<float> chunk_buffer;
+            for (size_t i = next_chunk++; i < chunks.size(); i = next_chunk++)
+            {
+                FILE* file = std::fopen(chunks[i].file.c_str(), "rb");
+                if (!file)
+                {
+                    throw std::runtime_error("Could not read " + chunks[i].file + ".");
+                }
+                std::vector<PointT> part;
+                points.clear();
+                while (readPoints(file, part, block_size, chunk_buffer) > 0)
+                {
+                    points.insert(points.end(), part.begin(), part.end());
+                }
+                std::fclose(file);
+                std::remove(chunks[i].file.c_str());
+                buildChunk(chunks[i].name, chunks[i].cell, points, chunk_nodes[t]);
+            }
+        }
+        catch (const std::exception& e)
+        {
+            errors[t] = e.what();
+        }
+    };
+    std::vector<std::thread> workers;
+    const int threads = std::min<size_t>(num_threads, chunks.size());
+    for (int t = 1; t < threads; ++t)
+    {
+        workers.push_back(std::thread(work, t));
+    }
+    work(0);
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+    for (int t = 0; t < num_threads; ++t)
+    {
+        if (!errors[t].empty())
+        {
+            throw std::runtime_error(errors[t]);
+        }
+        nodes.insert(nodes.end(), chunk_nodes[t].begin(), chunk_nodes[t].end());
+    }
+    writeIndex(nodes);
+}
+
+void LodOctreeWriter::writeIndex(std::vector<NodeInfo>& nodes) const
+{
+    // Breadth first, so a client can read as far down the index as the levels it wants
+    std::sort(nodes.begin(), nodes.end(), [](const NodeInfo& a, const NodeInfo& b)
+    {
+        return a.level != b.level ? a.level < b.level : a.name < b.name;
+    });
+
+    std::ofstream out (directory + "/index.json");
+    if (!out)
+    {
+        throw std::runtime_error("Could not create " + directory + "/index.json.");
+    }
+    out << std::setprecision(9);
+    out << "{\n"
+        << "  \"version\": 1,\n"
+        << "  \"points\": " << num_points << ",\n"
+        << "  \"encoding\": \"float32 x, y, z, little endian\",\n"
+        << "  \"cube\": {\"min\": [" << cube_min[0] << ", " << cube_min[1] << ", " << cube_min[2] << "], \"size\": "
+        << cube_size << "},\n";
+    if (num_points > 0)
+    {
+        out << "  \"bounds\": {\"min\": [" << lo[0] << ", " << lo[1] << ", " << lo[2] << "], \"max\": ["
+            << hi[0] << ", " << hi[1] << ", " << hi[2] << "]},\n";
+    }
+    out << "  \"spacing\": " << cube_size / (1 << sample_bits) << ",\n"
+        << "  \"max_node_points\": " << max_node_points << ",\n"
+        << "  \"nodes\": [";
+    for (size_t i = 0; i < nodes.size(); ++i)
+    {
+        out << (i ? ",\n" : "\n") << "    {\"name\": \"" << nodes[i].name << "\", \"level\": " << nodes[i].level
+            << ", \"points\": " << nodes[i].count << "}";
+    }
+    out << "\n  ]\n}\n";
+}
@@ -0,0 +1,75 @@
+#ifndef LOD_OCTREE_H
+#define LOD_OCTREE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+typedef pcl::PointXYZ PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+
+// Writes a cloud as a multi-resolution octree, so viewers can show the coarse levels at once and page in detail
+// as they need it, rather than loading the whole map first
+// As in Potree, each node holds a subsample of the points below it, at most one point per cell of a 128^3 grid over
+// the node, and passes the rest on to its eight children; a node with few enough points keeps them all
+// Every node is its own file of float32 x, y, z triples named after its path from the root ("r", "r0", "r07", ...,
+// where the digit of a child is 4x + 2y + z); index.json lists the nodes breadth first with their point counts and
+// gives the bounding cube they divide
+// Points are streamed in with add() and spilled to disk, so the cloud never has to be held in memory as a whole;
+// close() then counts them on a coarse grid, splits the cube into chunks small enough to build in memory, and builds
+// the chunks on several threads
+class LodOctreeWriter
+{
+public:
+    // 'directory' is created if it does not exist
+    // A node of more than 'max_node_points' points is split; the nodes above the leaves hold one sample per grid cell,
+    // however many that comes to
+    LodOctreeWriter(const std::string& directory, const size_t max_node_points = 20000, const int num_threads = 1);
+    ~LodOctreeWriter();
+    LodOctreeWriter(const LodOctreeWriter&) = delete;
+    LodOctreeWriter& operator=(const LodOctreeWriter&) = delete;
+
+    void add(const PointT* points, const size_t count);
+    void add(const PointCloudT& cloud) { add(cloud.points.data(), cloud.size()); }
+    // Builds the octree and writes the nodes and the index
+    void close();
+
+    size_t size() const { return num_points; }
+
+private:
+    struct NodeInfo
+    {
+        std::string name;
+        int level;
+        size_t count;
+    };
+    struct Cell
+    {
+        int level;
+        uint32_t x, y, z;
+    };
+
+    double cellCoordinate(const float value, const int axis, const int level) const;
+    Cell cellOf(const PointT& p, const int level) const;
+    void writeNode(const std::string& name, const std::vector<PointT>& points) const;
+    void buildChunk(const std::string& name, const Cell& cell, std::vector<PointT>& points, std::vector<NodeInfo>& nodes) const;
+    void writeIndex(std::vector<NodeInfo>& nodes) const;
+
+    std::string directory;
+    size_t max_node_points;
+    int num_threads;
+    FILE* spill = nullptr;
+    size_t num_points = 0;
+    Eigen::Vector3f lo;
+    Eigen::Vector3f hi;
+    Eigen::Vector3d cube_min;
+    double cube_size = 1;
+};
+
+#endif
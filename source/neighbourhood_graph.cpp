@@ -0,0 +1,304 @@
+#include <neighbourhood_graph.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#include <numeric>
+#include <thread>
+
+#include <voxel_hash_index.h>
+
+int NeighbourhoodGraph::threadsFor(const size_t count) const
+{
+    // Each row is a full k-nearest search, so even fairly small clouds are worth splitting
+    const size_t min_per_thread = 512;
+    return std::max<int>(1, std::min<size_t>(num_threads, count / min_per_thread));
+}
+
+template <typename Function>
+void NeighbourhoodGraph::parallelFor(const int threads, const size_t count, Function function) const
+{
+    // Splits [0, count) into one contiguous range per thread and calls function(begin, end)
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; ++t)
+    {
+        workers.push_back(std::thread(function, count * t / threads, count * (t + 1) / threads));
+    }
+    function(0, count / threads);
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void NeighbourhoodGraph::build(const PointCloudT::ConstPtr& cloud, const pcl::search::Search<PointT>& search, const int k)
+{
+    input = cloud;
+    max_k = std::max(k, 1);
+    points.resize(cloud->size());
+    std::iota(points.begin(), points.end(), 0);
+    findNeighbours(search);
+}
+
+void NeighbourhoodGraph::build(const PointCloudT::ConstPtr& cloud, const pcl::search::Search<PointT>& search, const int k,
+                               const std::vector<int>& rows)
+{
+    input = cloud;
+    max_k = std::max(k, 1);
+    points = rows;
+    findNeighbours(search);
+}
+
+void NeighbourhoodGraph::clear()
+{
+    input.reset();
+    points.clear();
+    row_of.clear();
+    offsets.assign(1, 0);
+    indices.clear();
+    sqr_distances.clear();
+    reaches.clear();
+}
+
+void NeighbourhoodGraph::findNeighbours(const pcl::search::Search<PointT>& search)
+{
+    const PointCloudT::ConstPtr& cloud = input;
+    row_of.assign(cloud->size(), -1);
+    for (size_t r = 0; r < points.size(); ++r)
+    {
+        row_of[points[r]] = r;
+    }
+
+    // Every row first gets a full slot of k entries, filled in parallel, then the rows are packed down in place
+    const size_t num_rows = points.size();
+    indices.resize(num_rows * max_k);
+    sqr_distances.resize(num_rows * max_k);
+    reaches.resize(num_rows);
+    counts.assign(num_rows, 0);
+    parallelFor(threadsFor(num_rows), num_rows, [&](const size_t begin, const size_t end)
+    {
+        std::vector<int> nn_indices;
+        std::vector<float> nn_sqr_distances;
+        for (size_t r = begin; r < end; ++r)
+        {
+            const int found = std::min(max_k, search.nearestKSearch(cloud->points[points[r]], max_k, nn_indices, nn_sqr_distances));
+            std::copy(nn_indices.begin(), nn_indices.begin() + found, indices.begin() + r * max_k);
+            std::copy(nn_sqr_distances.begin(), nn_sqr_distances.begin() + found, sqr_distances.begin() + r * max_k);
+            counts[r] = found;
+            // A search that comes back short has found every point there is
+            reaches[r] = found < max_k ? std::numeric_limits<float>::infinity() : nn_sqr_distances[found - 1];
+        }
+    });
+
+    offsets.resize(num_rows + 1);
+    offsets[0] = 0;
+    for (size_t r = 0; r < num_rows; ++r)
+    {
+        offsets[r + 1] = offsets[r] + counts[r];
+        if (offsets[r] != r * max_k)
+        {
+            std::memmove(&indices[offsets[r]], &indices[r * max_k], counts[r] * sizeof(int));
+            std::memmove(&sqr_distances[offsets[r]], &sqr_distances[r * max_k], counts[r] * sizeof(float));
+        }
+    }
+    indices.resize(offsets[num_rows]);
+    sqr_distances.resize(offsets[num_rows]);
+}
+
+void NeighbourhoodGraph::meanDistances(const int k, std::vector<float>& means, std::vector<uint8_t>& valid) const
+{
+    means.assign(size(), 0);
+    valid.assign(size(), 0);
+    parallelFor(threadsFor(size()), size(), [&](const size_t begin, const size_t end)
+    {
+        for (size_t r = begin; r < end; ++r)
+        {
+            // The first neighbour is the point itself
+            const int n = std::min(count(r), k + 1);
+            if (n < 2)
+            {
+                continue;
+            }
+            const float* d = sqrDistances(r);
+            double dist_sum = 0;
+            for (int j = 1; j < n; ++j)
+            {
+                dist_sum += std::sqrt(d[j]);
+            }
+            means[r] = dist_sum / (n - 1);
+            valid[r] = 1;
+        }
+    });
+}
+
+void NeighbourhoodGraph::renumber()
+{
+    // 'new_index' gives each point's index after the change, or -1 if it has gone
+    // Dropping removed points keeps each row sorted and complete within its reach
+    size_t rows = 0;
+    size_t entries = 0;
+    size_t cloud_size = 0;
+    for (size_t r = 0; r < points.size(); ++r)
+    {
+        const size_t begin = offsets[r];
+        const size_t end = offsets[r + 1];
+        if (new_index[points[r]] < 0)
+        {
+            continue;
+        }
+        points[rows] = new_index[points[r]];
+        reaches[rows] = reaches[r];
+        offsets[rows] = entries;
+        for (size_t j = begin; j < end; ++j)
+        {
+            if (new_index[indices[j]] >= 0)
+            {
+                indices[entries] = new_index[indices[j]];
+                sqr_distances[entries] = sqr_distances[j];
+                ++entries;
+            }
+        }
+        ++rows;
+    }
+    for (const int i : new_index)
+    {
+        cloud_size += i >= 0;
+    }
+    points.resize(rows);
+    reaches.resize(rows);
+    offsets.resize(rows + 1);
+    offsets[rows] = entries;
+    indices.resize(entries);
+    sqr_distances.resize(entries);
+
+    row_of.assign(cloud_size, -1);
+    for (size_t r = 0; r < rows; ++r)
+    {
+        row_of[points[r]] = r;
+    }
+}
+
+void NeighbourhoodGraph::erase(const std::vector<int>& removed)
+{
+    order.resize(row_of.size());
+    std::iota(order.begin(), order.end(), 0);
+    VoxelHashIndex::swapRemove(removed, order);
+    new_index.assign(row_of.size(), -1);
+    for (size_t j = 0; j < order.size(); ++j)
+    {
+        new_index[order[j]] = j;
+    }
+    renumber();
+}
+
+GraphSearch::GraphSearch(const NeighbourhoodGraph::ConstPtr& graph, const pcl::search::KdTree<PointT>::Ptr& fallback)
+    : pcl::search::KdTree<PointT>(true), graph(graph), fallback(fallback)
+{
+    input_ = graph->cloud();
+}
+
+void GraphSearch::setInputCloud(const PointCloudConstPtr& cloud, const IndicesConstPtr& indices)
+{
+    // Nothing to build; only the fallback needs to know about a different cloud
+    input_ = cloud;
+    indices_ = indices;
+    if (fallback->getInputCloud() != cloud)
+    {
+        fallback->setInputCloud(cloud);
+    }
+}
+
+int GraphSearch::nearestKSearch(const PointT& point, int k, std::vector<int>& k_indices, std::vector<float>& k_sqr_distances) const
+{
+    return fallback->nearestKSearch(point, k, k_indices, k_sqr_distances);
+}
+
+int GraphSearch::nearestKSearch(const PointCloudT& cloud, int index, int k, std::vector<int>& k_indices,
+                                std::vector<float>& k_sqr_distances) const
+{
+    const int row = &cloud == graph->cloud().get() ? graph->rowOf(index) : -1;
+    if (row < 0 || k > graph->count(row))
+    {
+        return fallback->nearestKSearch(cloud.points[index], k, k_indices, k_sqr_distances);
+    }
+    k_indices.assign(graph->neighbours(row), graph->neighbours(row) + k);
+    k_sqr_distances.assign(graph->sqrDistances(row), graph->sqrDistances(row) + k);
+    return k;
+}
+
+int GraphSearch::nearestKSearch(int index, int k, std::vector<int>& k_indices, std::vector<float>& k_sqr_distances) const
+{
+    return nearestKSearch(*input_, index, k, k_indices, k_sqr_distances);
+}
+
+int GraphSearch::radiusSearch(const PointT& point, double radius, std::vector<int>& k_indices,
+                              std::vector<float>& k_sqr_distances, unsigned int max_nn) const
+{
+    return fallback->radiusSearch(point, radius, k_indices, k_sqr_distances, max_nn);
+}
+
+int GraphSearch::radiusSearch(const PointCloudT& cloud, int index, double radius, std::vector<int>& k_indices,
+                              std::vector<float>& k_sqr_distances, unsigned int max_nn) const
+{
+    const float sqr_radius = radius * radius;
+    const int row = &cloud == graph->cloud().get() ? graph->rowOf(index) : -1;
+    if (row < 0 || sqr_radius >= graph->reach(row))
+    {
+        return fallback->radiusSearch(cloud.points[index], radius, k_indices, k_sqr_distances, max_nn);
+    }
+    const float* d = graph->sqrDistances(row);
+    int n = std::upper_bound(d, d + graph->count(row), sqr_radius) - d;
+    if (max_nn > 0)
+    {
+        n = std::min<int>(n, max_nn);
+    }
+    k_indices.assign(graph->neighbours(row), graph->neighbours(row) + n);
+    k_sqr_distances.assign(d, d + n);
+    return n;
+}
+
+int GraphSearch::radiusSearch(int index, double radius, std::vector<int>& k_indices,
+                              std::vector<float>& k_sqr_distances, unsigned int max_nn) const
+{
+    return radiusSearch(*input_, index, radius, k_indices, k_sqr_distances, max_nn);
+}
+
+std::vector<int> statisticalInliers(const NeighbourhoodGraph& graph, const int num_neighbours, const double stddev)
+{
+    std::vector<float> means;
+    std::vector<uint8_t> valid;
+    graph.meanDistances(num_neighbours, means, valid);
+
+    double sum = 0;
+    double sq_sum = 0;
+    int count = 0;
+    for (size_t r = 0; r < graph.size(); ++r)
+    {
+        if (valid[r])
+        {
+            sum += means[r];
+            sq_sum += means[r] * means[r];
+            ++count;
+        }
+    }
+    double threshold = std::numeric_limits<double>::infinity();
+    if (count > 1)
+    {
+        const double mean = sum / count;
+        const double variance = std::max(0.0, (sq_sum - sum * sum / count) / (count - 1));
+        threshold = mean + stddev * std::sqrt(variance);
+    }
+
+    std::vector<int> kept;
+    kept.reserve(graph.cloud()->size());
+    for (size_t i = 0; i < graph.cloud()->size(); ++i)
+    {
+        const int row = graph.rowOf(i);
+        if (row < 0 || !valid[row] || means[row] <= threshold)
+        {
+            kept.push_back(i);
+        }
+    }
+    return kept;
+}
@@ -0,0 +1,110 @@
+#ifndef NEIGHBOURHOOD_GRAPH_H
+#define NEIGHBOURHOOD_GRAPH_H
+
+#include <vector>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl/search/kdtree.h>
+
+typedef pcl::PointXYZ PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+
+// The k nearest neighbours of points of a cloud, found once and shared by every stage that needs them
+// Rows are stored back to back (compressed sparse row layout): the neighbours of row r are entries offsets[r] to
+// offsets[r+1] of one index array and one squared distance array, nearest first, starting with the point itself
+// A row holds every point of the cloud within its reach, so the k' < k nearest, or all points within a radius
+// inside the reach, are a prefix of the row; this stays true as points are removed from the cloud and the graph
+class NeighbourhoodGraph
+{
+public:
+    typedef boost::shared_ptr<NeighbourhoodGraph> Ptr;
+    typedef boost::shared_ptr<const NeighbourhoodGraph> ConstPtr;
+
+    NeighbourhoodGraph(const int num_threads = 1) : num_threads(std::max(num_threads, 1)) {}
+    void setNumThreads(const int num_threads) { this->num_threads = std::max(num_threads, 1); }
+
+    // Finds the 'k' nearest neighbours in 'cloud', through 'search', of every point or of the points in 'rows'
+    // 'search' must already index 'cloud' and be safe to query from several threads, as PCL's kd-tree and
+    // VoxelHashIndex are
+    void build(const PointCloudT::ConstPtr& cloud, const pcl::search::Search<PointT>& search, const int k);
+    void build(const PointCloudT::ConstPtr& cloud, const pcl::search::Search<PointT>& search, const int k,
+               const std::vector<int>& rows);
+
+    // Empties the graph and lets go of the cloud, but keeps the storage for the next build
+    void clear();
+
+    // Mean distance from the point of each row to its first 'k' neighbours, not counting itself
+    // Rows with no neighbours besides the point are marked invalid
+    void meanDistances(const int k, std::vector<float>& means, std::vector<uint8_t>& valid) const;
+
+    // Applies the same removal to the graph as VoxelHashIndex::erase does to the cloud
+    void erase(const std::vector<int>& indices);
+
+    const PointCloudT::ConstPtr& cloud() const { return input; }
+    int k() const { return max_k; }
+    size_t size() const { return points.size(); }
+    int point(const size_t row) const { return points[row]; }
+    int rowOf(const int index) const { return index < static_cast<int>(row_of.size()) ? row_of[index] : -1; }
+    int count(const size_t row) const { return offsets[row + 1] - offsets[row]; }
+    const int* neighbours(const size_t row) const { return &indices[offsets[row]]; }
+    const float* sqrDistances(const size_t row) const { return &sqr_distances[offsets[row]]; }
+    float reach(const size_t row) const { return reaches[row]; }
+
+private:
+    int threadsFor(const size_t count) const;
+    template <typename Function> void parallelFor(const int threads, const size_t count, Function function) const;
+    void findNeighbours(const pcl::search::Search<PointT>& search);
+    void renumber();
+
+    int num_threads;
+    PointCloudT::ConstPtr input;
+    int max_k = 0;
+    std::vector<int> points;            // Point of each row
+    std::vector<int> row_of;            // Row of each point of the cloud, or -1
+    std::vector<size_t> offsets;        // One more than there are rows
+    std::vector<int> indices;
+    std::vector<float> sqr_distances;
+    std::vector<float> reaches;         // Squared distance out to which each row holds every point
+
+    // Scratch space, kept so that rebuilding the graph frame after frame reuses it
+    std::vector<int> counts;
+    std::vector<int> order;
+    std::vector<int> new_index;
+};
+
+// Search method that answers queries about points of the graph's cloud from the graph, so that PCL's normal and
+// feature estimators and MLS reuse its neighbourhoods instead of searching again
+// Anything the graph cannot answer exactly (other points, larger k, radii beyond a row's reach) goes to 'fallback',
+// which must index the same cloud
+class GraphSearch : public pcl::search::KdTree<PointT>
+{
+public:
+    typedef boost::shared_ptr<GraphSearch> Ptr;
+
+    GraphSearch(const NeighbourhoodGraph::ConstPtr& graph, const pcl::search::KdTree<PointT>::Ptr& fallback);
+
+    void setInputCloud(const PointCloudConstPtr& cloud, const IndicesConstPtr& indices = IndicesConstPtr());
+
+    int nearestKSearch(const PointT& point, int k, std::vector<int>& k_indices, std::vector<float>& k_sqr_distances) const;
+    int nearestKSearch(const PointCloudT& cloud, int index, int k, std::vector<int>& k_indices,
+                       std::vector<float>& k_sqr_distances) const;
+    int nearestKSearch(int index, int k, std::vector<int>& k_indices, std::vector<float>& k_sqr_distances) const;
+    int radiusSearch(const PointT& point, double radius, std::vector<int>& k_indices,
+                     std::vector<float>& k_sqr_distances, unsigned int max_nn = 0) const;
+    int radiusSearch(const PointCloudT& cloud, int index, double radius, std::vector<int>& k_indices,
+                     std::vector<float>& k_sqr_distances, unsigned int max_nn = 0) const;
+    int radiusSearch(int index, double radius, std::vector<int>& k_indices,
+                     std::vector<float>& k_sqr_distances, unsigned int max_nn = 0) const;
+
+private:
+    NeighbourhoodGraph::ConstPtr graph;
+    pcl::search::KdTree<PointT>::Ptr fallback;
+};
+
+// Statistical outlier removal as in pcl::StatisticalOutlierRemoval, from the first 'num_neighbours' neighbours in
+// 'graph', with the mean distances computed in parallel
+// Returns the points to keep, in ascending order; points without a row in the graph are kept
+std::vector<int> statisticalInliers(const NeighbourhoodGraph& graph, const int num_neighbours, const double stddev);
+
+#endif
@@ -0,0 +1,286 @@
+#include <pcd_file.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <pcl/io/lzf.h>
+
+MappedPCD::MappedPCD(const std::string& path)
+{
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || info.st_size == 0)
+    {
+        ::close(fd);
+        return;
+    }
+    mapping_size = info.st_size;
+    mapping = mmap(nullptr, mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapping == MAP_FAILED)
+    {
+        mapping = nullptr;
+        return;
+    }
+    madvise(mapping, mapping_size, MADV_SEQUENTIAL);
+
+    // Parse the header, which ends with the DATA line
+    const char* begin = static_cast<const char*>(mapping);
+    const char* end = begin + mapping_size;
+    std::vector<std::string> fields, types;
+    std::vector<size_t> sizes, counts;
+    size_t width = 0, height = 1;
+    bool binary = false;
+    const char* line = begin;
+    while (line < end)
+    {
+        const char* eol = static_cast<const char*>(std::memchr(line, '\n', end - line));
+        if (!eol)
+        {
+            return;
+        }
+        std::istringstream iss (std::string(line, eol));
+        line = eol + 1;
+
+        std::string key;
+        iss >> key;
+        if (key.empty() || key[0] == '#')
+        {
+            continue;
+        }
+        std::string val;
+        if (key == "FIELDS")        while (iss >> val) fields.push_back(val);
+        else if (key == "TYPE")     while (iss >> val) types.push_back(val);
+        else if (key == "SIZE")     while (iss >> val) sizes.push_back(std::stoul(val));
+        else if (key == "COUNT")    while (iss >> val) counts.push_back(std::stoul(val));
+        else if (key == "WIDTH")    iss >> width;
+        else if (key == "HEIGHT")   iss >> height;
+        else if (key == "POINTS")   iss >> num_points;
+        else if (key == "DATA")
+        {
+            iss >> val;
+            binary = (val == "binary");
+            break;
+        }
+    }
+    if (counts.empty())
+    {
+        counts.assign(fields.size(), 1);
+    }
+    if (num_points == 0)
+    {
+        num_points = width * height;
+    }
+
+    // The x, y and z fields must be adjacent 4 byte floats
+    bool found = false;
+    if (binary && fields.size() == types.size() && fields.size() == sizes.size() && fields.size() == counts.size())
+    {
+        size_t offset = 0;
+        for (size_t f = 0; f < fields.size(); ++f)
+        {
+            if (fields[f] == "x" && f + 2 < fields.size() && fields[f+1] == "y" && fields[f+2] == "z")
+            {
+                found = true;
+                xyz_offset = offset;
+                for (size_t k = f; k < f + 3; ++k)
+                {
+                    found = found && types[k] == "F" && sizes[k] == 4 && counts[k] == 1;
+                }
+            }
+            offset += sizes[f] * counts[f];
+        }
+        stride = offset;
+    }
+    if (!found || line + num_points * stride > end)
+    {
+        num_points = 0;
+        return;
+    }
+    points = line;
+}
+
+MappedPCD::~MappedPCD()
+{
+    if (mapping)
+    {
+        munmap(mapping, mapping_size);
+    }
+}
+
+PCDStreamWriter::PCDStreamWriter(const std::string& path, const PCDFormat format)
+    : path(path), format(format)
+{
+    file = std::fopen(path.c_str(), "wb");
+    if (!file)
+    {
+        throw std::runtime_error("Could not open " + path + " for writing.");
+    }
+    // The real point count is written over the placeholder by close()
+    if (format != PCDFormat::BinaryCompressed)
+    {
+        writeHeader(0);
+    }
+}
+
+PCDStreamWriter::~PCDStreamWriter()
+{
+    // Without close() the placeholder count of zero stays, so a file abandoned part way never passes as complete
+    if (file)
+    {
+        std::fclose(file);
+    }
+}
+
+void PCDStreamWriter::put(const void* data, const size_t size, const size_t count)
+{
+    if (std::fwrite(data, size, count, file) != count)
+    {
+        throw std::runtime_error("Could not write " + path + ".");
+    }
+}
+
+void PCDStreamWriter::writeHeader(const size_t count)
+{
+    // Counts are zero padded to a fixed width so the header can be rewritten in place
+    const char* data_type = format == PCDFormat::ASCII ? "ascii" : (format == PCDFormat::Binary ? "binary" : "binary_compressed");
+    const int written = std::fprintf(file,
+                 "# .PCD v0.7 - Point Cloud Data file format\n"
+                 "VERSION 0.7\n"
+                 "FIELDS x y z\n"
+                 "SIZE 4 4 4\n"
+                 "TYPE F F F\n"
+                 "COUNT 1 1 1\n"
+                 "WIDTH %020zu\n"
+                 "HEIGHT 1\n"
+                 "VIEWPOINT 0 0 0 1 0 0 0\n"
+                 "POINTS %020zu\n"
+                 "DATA %s\n", count, count, data_type);
+    if (written < 0)
+    {
+        throw std::runtime_error("Could not write " + path + ".");
+    }
+}
+
+void PCDStreamWriter::write(const PointT* points, const size_t count)
+{
+    if (!file)
+    {
+        throw std::runtime_error("Writing to " + path + " after it was closed.");
+    }
+    if (format == PCDFormat::BinaryCompressed)
+    {
+        // The compressed block records its sizes in 32 bits, which caps it at about 358 million points
+        if ((this->count + count) * 3 * sizeof(float) > std::numeric_limits<uint32_t>::max())
+        {
+            throw std::runtime_error("Too many points for binary_compressed in " + path + "; use binary instead.");
+        }
+        this->count += count;
+        for (size_t i = 0; i < count; ++i)
+        {
+            x.push_back(points[i].x);
+            y.push_back(points[i].y);
+            z.push_back(points[i].z);
+        }
+        return;
+    }
+    this->count += count;
+
+    // Convert and write a bounded chunk at a time
+    const size_t chunk_size = 65536;
+    std::vector<float> binary;
+    std::string text;
+    char buffer[64];
+    for (size_t begin = 0; begin < count; begin += chunk_size)
+    {
+        const size_t end = std::min(begin + chunk_size, count);
+        if (format == PCDFormat::Binary)
+        {
+            binary.resize(3 * (end - begin));
+            for (size_t i = begin; i < end; ++i)
+            {
+                std::memcpy(&binary[3 * (i - begin)], points[i].data, 3 * sizeof(float));
+            }
+            put(binary.data(), sizeof(float), binary.size());
+        }
+        else
+        {
+            text.clear();
+            for (size_t i = begin; i < end; ++i)
+            {
+                int n = std::snprintf(buffer, sizeof(buffer), "%.8g %.8g %.8g\n", points[i].x, points[i].y, points[i].z);
+                text.append(buffer, n);
+            }
+            put(text.data(), 1, text.size());
+        }
+    }
+}
+
+void PCDStreamWriter::close()
+{
+    if (!file)
+    {
+        return;
+    }
+
+    if (format == PCDFormat::BinaryCompressed)
+    {
+        // Fields are stored one after another and compressed as a single block
+        // x grows into that block, taking in y and then z, so at most one extra copy of the points is held on the way
+        x.reserve(3 * count);
+        x.insert(x.end(), y.begin(), y.end());
+        std::vector<float>().swap(y);
+        x.insert(x.end(), z.begin(), z.end());
+        std::vector<float>().swap(z);
+        const uint32_t uncompressed_size = x.size() * sizeof(float);
+        std::vector<char> compressed (std::min<size_t>(uncompressed_size * 1.5 + 8, std::numeric_limits<uint32_t>::max()));
+        const uint32_t compressed_size = x.empty() ? 0 :
+            pcl::lzfCompress(x.data(), uncompressed_size, compressed.data(), compressed.size());
+        std::vector<float>().swap(x);
+        if (compressed_size == 0 && uncompressed_size > 0)
+        {
+            throw std::runtime_error("Could not compress the points of " + path + ".");
+        }
+        // The header only goes in once the points are known to fit in it
+        writeHeader(count);
+        put(&compressed_size, sizeof(compressed_size), 1);
+        put(&uncompressed_size, sizeof(uncompressed_size), 1);
+        put(compressed.data(), 1, compressed_size);
+    }
+    else
+    {
+        if (std::fseek(file, 0, SEEK_SET) != 0)
+        {
+            throw std::runtime_error("Could not write " + path + ".");
+        }
+        writeHeader(count);
+    }
+
+    // Data still buffered is only known to be written once the file is closed
+    const int result = std::fclose(file);
+    file = nullptr;
+    if (result != 0)
+    {
+        throw std::runtime_error("Could not write " + path + ".");
+    }
+}
+
+void writePCD(const std::string& path, const PointCloudT& cloud, const PCDFormat format)
+{
+    PCDStreamWriter writer (path, format);
+    writer.write(cloud);
+    writer.close();
+}
@@ -0,0 +1,83 @@
+#ifndef PCD_FILE_H
+#define PCD_FILE_H
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+typedef pcl::PointXYZ PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+
+enum class PCDFormat
+{
+    ASCII,
+    Binary,
+    BinaryCompressed
+};
+
+// Read-only memory mapping of a binary PCD file
+// The points are read straight out of the page cache with no intermediate copy of the cloud
+// Only uncompressed binary files with float x, y and z fields can be mapped; valid() is false for anything else,
+// in which case the file should be read with pcl::PCDReader instead
+class MappedPCD
+{
+public:
+    MappedPCD(const std::string& path);
+    ~MappedPCD();
+    MappedPCD(const MappedPCD&) = delete;
+    MappedPCD& operator=(const MappedPCD&) = delete;
+
+    bool valid() const { return points != nullptr; }
+    size_t size() const { return num_points; }
+
+    PointT operator[](const size_t i) const
+    {
+        float xyz[3];
+        std::memcpy(xyz, points + i * stride + xyz_offset, sizeof(xyz));
+        return PointT(xyz[0], xyz[1], xyz[2]);
+    }
+
+private:
+    void* mapping = nullptr;
+    size_t mapping_size = 0;
+    const char* points = nullptr;   // Start of the point data within the mapping
+    size_t num_points = 0;
+    size_t stride = 0;              // Bytes per point
+    size_t xyz_offset = 0;          // Offset of x within a point; y and z follow it
+};
+
+// Writes a PCD file a chunk of points at a time, without holding the whole file in memory
+// The point count can be given up front or left for close() to fill in
+// BinaryCompressed data is a single LZF block, so those points are buffered until close()
+// write() and close() throw std::runtime_error if the file cannot be written
+class PCDStreamWriter
+{
+public:
+    PCDStreamWriter(const std::string& path, const PCDFormat format);
+    ~PCDStreamWriter();
+    PCDStreamWriter(const PCDStreamWriter&) = delete;
+    PCDStreamWriter& operator=(const PCDStreamWriter&) = delete;
+
+    void write(const PointT* points, const size_t count);
+    void write(const PointCloudT& cloud) { write(cloud.points.data(), cloud.size()); }
+    void close();
+
+private:
+    void writeHeader(const size_t count);
+    void put(const void* data, const size_t size, const size_t count);
+
+    std::string path;
+    PCDFormat format;
+    FILE* file = nullptr;
+    size_t count = 0;
+    std::vector<float> x, y, z;     // Buffered fields for BinaryCompressed
+};
+
+// Writes 'cloud' to 'path' through a PCDStreamWriter
+void writePCD(const std::string& path, const PointCloudT& cloud, const PCDFormat format);
+
+#endif
@@ -0,0 +1,102 @@
+#include <point_to_plane.h>
+
+#include <Eigen/Dense>
+
+void PointToPlaneEstimation::estimateRigidTransformation(const PointCloudT& cloud_src, const PointCloudT& cloud_tgt,
+                                                         Matrix4& transformation_matrix) const
+{
+    // Point i of the source matches point i of the target
+    pcl::Correspondences correspondences;
+    for (size_t i = 0; i < cloud_src.size(); ++i)
+    {
+        correspondences.push_back(pcl::Correspondence(i, i, 0));
+    }
+    estimateRigidTransformation(cloud_src, cloud_tgt, correspondences, transformation_matrix);
+}
+
+void PointToPlaneEstimation::estimateRigidTransformation(const PointCloudT& cloud_src, const std::vector<int>& indices_src,
+                                                         const PointCloudT& cloud_tgt, Matrix4& transformation_matrix) const
+{
+    pcl::Correspondences correspondences;
+    for (size_t i = 0; i < indices_src.size(); ++i)
+    {
+        correspondences.push_back(pcl::Correspondence(indices_src[i], i, 0));
+    }
+    estimateRigidTransformation(cloud_src, cloud_tgt, correspondences, transformation_matrix);
+}
+
+void PointToPlaneEstimation::estimateRigidTransformation(const PointCloudT& cloud_src, const std::vector<int>& indices_src,
+                                                         const PointCloudT& cloud_tgt, const std::vector<int>& indices_tgt,
+                                                         Matrix4& transformation_matrix) const
+{
+    pcl::Correspondences correspondences;
+    for (size_t i = 0; i < indices_src.size() && i < indices_tgt.size(); ++i)
+    {
+        correspondences.push_back(pcl::Correspondence(indices_src[i], indices_tgt[i], 0));
+    }
+    estimateRigidTransformation(cloud_src, cloud_tgt, correspondences, transformation_matrix);
+}
+
+void PointToPlaneEstimation::estimateRigidTransformation(const PointCloudT& cloud_src, const PointCloudT& cloud_tgt,
+                                                         const pcl::Correspondences& correspondences,
+                                                         Matrix4& transformation_matrix) const
+{
+    // Linearised least squares: for small rotations (a, b, c) and translation t, each pair contributes
+    // ((s x n) . (a, b, c) + n . t - n . (d - s))^2, where s is the source point, d its match and n the match's normal
+    // Coordinates are taken relative to the source centroid, which keeps the system well conditioned at map scale
+    transformation_matrix.setIdentity();
+    Eigen::Vector3d centroid = Eigen::Vector3d::Zero();
+    for (const pcl::Correspondence& c : correspondences)
+    {
+        centroid += cloud_src.points[c.index_query].getVector3fMap().cast<double>();
+    }
+    if (correspondences.size() < 6)
+    {
+        return;
+    }
+    centroid /= correspondences.size();
+
+    Eigen::Matrix<double, 6, 6> ata = Eigen::Matrix<double, 6, 6>::Zero();
+    Eigen::Matrix<double, 6, 1> atb = Eigen::Matrix<double, 6, 1>::Zero();
+    size_t used = 0;
+    for (const pcl::Correspondence& c : correspondences)
+    {
+        const pcl::Normal& normal = normals->points[c.index_match];
+        if (!std::isfinite(normal.normal_x) || !std::isfinite(normal.normal_y) || !std::isfinite(normal.normal_z))
+        {
+            continue;
+        }
+        const Eigen::Vector3d s = cloud_src.points[c.index_query].getVector3fMap().cast<double>() - centroid;
+        const Eigen::Vector3d d = cloud_tgt.points[c.index_match].getVector3fMap().cast<double>() - centroid;
+        const Eigen::Vector3d n (normal.normal_x, normal.normal_y, normal.normal_z);
+        Eigen::Matrix<double, 6, 1> a;
+        a << s.cross(n), n;
+        ata.selfadjointView<Eigen::Upper>().rankUpdate(a);
+        atb += a * n.dot(d - s);
+        ++used;
+    }
+    if (used < 6)
+    {
+        return;
+    }
+
+    // A smooth tunnel wall leaves sliding along and rolling about the axis unconstrained
+    // A little damping keeps those directions at zero instead of letting them run away; rotations and translations
+    // are in different units, so each is damped relative to its own block
+    Eigen::Matrix<double, 6, 6> system = ata.selfadjointView<Eigen::Upper>();
+    const double rotation_damping = 1e-6 * system.topLeftCorner<3, 3>().trace() / 3 + 1e-12;
+    const double translation_damping = 1e-6 * system.bottomRightCorner<3, 3>().trace() / 3 + 1e-12;
+    system.diagonal().head<3>().array() += rotation_damping;
+    system.diagonal().tail<3>().array() += translation_damping;
+    const Eigen::Matrix<double, 6, 1> x = system.ldlt().solve(atb);
+
+    Eigen::Affine3d step = Eigen::Affine3d::Identity();
+    step.translation() = x.tail<3>();
+    step.linear() = (Eigen::AngleAxisd(x(2), Eigen::Vector3d::UnitZ()) *
+                     Eigen::AngleAxisd(x(1), Eigen::Vector3d::UnitY()) *
+                     Eigen::AngleAxisd(x(0), Eigen::Vector3d::UnitX())).toRotationMatrix();
+
+    // Back from centroid coordinates
+    const Eigen::Affine3d transform = Eigen::Translation3d(centroid) * step * Eigen::Translation3d(-centroid);
+    transformation_matrix = transform.matrix().cast<float>();
+}
@@ -0,0 +1,36 @@
+#ifndef POINT_TO_PLANE_H
+#define POINT_TO_PLANE_H
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl/registration/transformation_estimation.h>
+
+typedef pcl::PointXYZ PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+
+// Point-to-plane transformation estimate for ICP, with the target normals held in a separate cloud
+// pcl::TransformationEstimationPointToPlaneLLS needs the normals inside the target points, which would mean copying the
+// whole map into a PointNormal cloud and giving up its spatial index; here 'normals' only has to run parallel to the
+// target, so the cached map normals and the voxel hash index can both be used as they are
+class PointToPlaneEstimation : public pcl::registration::TransformationEstimation<PointT, PointT>
+{
+public:
+    typedef boost::shared_ptr<PointToPlaneEstimation> Ptr;
+
+    PointToPlaneEstimation(const pcl::PointCloud<pcl::Normal>::ConstPtr& normals) : normals(normals) {}
+
+    void estimateRigidTransformation(const PointCloudT& cloud_src, const PointCloudT& cloud_tgt,
+                                     Matrix4& transformation_matrix) const;
+    void estimateRigidTransformation(const PointCloudT& cloud_src, const std::vector<int>& indices_src,
+                                     const PointCloudT& cloud_tgt, Matrix4& transformation_matrix) const;
+    void estimateRigidTransformation(const PointCloudT& cloud_src, const std::vector<int>& indices_src,
+                                     const PointCloudT& cloud_tgt, const std::vector<int>& indices_tgt,
+                                     Matrix4& transformation_matrix) const;
+    void estimateRigidTransformation(const PointCloudT& cloud_src, const PointCloudT& cloud_tgt,
+                                     const pcl::Correspondences& correspondences, Matrix4& transformation_matrix) const;
+
+private:
+    pcl::PointCloud<pcl::Normal>::ConstPtr normals;
+};
+
+#endif
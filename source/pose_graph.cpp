@@ -0,0 +1,127 @@
+#include <pose_graph.h>
+
+#include <atomic>
+#include <thread>
+
+#include <Eigen/Sparse>
+
+std::vector<PairConstraint> registerPairs(const std::vector<PointCloudT::Ptr>& clouds,
+                                          const std::vector<std::pair<int, int> >& pairs,
+                                          const int iters, const int num_threads)
+{
+    std::vector<PairConstraint> constraints (pairs.size());
+    std::atomic<size_t> next_pair (0);
+
+    auto work = [&]()
+    {
+        for (size_t p = next_pair++; p < pairs.size(); p = next_pair++)
+        {
+            PairConstraint& c = constraints[p];
+            c.from = pairs[p].first;
+            c.to = pairs[p].second;
+
+            CountingICP icp;
+            icp.setMaximumIterations(iters);
+            icp.setInputSource(clouds[c.to]);
+            icp.setInputTarget(clouds[c.from]);
+            PointCloudT aligned;
+            icp.align(aligned);
+
+            c.correction = icp.getFinalTransformation();
+            c.fitness = icp.getFitnessScore();
+            c.converged = icp.hasConverged();
+            c.iterations = icp.iterations();
+            // Revert the translation in the z axis, as StitchedCloud::registerWithICP does
+            c.correction(2,3) = 0;
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < num_threads; ++i)
+    {
+        threads.push_back(std::thread(work));
+    }
+    work();
+    for (std::thread& t : threads)
+    {
+        t.join();
+    }
+    return constraints;
+}
+
+std::vector<Eigen::Matrix4f> chainCorrections(const std::vector<PairConstraint>& consecutive, const size_t num_clouds)
+{
+    // Cloud i was registered against cloud i-1 at its prior pose, so it inherits whatever moves cloud i-1
+    std::vector<Eigen::Matrix4f> corrections (num_clouds, Eigen::Matrix4f::Identity());
+    for (const PairConstraint& c : consecutive)
+    {
+        if (c.to == c.from + 1 && c.to < num_clouds)
+        {
+            corrections[c.to] = corrections[c.from] * (c.converged ? c.correction : Eigen::Matrix4f::Identity());
+        }
+    }
+    return corrections;
+}
+
+void optimisePoseGraph(std::vector<Eigen::Matrix4f>& corrections, const std::vector<PairConstraint>& constraints,
+                       const std::vector<TransformData>& priors)
+{
+    // Each constraint asks that correction[to] = correction[from] * constraint.correction
+    // With the rotations held fixed this is linear in the translations:
+    //     t_to - t_from = R_from * t_constraint
+    // Priors pull each cloud towards its prior pose (no correction) in proportion to their confidence
+    const int n = corrections.size();
+    if (n < 2)
+    {
+        return;
+    }
+    const double anchor_weight = 1e6;       // Holds the first cloud in place
+    const double prior_weight = 0.1;        // Weight of a prior with a confidence of 1, relative to one constraint
+    const double chain_weight = 1e-6;       // Keeps clouds without any constraints where the chain put them
+
+    std::vector<Eigen::Triplet<double> > triplets;
+    Eigen::MatrixXd rhs = Eigen::MatrixXd::Zero(n, 3);
+
+    triplets.push_back(Eigen::Triplet<double>(0, 0, anchor_weight));
+    rhs.row(0) = anchor_weight * corrections[0].block<3,1>(0,3).cast<double>().transpose();
+    for (int i = 0; i < n; ++i)
+    {
+        triplets.push_back(Eigen::Triplet<double>(i, i, chain_weight));
+        rhs.row(i) += chain_weight * corrections[i].block<3,1>(0,3).cast<double>().transpose();
+        if (i < priors.size() && priors[i].confidence > 0)
+        {
+            triplets.push_back(Eigen::Triplet<double>(i, i, prior_weight * priors[i].confidence));
+        }
+    }
+    for (const PairConstraint& c : constraints)
+    {
+        if (!c.converged || c.from >= n || c.to >= n)
+        {
+            continue;
+        }
+        const Eigen::Vector3d measured = (corrections[c.from].block<3,3>(0,0) * c.correction.block<3,1>(0,3)).cast<double>();
+        triplets.push_back(Eigen::Triplet<double>(c.to, c.to, 1));
+        triplets.push_back(Eigen::Triplet<double>(c.from, c.from, 1));
+        triplets.push_back(Eigen::Triplet<double>(c.to, c.from, -1));
+        triplets.push_back(Eigen::Triplet<double>(c.from, c.to, -1));
+        rhs.row(c.to) += measured.transpose();
+        rhs.row(c.from) -= measured.transpose();
+    }
+
+    Eigen::SparseMatrix<double> normal (n, n);
+    normal.setFromTriplets(triplets.begin(), triplets.end());
+    Eigen::SimplicialLDLT<Eigen::SparseMatrix<double> > solver (normal);
+    if (solver.info() != Eigen::Success)
+    {
+        std::cout << "WARNING: Pose graph optimisation failed, keeping the chained poses.\n";
+        return;
+    }
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const Eigen::VectorXd t = solver.solve(rhs.col(axis));
+        for (int i = 0; i < n; ++i)
+        {
+            corrections[i](axis,3) = t(i);
+        }
+    }
+}
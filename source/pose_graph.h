@@ -0,0 +1,35 @@
+#ifndef POSE_GRAPH_H
+#define POSE_GRAPH_H
+
+#include <utility>
+#include <vector>
+
+#include <stitched_cloud.h>
+
+// Alignment of one cloud against another, both already placed at their prior poses
+struct PairConstraint
+{
+    int from = 0;
+    int to = 0;
+    Eigen::Matrix4f correction = Eigen::Matrix4f::Identity();   // Moves cloud 'to' onto cloud 'from'
+    double fitness = 0;
+    bool converged = false;
+    int iterations = 0;
+};
+
+// Registers every pair with ICP, spreading the pairs over 'num_threads' threads
+// Pairs are independent, so the result does not depend on the number of threads
+std::vector<PairConstraint> registerPairs(const std::vector<PointCloudT::Ptr>& clouds,
+                                          const std::vector<std::pair<int, int> >& pairs,
+                                          const int iters, const int num_threads);
+
+// Composes the corrections between consecutive clouds into a correction for every cloud
+// The first cloud is the reference and is left where it is
+std::vector<Eigen::Matrix4f> chainCorrections(const std::vector<PairConstraint>& consecutive, const size_t num_clouds);
+
+// Refines the translations of the chained corrections against every constraint and the priors
+// Rotations are kept from the chain, which leaves one small linear least squares problem per axis
+void optimisePoseGraph(std::vector<Eigen::Matrix4f>& corrections, const std::vector<PairConstraint>& constraints,
+                       const std::vector<TransformData>& priors);
+
+#endif
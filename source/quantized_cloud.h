@@ -0,0 +1,80 @@
+#ifndef QUANTIZED_CLOUD_H
+#define QUANTIZED_CLOUD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+typedef pcl::PointXYZ PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+
+// Points stored as integer offsets from the centre of their bounding box, in steps of a fixed size, one array per axis
+// 'Coord' sets the size: int16_t takes 6 bytes a point and int32_t 12, against 16 for PointXYZ with its padding
+// Each cloud has its own centre and step, so it suits a single tile of the map: the step is the requested
+// resolution, or as much coarser as it takes for the tile's extent to fit in 'Coord'
+template <typename Coord>
+class QuantizedCloud
+{
+public:
+    // Encodes the points 'indices' of 'cloud'; rounding moves each point by at most half a step along each axis
+    void encode(const PointCloudT& cloud, const std::vector<int>& indices, const float resolution)
+    {
+        Eigen::Vector3f lo = Eigen::Vector3f::Constant(std::numeric_limits<float>::max());
+        Eigen::Vector3f hi = Eigen::Vector3f::Constant(std::numeric_limits<float>::lowest());
+        for (const int i : indices)
+        {
+            lo = lo.cwiseMin(cloud.points[i].getVector3fMap());
+            hi = hi.cwiseMax(cloud.points[i].getVector3fMap());
+        }
+        const float max_code = std::numeric_limits<Coord>::max();
+        origin = indices.empty() ? Eigen::Vector3f::Zero() : Eigen::Vector3f((lo + hi) / 2);
+        step_size = indices.empty() ? resolution : std::max(resolution, (hi - lo).maxCoeff() / 2 / max_code);
+
+        const float inverse = 1 / step_size;
+        for (int axis = 0; axis < 3; ++axis)
+        {
+            std::vector<Coord>& codes = coords[axis];
+            codes.resize(indices.size());
+            for (size_t j = 0; j < indices.size(); ++j)
+            {
+                const float offset = (cloud.points[indices[j]].data[axis] - origin[axis]) * inverse;
+                codes[j] = static_cast<Coord>(std::max(-max_code, std::min(max_code, std::round(offset))));
+            }
+            codes.shrink_to_fit();
+        }
+    }
+
+    // Decodes points 'begin' to 'end' into 'out'
+    // One multiply-add per coordinate over contiguous arrays, so the compiler can vectorise it
+    void decode(const size_t begin, const size_t end, PointT* out) const
+    {
+        const Coord* x = coords[0].data();
+        const Coord* y = coords[1].data();
+        const Coord* z = coords[2].data();
+        const float ox = origin[0], oy = origin[1], oz = origin[2];
+        const float step = step_size;
+        for (size_t i = begin; i < end; ++i)
+        {
+            PointT& p = out[i - begin];
+            p.x = ox + step * x[i];
+            p.y = oy + step * y[i];
+            p.z = oz + step * z[i];
+        }
+    }
+
+    size_t size() const { return coords[0].size(); }
+    size_t bytes() const { return 3 * coords[0].capacity() * sizeof(Coord) + sizeof(*this); }
+    float step() const { return step_size; }
+
+private:
+    Eigen::Vector3f origin = Eigen::Vector3f::Zero();
+    float step_size = 1;
+    std::vector<Coord> coords[3];
+};
+
+#endif
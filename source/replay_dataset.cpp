@@ -0,0 +1,175 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+void helpMessage();
+
+// Index of a cloud file named PCD<n>.pcd, or -1 for any other file
+long cloudIndex(const std::string& name)
+{
+    if (name.size() <= 7 || name.compare(0, 3, "PCD") || name.compare(name.size() - 4, 4, ".pcd"))
+    {
+        return -1;
+    }
+    const std::string digits = name.substr(3, name.size() - 7);
+    return digits.find_first_not_of("0123456789") == std::string::npos ? std::stol(digits) : -1;
+}
+
+// Feeds a recorded dataset into a directory at the rate the drone wrote it, for testing registerClouds -l
+// For each cloud its pose rows are appended to <live>/transforms.txt, then the cloud is copied in under a temporary
+// name and renamed into place, so it appears all at once; a file called done marks the end
+int main(int argc, char** argv)
+{
+    if (argc < 3)
+    {
+        helpMessage();
+        return -1;
+    }
+    const std::string dataset = argv[1];
+    const std::string live = argv[2];
+
+    std::string transform_file = dataset + "/transforms.txt";
+    double period = 1;
+    double speed = 1;
+    int rows_per_cloud = 10;
+    for (int i = 3; i < argc; i += 2)
+    {
+        if (i + 1 >= argc)
+        {
+            std::cout << "Command \"" << argv[i] << "\" is missing a value." << std::endl;
+            helpMessage();
+            return -1;
+        }
+        if (!std::strcmp(argv[i], "-t"))
+        {
+            transform_file = argv[i+1];
+        }
+        else if (!std::strcmp(argv[i], "-p"))
+        {
+            period = std::stod(argv[i+1]);
+        }
+        else if (!std::strcmp(argv[i], "-x"))
+        {
+            speed = std::max(1e-3, std::stod(argv[i+1]));
+        }
+        else if (!std::strcmp(argv[i], "-n"))
+        {
+            rows_per_cloud = std::max(1, std::stoi(argv[i+1]));
+        }
+        else
+        {
+            std::cout << "Command \"" << argv[i] << "\" not recognised." << std::endl;
+            helpMessage();
+            return -1;
+        }
+    }
+
+    // Clouds of the dataset, in order, with their names as they are on disk
+    std::vector<std::pair<long, std::string> > clouds;
+    DIR* dp = opendir(dataset.c_str());
+    if (!dp)
+    {
+        std::cout << "Error opening " << dataset << std::endl;
+        return -1;
+    }
+    while (struct dirent* dirp = readdir(dp))
+    {
+        const long index = cloudIndex(dirp->d_name);
+        if (index >= 0)
+        {
+            clouds.push_back(std::make_pair(index, std::string(dirp->d_name)));
+        }
+    }
+    closedir(dp);
+    std::sort(clouds.begin(), clouds.end());
+    if (clouds.empty())
+    {
+        std::cout << "No PCD files found." << std::endl;
+        return -1;
+    }
+
+    // Pose rows, 'rows_per_cloud' to each cloud by its number counted from the first cloud, after one header row
+    std::vector<std::string> rows;
+    std::string header;
+    std::ifstream transforms_in (transform_file);
+    const bool have_transforms = transforms_in.is_open();
+    if (have_transforms)
+    {
+        std::getline(transforms_in, header);
+        for (std::string line; std::getline(transforms_in, line); )
+        {
+            rows.push_back(line);
+        }
+    }
+
+    mkdir(live.c_str(), 0755);
+    std::remove((live + "/done").c_str());
+    std::ofstream transforms_out;
+    if (have_transforms)
+    {
+        transforms_out.open(live + "/transforms.txt");
+        transforms_out << header << "\n" << std::flush;
+    }
+
+    const auto step = std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(period / speed));
+    const auto start = std::chrono::steady_clock::now();
+    size_t rows_written = 0;
+    for (size_t k = 0; k < clouds.size(); ++k)
+    {
+        std::this_thread::sleep_until(start + static_cast<int>(k) * step);
+        const std::string& name = clouds[k].second;
+
+        // The pose goes first, so the cloud never has to wait for it
+        // Rows of clouds missing from the dataset are written too, as rows are matched to clouds by number
+        if (transforms_out.is_open())
+        {
+            const size_t end_row = std::min<size_t>((clouds[k].first - clouds[0].first + 1) * rows_per_cloud, rows.size());
+            for (; rows_written < end_row; ++rows_written)
+            {
+                transforms_out << rows[rows_written] << "\n";
+            }
+            transforms_out.flush();
+        }
+
+        const std::string temporary = live + "/." + name + ".part";
+        {
+            std::ifstream in (dataset + "/" + name, std::ios::binary);
+            std::ofstream out (temporary, std::ios::binary);
+            if (!in || !out || !(out << in.rdbuf()) || !out.flush())
+            {
+                std::cout << "Could not copy " << name << " to " << live << "." << std::endl;
+                std::remove(temporary.c_str());
+                return -1;
+            }
+        }
+        if (std::rename(temporary.c_str(), (live + "/" + name).c_str()) != 0)
+        {
+            std::cout << "Could not move " << name << " into " << live << "." << std::endl;
+            return -1;
+        }
+        std::cout << "Wrote " << name << std::endl;
+    }
+
+    std::ofstream done (live + "/done");
+    return 0;
+}
+
+void helpMessage()
+{
+    std::cout << "Usage: replayDataset <dataset directory> <live directory> [options]\n"
+              << "\t-t <txt file>" << "\t\tTransformations of the dataset; <dataset directory>/transforms.txt by default. (OPTIONAL)\n"
+              << "\t-p <seconds>" << "\t\tTime between clouds; 1 by default. (OPTIONAL)\n"
+              << "\t-x <factor>" << "\t\tReplay this many times faster. (OPTIONAL)\n"
+              << "\t-n <rows>" << "\t\tRows of the transformations file for each cloud; 10 by default. (OPTIONAL)"
+              << std::endl;
+}
@@ -0,0 +1,144 @@
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "batch_scheduler.h"
+
+void helpMessage();
+
+// Stitches many datasets in one process, each into its own <directory>/filtered.pcd
+// The datasets share one pool of threads and a memory budget, rather than each running as a registerClouds process
+// with threads of its own
+int main(int argc, char** argv)
+{
+    std::vector<std::string> directories;
+    int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    // Three quarters of the machine's memory, leaving the rest to the page cache and everything else
+    size_t memory_budget = static_cast<size_t>(sysconf(_SC_PHYS_PAGES)) * sysconf(_SC_PAGE_SIZE) / 4 * 3;
+    size_t max_ahead = 2;
+    std::string transform_name = "transforms.txt";
+    std::string stats_name;
+    StitchingOptions options;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (argv[i][0] != '-')
+        {
+            directories.push_back(argv[i]);
+            continue;
+        }
+        if (i + 1 >= argc)
+        {
+            std::cout << "Command \"" << argv[i] << "\" is missing a value." << std::endl;
+            helpMessage();
+            return -1;
+        }
+        if (!std::strcmp(argv[i], "-j"))
+        {
+            num_threads = std::max(1, std::stoi(argv[i+1]));
+        }
+        else if (!std::strcmp(argv[i], "-m"))
+        {
+            memory_budget = std::stoul(argv[i+1]) << 20;
+        }
+        else if (!std::strcmp(argv[i], "-a"))
+        {
+            max_ahead = std::stoul(argv[i+1]);
+        }
+        else if (!std::strcmp(argv[i], "-L"))
+        {
+            std::ifstream list (argv[i+1]);
+            if (!list)
+            {
+                std::cout << "Error opening " << argv[i+1] << std::endl;
+                return -1;
+            }
+            for (std::string line; std::getline(list, line); )
+            {
+                if (!line.empty() && line[0] != '#')
+                {
+                    directories.push_back(line);
+                }
+            }
+        }
+        else if (!std::strcmp(argv[i], "-t"))
+        {
+            transform_name = argv[i+1];
+        }
+        else if (!std::strcmp(argv[i], "-s"))
+        {
+            stats_name = argv[i+1];
+        }
+        else if (!parseStitchingOption(argv[i], argv[i+1], options))
+        {
+            std::cout << "Command \"" << argv[i] << "\" not recognised." << std::endl;
+            helpMessage();
+            return -1;
+        }
+        ++i;
+    }
+    if (directories.empty())
+    {
+        helpMessage();
+        return -1;
+    }
+
+    // The pool provides all of the parallelism, across clouds and datasets, so each map runs its stages on one thread
+    options.num_threads = 1;
+    options.show_progress = false;
+
+    BatchScheduler scheduler (num_threads, memory_budget, max_ahead);
+    for (const std::string& directory : directories)
+    {
+        StitchingOptions dataset_options = options;
+        struct stat st;
+        const std::string transform_file = directory + "/" + transform_name;
+        if (stat(transform_file.c_str(), &st) == 0)
+        {
+            dataset_options.transform_file = transform_file;
+        }
+        if (!stats_name.empty())
+        {
+            dataset_options.stats_file = directory + "/" + stats_name;
+        }
+        scheduler.add(directory, dataset_options);
+    }
+
+    // Start the timer
+    auto start = Clock::now();
+    const std::vector<BatchScheduler::Result> results = scheduler.run();
+    const Seconds total_time = Clock::now() - start;
+
+    int num_failed = 0;
+    std::cout << "\nBatch Summary\n"
+              << std::left << std::setw(40) << "Dataset" << std::right << std::setw(8) << "Clouds"
+              << std::setw(12) << "Time (s)" << "  Result\n";
+    for (const BatchScheduler::Result& result : results)
+    {
+        std::cout << std::left << std::setw(40) << result.directory << std::right << std::setw(8) << result.clouds
+                  << std::setw(12) << std::fixed << std::setprecision(1) << result.times.total_time.count() << "  "
+                  << (result.succeeded ? "ok" : result.error) << "\n";
+        num_failed += !result.succeeded;
+    }
+    std::cout << results.size() - num_failed << " of " << results.size() << " datasets stitched in "
+              << std::setprecision(1) << total_time.count() << "s on " << num_threads << " threads" << std::endl;
+    return num_failed > 0 ? 1 : 0;
+}
+
+void helpMessage()
+{
+    std::cout << "Usage: stitchBatch [options] <dataset directory>...\n"
+              << "\t-L <file>" << "\t\tAlso stitch the directories listed in <file>, one per line. (OPTIONAL)\n"
+              << "\t-j <threads>" << "\t\tThreads shared by all of the datasets; all cores by default. (OPTIONAL)\n"
+              << "\t-m <MB>" << "\t\t\tMemory shared by the datasets running at once; three quarters of the\n"
+              << "\t\t\t\tmachine's by default, no limit if 0. (OPTIONAL)\n"
+              << "\t-a <num clouds>" << "\t\tClouds each dataset prepares ahead of registration; 2 by default. (OPTIONAL)\n"
+              << "\t-t <name>" << "\t\tTransformations file in each dataset directory; transforms.txt by default,\n"
+              << "\t\t\t\tused where it exists. (OPTIONAL)\n"
+              << "\t-s <name>" << "\t\tWrite per-cloud measurements to this file in each dataset directory. (OPTIONAL)\n"
+              << "\t-w, -c, -k, -P, -b, -C, -T, -Q, -O, -o" << "\tAs for registerClouds, applied to every dataset. (OPTIONAL)"
+              << std::endl;
+}
@@ -1,159 +1,920 @@
 #include <stitched_cloud.h>
 
-StitchedCloud::StitchedCloud(PointCloudT::Ptr point_cloud)
+namespace
 {
+    // Stats of the cloud being processed on this thread, if any
+    // Clouds are preprocessed on worker threads while another is registered, so each thread has its own
+    thread_local CloudStats* frame_stats = nullptr;
+
+    // Points frame_stats at 'stats' until the end of the scope
+    struct FrameScope
+    {
+        CloudStats* previous;
+        FrameScope(CloudStats* stats) : previous(frame_stats) { if (stats) frame_stats = stats; }
+        ~FrameScope() { frame_stats = previous; }
+    };
+}
+
+StitchedCloud::StitchedCloud(PointCloudT::Ptr point_cloud, const int num_threads)
+    : num_threads(std::max(num_threads, 1))
+{
+    region_graph.reset(new NeighbourhoodGraph(this->num_threads));
+    smoothed_points.reset(new pcl::PointCloud<pcl::PointNormal>());
+
     stitched_cloud = point_cloud;
     downSample(stitched_cloud, 500);
     removeOutliers(stitched_cloud, 500, 1);
     filterRangeZ(stitched_cloud, 0, 10000);
+    map_index.reset(new VoxelHashIndex(1000));
+    map_index->setInputCloud(stitched_cloud);
+
+    local_map.reset(new PointCloudT());
+    local_index.reset(new VoxelHashIndex(1000));
+    local_index->setInputCloud(local_map);
+    updateLocalMap(stitched_cloud);
+}
+
+void StitchedCloud::setRegistrationTarget(const RegistrationTarget target, const int window_size, const double crop_radius)
+{
+    // Windowed targets keep the cost of registering each cloud independent of the length of the map
+    target_mode = target;
+    this->window_size = std::max(window_size, 1);
+    this->crop_radius = crop_radius;
+    trimLocalMap();
+    // The new target may need normals of its own
+    setRegistrationBackend(backend);
+}
+
+void StitchedCloud::setRegistrationBudget(const int max_iterations, const int min_iterations, const double skip_confidence)
+{
+    this->max_iterations = std::max(max_iterations, 1);
+    this->min_iterations = std::min(std::max(min_iterations, 1), this->max_iterations);
+    this->skip_confidence = skip_confidence;
+}
+
+void StitchedCloud::setRegistrationBackend(const RegistrationBackend backend)
+{
+    this->backend = backend;
+    local_normals.reset();
+    if (backend != RegistrationBackend::PointToPlane)
+    {
+        return;
+    }
+
+    // Start the timer
+    auto start = Clock::now();
+
+    // Normals of the points already in the target; from here on each point gets its normal as it is added
+    if (target_mode == RegistrationTarget::WholeMap)
+    {
+        updateMapNormals();
+    }
+    else
+    {
+        local_normals.reset(new pcl::PointCloud<pcl::Normal>());
+        estimateNormals(local_map, pcl::IndicesPtr(), *local_normals);
+    }
+
+    // Record the time
+    recordTime(&StageTimes::normal_time, start);
+}
+
+void StitchedCloud::setCorrespondenceSearch(const CorrespondenceSearch search, const double cell_size)
+{
+    correspondence_search = search;
+    correspondence_cell_size = cell_size;
+}
+
+void StitchedCloud::setRegistrationPyramid(std::vector<double> leaf_sizes)
+{
+    // Levels run from the coarsest down; the map itself is the finest level
+    std::sort(leaf_sizes.begin(), leaf_sizes.end(), std::greater<double>());
+    pyramid.clear();
+    for (const double leaf_size : leaf_sizes)
+    {
+        PyramidLevel level (leaf_size);
+        level.map_grid.add(*stitched_cloud);
+        pyramid.push_back(level);
+    }
+}
+
+PointCloudT::Ptr StitchedCloud::pyramidTarget(PyramidLevel& level, const PointCloudT::Ptr target)
+{
+    // The downsampled stitched map is kept up to date as clouds are added; other targets are downsampled as needed
+    if (target != stitched_cloud)
+    {
+        PointCloudT::Ptr coarse (new PointCloudT(*target));
+        VoxelDownsampler(level.leaf_size).filter(*coarse);
+        return coarse;
+    }
+    if (level.map_stale)
+    {
+        level.map_grid.getCloud(*level.map_cloud);
+        level.map_stale = false;
+    }
+    return level.map_cloud;
+}
+
+void StitchedCloud::extendPyramid(const PointCloudT::Ptr cloud)
+{
+    // New points are merged into the cached levels
+    // Points later removed by outlier removal or replaced by smoothing stay in them; at these leaf sizes the
+    // centroids barely move. Points flushed to disk are another matter, so then the levels are rebuilt
+    for (PyramidLevel& level : pyramid)
+    {
+        if (cloud)
+        {
+            level.map_grid.add(*cloud);
+        }
+        else
+        {
+            level.map_grid.clear();
+            level.map_grid.add(*stitched_cloud);
+        }
+        level.map_stale = true;
+    }
+}
+
+void StitchedCloud::enableTiling(const std::string& directory, const double tile_length, const TileStorage storage)
+{
+    // Tiles are cut along z, the direction of travel, and hold whole index cells so a cell is never split across
+    // the points in memory and those on disk
+    // Quantized tiles are rounded to 1 mm, far below the 500 mm leaf the map is downsampled to
+    const double cell_size = map_index->cellSize();
+    tile_store.reset(new TileStore(directory, std::max(1.0, std::ceil(tile_length / cell_size)) * cell_size, 2, storage, 1));
+    flushTiles();
+}
+
+void StitchedCloud::writeMap(const std::string& path, const PCDFormat format, LodOctreeWriter* octree)
+{
+    // Tiles on disk are streamed into the output ahead of the points still in memory
+    if (tile_store)
+    {
+        tile_store->assemble(path, *stitched_cloud, format, octree);
+    }
+    else
+    {
+        writePCD(path, *stitched_cloud, format);
+        if (octree)
+        {
+            octree->add(*stitched_cloud);
+        }
+    }
 }
 
-void StitchedCloud::addCloud(PointCloudT::Ptr new_cloud, const TransformData& transformation)
+void StitchedCloud::addCloud(PointCloudT::Ptr new_cloud, const TransformData& transformation, CloudStats* stats)
 {
     // Uses given transformation data to improve the speed of registration
+    preprocessCloud(new_cloud, transformation, stats);
+    addPreprocessedCloud(new_cloud, transformation, stats);
+}
 
+void StitchedCloud::preprocessCloud(PointCloudT::Ptr new_cloud, const TransformData& transformation, CloudStats* stats)
+{
+    // Only touches 'new_cloud', so clouds can be preprocessed on other threads while registration runs
+    FrameScope scope (stats);
+    preprocess(*new_cloud, new_cloud, transformation);
+}
+
+void StitchedCloud::preprocessCloud(const MappedPCD& file, PointCloudT::Ptr new_cloud, const TransformData& transformation,
+                                    CloudStats* stats)
+{
+    // As above, but the points are read straight out of the mapped file into the preprocessed cloud
+    FrameScope scope (stats);
+    preprocess(file, new_cloud, transformation);
+}
+
+template <typename Source>
+void StitchedCloud::preprocess(const Source& source, PointCloudT::Ptr new_cloud, const TransformData& transformation)
+{
     /*          Pre-Processing          */
-    downSample(new_cloud, 500);
+    // NaN removal, transformation and downsampling in one pass; outlier removal is unaffected by the transformation
+    const double inf = std::numeric_limits<double>::infinity();
+    fusedPreprocess(source, *new_cloud, transformation.affine(), -inf, inf, 500);
+    // fusedPreprocess(source, *new_cloud, transformation.affine(), transformation.dz, 10000+transformation.dz, 500);
     removeOutliers(new_cloud, 500, 2);
-    transform(new_cloud, transformation);
-    // filterRangeZ(new_cloud, transformation.dz, 10000+transformation.dz);
+    if (frame_stats)
+    {
+        frame_stats->points_preprocessed = new_cloud->size();
+    }
+}
+
+void StitchedCloud::addPreprocessedCloud(PointCloudT::Ptr new_cloud, const TransformData& transformation, CloudStats* stats)
+{
+    FrameScope scope (stats);
+
     /*          Registration            */
-    // registerWithSAC(new_cloud, 2);
-    registerWithICP(new_cloud, 100);
+    last_registration = Eigen::Matrix4f::Identity();
+    const int iterations = registrationBudget(transformation.confidence);
+    if (iterations > 0)
+    {
+        PointCloudT::Ptr target = registrationTarget(transformation);
+        // registerWithSAC(new_cloud, target, 2);
+        registerWithICP(new_cloud, target, iterations);
+    }
+    integrateCloud(new_cloud);
+}
+
+int StitchedCloud::registrationBudget(const double confidence) const
+{
+    // The more the supplied transformation can be trusted, the less ICP has left to correct
+    // A confidence of 0 (or no transformation file) gets the full budget; trusted transformations are used as they are
+    if (confidence >= skip_confidence)
+    {
+        return 0;
+    }
+    const double c = std::min(std::max(confidence, 0.0), 1.0);
+    return std::max(min_iterations, static_cast<int>(std::round(max_iterations * (1 - c))));
+}
+
+void StitchedCloud::integrateCloud(PointCloudT::Ptr new_cloud, CloudStats* stats)
+{
+    // Adds a cloud that has already been registered to the map
+    FrameScope scope (stats);
+    reserveMap(new_cloud->size());
     *stitched_cloud += *new_cloud;
+    map_index->setInputCloud(stitched_cloud);
+    extendMapFeatures();
+    updateLocalMap(new_cloud);
     /*          Post-Processing         */
-    removeOutliers(stitched_cloud, 100, 2);
-    smoothSurface(stitched_cloud, 500);
+    // Only the cells near the new cloud have changed, so only they are filtered and smoothed again
+    // The first pass covers the whole map, since nothing has been filtered at that point
+    // Flushing tiles empties the per-cell totals, so they cannot tell whether that pass has happened
+    const bool first_pass = !post_processed;
+    const size_t map_points = stitched_cloud->size();
+    removeMapOutliers(dirtyRegion(new_cloud, first_pass), 100, 2);
+    const size_t map_outliers = map_points - stitched_cloud->size();
+    // Removing outliers renumbers points, so the region is gathered again
+    const std::vector<int> region = dirtyRegion(new_cloud, first_pass);
+    smoothMapRegion(region, 500);
+    post_processed = true;
+    // Points further out also have new neighbours, so their features need recomputing too
+    markFeaturesStale(map_index->pointsNear(*new_cloud, 2 * map_index->cellSize()));
+    const size_t map_flushed = flushTiles();
+    extendPyramid(map_flushed ? PointCloudT::Ptr() : new_cloud);
+    if (backend == RegistrationBackend::PointToPlane && target_mode == RegistrationTarget::WholeMap)
+    {
+        // Start the timer
+        auto start = Clock::now();
+
+        // Normals are brought up to date as points arrive, so registration only has to read them
+        updateMapNormals();
+
+        // Record the time
+        recordTime(&StageTimes::normal_time, start);
+    }
+
+    if (frame_stats)
+    {
+        frame_stats->map_outliers = map_outliers;
+        frame_stats->map_smoothed = region.size();
+        frame_stats->map_flushed = map_flushed;
+        frame_stats->map_points = stitched_cloud->size();
+    }
 }
 
-void StitchedCloud::registerWithICP(PointCloudT::Ptr cloud, const int iters)
+std::vector<int> StitchedCloud::dirtyRegion(const PointCloudT::Ptr new_cloud, const bool whole_map)
 {
-    // Transforms 'cloud' such that it more closely aligns with the stitched cloud
+    // Indices of the stitched points whose neighbourhoods may have changed after adding 'new_cloud'
+    // That is every point in the index cells touched by the new cloud, plus a margin of one cell
+    if (whole_map)
+    {
+        std::vector<int> region (stitched_cloud->size());
+        std::iota(region.begin(), region.end(), 0);
+        return region;
+    }
+    return map_index->pointsNear(*new_cloud, map_index->cellSize());
+}
+
+PointCloudT::Ptr StitchedCloud::registrationTarget(const TransformData& prediction)
+{
+    // Selects the points that the next cloud is registered against
+    switch (target_mode)
+    {
+    case RegistrationTarget::SlidingWindow:
+        return local_map;
+    case RegistrationTarget::SpatialCrop:
+    {
+        // Only keep the windowed points within crop_radius of the predicted position
+        // Their normals are cropped along with them
+        PointCloudT::Ptr cropped (new PointCloudT());
+        pcl::PointCloud<pcl::Normal>::Ptr normals (new pcl::PointCloud<pcl::Normal>());
+        cropped->reserve(local_map->size());
+        for (size_t i = 0; i < local_map->size(); ++i)
+        {
+            const PointT& p = local_map->points[i];
+            if (std::abs(p.x - prediction.dx) <= crop_radius &&
+                std::abs(p.y - prediction.dy) <= crop_radius &&
+                std::abs(p.z - prediction.dz) <= crop_radius)
+            {
+                cropped->push_back(p);
+                if (local_normals)
+                {
+                    normals->push_back(local_normals->points[i]);
+                }
+            }
+        }
+        // A poor prediction can leave too few points to register against
+        if (cropped->size() < 10)
+        {
+            return local_map;
+        }
+        cropped_target = cropped;
+        cropped_normals = local_normals ? normals : pcl::PointCloud<pcl::Normal>::Ptr();
+        return cropped;
+    }
+    default:
+        return stitched_cloud;
+    }
+}
+
+pcl::PointCloud<pcl::Normal>::Ptr StitchedCloud::normalsFor(const PointCloudT::Ptr target)
+{
+    // Normals of 'target' for point-to-plane ICP
+    // The stitched, windowed and cropped maps already have theirs; anything else has them estimated here
+
+    // Start the timer
+    auto start = Clock::now();
+
+    pcl::PointCloud<pcl::Normal>::Ptr normals;
+    if (target == stitched_cloud)
+    {
+        updateMapNormals();
+        normals = map_normals;
+    }
+    else if (target == local_map && local_normals)
+    {
+        normals = local_normals;
+    }
+    else if (target == cropped_target && cropped_normals)
+    {
+        normals = cropped_normals;
+    }
+    else
+    {
+        normals.reset(new pcl::PointCloud<pcl::Normal>());
+        estimateNormals(target, pcl::IndicesPtr(), *normals);
+    }
+
+    // Record the time
+    recordTime(&StageTimes::normal_time, start);
+    return normals;
+}
+
+void StitchedCloud::updateLocalMap(const PointCloudT::Ptr cloud)
+{
+    // Appends the newly registered cloud and drops the oldest one once the window is full
+    // Only the points entering the window are indexed and given normals; dropping the oldest cloud shifts the rest of
+    // the window down, a pass over its points and index entries, but nothing is searched or rebuilt
+    const size_t first_new = local_map->size();
+    *local_map += *cloud;
+    local_index->setInputCloud(local_map);
+    if (local_normals)
+    {
+        // Start the timer
+        auto start = Clock::now();
+
+        // Only the new points get normals; those already in the window keep the ones they were given on arrival
+        pcl::IndicesPtr added (new std::vector<int>(cloud->size()));
+        std::iota(added->begin(), added->end(), first_new);
+        pcl::PointCloud<pcl::Normal> normals;
+        estimateNormals(local_map, added, normals);
+        *local_normals += normals;
+
+        // Record the time
+        recordTime(&StageTimes::normal_time, start);
+    }
+    window_clouds.push_back(cloud->size());
+    trimLocalMap();
+}
+
+void StitchedCloud::trimLocalMap()
+{
+    // Clouds are appended in order, so the oldest cloud's points are at the front of local_map
+    // local_map is handed to registration as a plain cloud, so it has to stay contiguous; the points left behind are
+    // moved down rather than kept in a ring
+    while (window_clouds.size() > window_size)
+    {
+        local_index->eraseFront(window_clouds.front(), *local_map);
+        if (local_normals)
+        {
+            local_normals->points.erase(local_normals->points.begin(), local_normals->points.begin() + window_clouds.front());
+            local_normals->width = local_normals->points.size();
+        }
+        window_clouds.pop_front();
+    }
+}
+
+size_t StitchedCloud::flushTiles()
+{
+    // Moves the tiles that have left the registration window out to disk
+    // A tile is finished once it is further from the window than post-processing reaches (two index cells),
+    // so no later cloud can filter, smooth or add features to its points
+    // Returns the number of points flushed
+    if (!tile_store || local_map->empty())
+    {
+        return 0;
+    }
+    const int axis = tile_store->axis();
+    float lo = std::numeric_limits<float>::max();
+    float hi = std::numeric_limits<float>::lowest();
+    for (const PointT& p : local_map->points)
+    {
+        lo = std::min(lo, p.data[axis]);
+        hi = std::max(hi, p.data[axis]);
+    }
+    const double margin = 2 * map_index->cellSize();
+    const int first_active = tile_store->tileOf(lo - margin);
+    const int last_active = tile_store->tileOf(hi + margin);
+
+    std::vector<int> finished;
+    for (size_t i = 0; i < stitched_cloud->size(); ++i)
+    {
+        const int tile = tile_store->tileOf(stitched_cloud->points[i]);
+        if (tile < first_active || tile > last_active)
+        {
+            finished.push_back(i);
+        }
+    }
+    if (finished.empty())
+    {
+        return 0;
+    }
+
+    // Start the timer
+    auto start = Clock::now();
+
+    tile_store->flush(*stitched_cloud, finished);
+
+    // Record the time
+    recordTime(&StageTimes::write_time, start);
+
+    // The flushed cells are never recomputed, so their distance totals are dropped
+    // The map-wide totals keep them, so the outlier threshold still reflects the whole map
+    for (const int i : finished)
+    {
+        cell_distance_stats.erase(map_index->cellKey(i));
+    }
+    eraseMapPoints(finished);
+    return finished.size();
+}
+
+pcl::search::KdTree<PointT>::Ptr StitchedCloud::searchFor(const PointCloudT::Ptr cloud)
+{
+    // Returns a search method that is ready to query 'cloud'
+    // The stitched and local maps have persistent indices; anything else gets a new kd-tree
+    if (cloud == stitched_cloud)
+    {
+        return map_index;
+    }
+    if (cloud == local_map)
+    {
+        return local_index;
+    }
+    pcl::search::KdTree<PointT>::Ptr tree (new pcl::search::KdTree<PointT>);
+    tree->setInputCloud(cloud);
+    return tree;
+}
+
+void StitchedCloud::registerWithICP(PointCloudT::Ptr cloud, PointCloudT::Ptr target, const int iters)
+{
+    // Transforms 'cloud' such that it more closely aligns with 'target'
     // Accurate results but slow run time
 
+    // Looked up before the timer starts, so any normals estimated here count as normal estimation
+    pcl::PointCloud<pcl::Normal>::Ptr target_normals;
+    if (backend == RegistrationBackend::PointToPlane)
+    {
+        target_normals = normalsFor(target);
+    }
+
+    // ICP still needs a search method for the target, if only for the fitness score
+    // When the voxel hash finds the correspondences a VoxelHashIndex stands in for the kd-tree, as it is much cheaper to build
+    auto targetSearch = [&](const PointCloudT::Ptr cloud, const double cell_size) -> pcl::search::KdTree<PointT>::Ptr
+    {
+        if (correspondence_search == CorrespondenceSearch::Tree || cloud == stitched_cloud || cloud == local_map)
+        {
+            return searchFor(cloud);
+        }
+        VoxelHashIndex::Ptr index (new VoxelHashIndex(cell_size));
+        index->setInputCloud(cloud);
+        return index;
+    };
+
     // Start the timer
-    auto start = std::chrono::system_clock::now();
+    auto start = Clock::now();
+
+    // Coarse-to-fine: each pyramid level aligns downsampled copies of both clouds, starting from the result of the
+    // level above, so the full resolution pass starts close to the answer and converges in a few iterations
+    Eigen::Matrix4f guess = Eigen::Matrix4f::Identity();
+    int coarse_iterations = 0;
+    for (PyramidLevel& level : pyramid)
+    {
+        // The level keeps its downsampler, and the working clouds come from the pool, so their storage is reused
+        PointCloudT::Ptr coarse_cloud = scratch_clouds.acquire();
+        level.cloud_grid.clear();
+        level.cloud_grid.add(*cloud);
+        level.cloud_grid.getCloud(*coarse_cloud);
+        PointCloudT::Ptr coarse_target = pyramidTarget(level, target);
+        if (coarse_cloud->size() < 10 || coarse_target->size() < 10)
+        {
+            continue;
+        }
+        CountingICP coarse_icp;
+        coarse_icp.setMaximumIterations(iters);
+        coarse_icp.setMaxCorrespondenceDistance(3 * level.leaf_size);
+        coarse_icp.setInputSource(coarse_cloud);
+        coarse_icp.setInputTarget(coarse_target);
+        if (correspondence_search == CorrespondenceSearch::VoxelHash)
+        {
+            coarse_icp.setCorrespondenceEstimation(VoxelHashCorrespondence::Ptr(new VoxelHashCorrespondence(3 * level.leaf_size)));
+        }
+        coarse_icp.setSearchMethodTarget(targetSearch(coarse_target, 3 * level.leaf_size), true);
+        PointCloudT::Ptr aligned = scratch_clouds.acquire();
+        coarse_icp.align(*aligned, guess);
+        guess = coarse_icp.getFinalTransformation();
+        coarse_iterations += coarse_icp.iterations();
+    }
 
-    pcl::IterativeClosestPoint<PointT, PointT> icp;
+    CountingICP icp;
     icp.setMaximumIterations(iters);
     icp.setInputSource(cloud);
-    icp.setInputTarget(stitched_cloud);
-    PointCloudT::Ptr registered_cloud (new PointCloudT());
-    icp.align(*cloud);
+    icp.setInputTarget(target);
+    if (correspondence_search == CorrespondenceSearch::VoxelHash)
+    {
+        icp.setMaxCorrespondenceDistance(correspondence_cell_size);
+        icp.setCorrespondenceEstimation(VoxelHashCorrespondence::Ptr(new VoxelHashCorrespondence(correspondence_cell_size)));
+    }
+    icp.setSearchMethodTarget(targetSearch(target, correspondence_cell_size), true);
+    // The coarse levels only need to get close, so only the full resolution pass minimises point-to-plane distances
+    if (target_normals)
+    {
+        icp.setTransformationEstimation(PointToPlaneEstimation::Ptr(new PointToPlaneEstimation(target_normals)));
+    }
+    // The source is left as it was until the fitness has been measured, since PCL scores the final transformation
+    // against the source points as given
+    PointCloudT::Ptr aligned = scratch_clouds.acquire();
+    icp.align(*aligned, guess);
+    if (frame_stats)
+    {
+        frame_stats->icp_iterations += coarse_iterations + icp.iterations();
+        frame_stats->icp_fitness = measure_fitness ? icp.getFitnessScore() : 0;
+        frame_stats->icp_converged = icp.hasConverged();
+    }
+    cloud->points.swap(aligned->points);
+    cloud->width = cloud->points.size();
+    cloud->height = 1;
 
     // Stop the timer
-    auto end = std::chrono::system_clock::now();
-    timeBreakdown.icp_time += (end - start) / 1000;
+    recordTime(&StageTimes::icp_time, start);
 
     // Revert the translation in the z axis
     TransformData t;
     t.dz = -icp.getFinalTransformation()(2,3);
     transform(cloud, t);
+    last_registration = t.affine().matrix() * icp.getFinalTransformation() * last_registration;
 }
 
-void StitchedCloud::registerWithSAC(PointCloudT::Ptr cloud, const int iters)
+void StitchedCloud::registerWithSAC(PointCloudT::Ptr cloud, PointCloudT::Ptr target, const int iters)
 {
-    // Transforms 'cloud' such that it more closely aligns with the stitched cloud
+    // Transforms 'cloud' such that it more closely aligns with 'target'
     // Sampled consensus initial alignment
     // Useful for fast but rough registration
 
     // Start the timer
-    auto start = std::chrono::system_clock::now();
+    auto start = Clock::now();
 
     // Estimate normals in the cloud
     pcl::PointCloud<pcl::Normal>::Ptr src_normals (new pcl::PointCloud<pcl::Normal> ());
     pcl::PointCloud<pcl::Normal>::Ptr stitched_normals (new pcl::PointCloud<pcl::Normal> ());
+    // Normals and features take prefixes of the same neighbourhoods, so they are searched for once
     pcl::NormalEstimationOMP<PointT, pcl::Normal> normal_est;
     pcl::search::KdTree<PointT>::Ptr tree (new pcl::search::KdTree<PointT>);
-    normal_est.setSearchMethod(tree);;
+    tree->setInputCloud(cloud);
+    NeighbourhoodGraph::Ptr graph (new NeighbourhoodGraph(num_threads));
+    graph->build(cloud, *tree, 250);
+    GraphSearch::Ptr source_search (new GraphSearch(graph, tree));
+    normal_est.setNumberOfThreads(num_threads);
+    normal_est.setSearchMethod(source_search);
     normal_est.setKSearch(100);
     normal_est.setInputCloud(cloud);
     normal_est.compute(*src_normals);
-    normal_est.setInputCloud(stitched_cloud);
-    normal_est.compute(*stitched_normals);
 
     // Locate features using the normals and clouds
     pcl::FPFHEstimationOMP<PointT, pcl::Normal, pcl::FPFHSignature33> fpfh;
     pcl::PointCloud<pcl::FPFHSignature33>::Ptr src_features (new pcl::PointCloud<pcl::FPFHSignature33> ());
     pcl::PointCloud<pcl::FPFHSignature33>::Ptr stitched_features (new pcl::PointCloud<pcl::FPFHSignature33> ());
-    fpfh.setSearchMethod(tree);
+    fpfh.setNumberOfThreads(num_threads);
+    fpfh.setSearchMethod(source_search);
     fpfh.setKSearch(250);       // must be larger than value for normals
     fpfh.setInputCloud(cloud);
     fpfh.setInputNormals(src_normals);
     fpfh.compute(*src_features);
-    fpfh.setInputCloud(stitched_cloud);
-    fpfh.setInputNormals(stitched_normals);
-    fpfh.compute(*stitched_features);
+
+    if (target == stitched_cloud)
+    {
+        // The map's features are cached and only recomputed where new points have arrived
+        updateMapFeatures();
+        stitched_normals = map_normals;
+        stitched_features = map_features;
+    }
+    else
+    {
+        pcl::search::KdTree<PointT>::Ptr target_tree = searchFor(target);
+        normal_est.setSearchMethod(target_tree);
+        normal_est.setInputCloud(target);
+        normal_est.compute(*stitched_normals);
+        fpfh.setSearchMethod(target_tree);
+        fpfh.setInputCloud(target);
+        fpfh.setInputNormals(stitched_normals);
+        fpfh.compute(*stitched_features);
+    }
 
     // Use the features found to perform the alignment
     pcl::SampleConsensusInitialAlignment<PointT, PointT, pcl::FPFHSignature33> sac_ia;
     sac_ia.setMaximumIterations(iters);
     // Stitched
-    sac_ia.setInputTarget(stitched_cloud);
+    sac_ia.setInputTarget(target);
     sac_ia.setTargetFeatures(stitched_features);
     // Un-registered cloud
     sac_ia.setInputSource(cloud);
     sac_ia.setSourceFeatures(src_features);
     sac_ia.align(*cloud);
+    last_registration = sac_ia.getFinalTransformation() * last_registration;
 
     // Record the time
-    auto end = std::chrono::system_clock::now();
-    timeBreakdown.sac_time += (end - start) / 1000;
+    recordTime(&StageTimes::sac_time, start);
+}
+
+void StitchedCloud::reserveMap(const size_t extra)
+{
+    // Grows the stitched cloud by half again whenever it runs out of room, rather than to exactly the size needed,
+    // so the map is only copied a logarithmic number of times as it grows
+    // Points flushed or removed leave their storage behind for the next clouds
+    const size_t needed = stitched_cloud->size() + extra;
+    if (needed > stitched_cloud->points.capacity())
+    {
+        stitched_cloud->reserve(std::max(needed, stitched_cloud->points.capacity() * 3 / 2));
+    }
+}
+
+void StitchedCloud::eraseMapPoints(const std::vector<int>& indices)
+{
+    // Removes points from the stitched cloud, its index and its cached features together
+    map_index->erase(indices, *stitched_cloud);
+    if (region_graph->cloud())
+    {
+        region_graph->erase(indices);
+    }
+    if (map_normals)
+    {
+        VoxelHashIndex::swapRemove(indices, map_normals->points);
+        VoxelHashIndex::swapRemove(indices, normals_stale);
+        map_normals->width = map_normals->points.size();
+    }
+    if (map_features)
+    {
+        VoxelHashIndex::swapRemove(indices, map_features->points);
+        VoxelHashIndex::swapRemove(indices, features_stale);
+        map_features->width = map_features->points.size();
+    }
+}
+
+void StitchedCloud::extendMapFeatures()
+{
+    // Points appended to the stitched cloud start with stale normals and features
+    if (map_normals)
+    {
+        map_normals->resize(stitched_cloud->size());
+        normals_stale.resize(stitched_cloud->size(), 1);
+    }
+    if (map_features)
+    {
+        map_features->resize(stitched_cloud->size());
+        features_stale.resize(stitched_cloud->size(), 1);
+    }
+}
+
+void StitchedCloud::markFeaturesStale(const std::vector<int>& indices)
+{
+    if (map_normals)
+    {
+        for (const int i : indices)
+        {
+            normals_stale[i] = 1;
+        }
+    }
+    if (map_features)
+    {
+        for (const int i : indices)
+        {
+            features_stale[i] = 1;
+        }
+    }
+}
+
+void StitchedCloud::updateMapNormals()
+{
+    // Recomputes the normals of the stale points of the stitched cloud
+    // Neighbours still come from the whole map, so each recomputed point sees the same neighbourhood as before
+    if (!map_normals)
+    {
+        map_normals.reset(new pcl::PointCloud<pcl::Normal>());
+        extendMapFeatures();
+    }
+
+    pcl::IndicesPtr stale (new std::vector<int>());
+    for (size_t i = 0; i < normals_stale.size(); ++i)
+    {
+        if (normals_stale[i])
+        {
+            stale->push_back(i);
+        }
+    }
+    if (stale->empty())
+    {
+        return;
+    }
+
+    pcl::PointCloud<pcl::Normal> normals;
+    estimateNormals(stitched_cloud, stale, normals);
+    for (size_t j = 0; j < stale->size(); ++j)
+    {
+        map_normals->points[(*stale)[j]] = normals.points[j];
+        normals_stale[(*stale)[j]] = 0;
+    }
+}
+
+void StitchedCloud::updateMapFeatures()
+{
+    // Recomputes the FPFH signatures of the stale points of the stitched cloud, after bringing the normals up to date
+    if (!map_features)
+    {
+        map_features.reset(new pcl::PointCloud<pcl::FPFHSignature33>());
+        extendMapFeatures();
+    }
+    updateMapNormals();
+
+    pcl::IndicesPtr stale (new std::vector<int>());
+    for (size_t i = 0; i < features_stale.size(); ++i)
+    {
+        if (features_stale[i])
+        {
+            stale->push_back(i);
+        }
+    }
+    if (stale->empty())
+    {
+        return;
+    }
+
+    pcl::PointCloud<pcl::FPFHSignature33> features;
+    pcl::FPFHEstimationOMP<PointT, pcl::Normal, pcl::FPFHSignature33> fpfh;
+    fpfh.setNumberOfThreads(num_threads);
+    fpfh.setSearchMethod(map_index);
+    fpfh.setKSearch(250);
+    fpfh.setInputCloud(stitched_cloud);
+    fpfh.setInputNormals(map_normals);
+    fpfh.setIndices(stale);
+    fpfh.compute(features);
+    for (size_t j = 0; j < stale->size(); ++j)
+    {
+        map_features->points[(*stale)[j]] = features.points[j];
+        features_stale[(*stale)[j]] = 0;
+    }
+}
+
+void StitchedCloud::estimateNormals(const PointCloudT::Ptr cloud, const pcl::IndicesPtr& indices, pcl::PointCloud<pcl::Normal>& normals)
+{
+    // Normals from the 100 nearest neighbours in 'cloud', of the points in 'indices' or of every point
+    pcl::NormalEstimationOMP<PointT, pcl::Normal> normal_est;
+    normal_est.setNumberOfThreads(num_threads);
+    normal_est.setSearchMethod(searchFor(cloud));
+    normal_est.setKSearch(100);
+    normal_est.setInputCloud(cloud);
+    if (indices)
+    {
+        normal_est.setIndices(indices);
+    }
+    normal_est.compute(normals);
 }
 
 void StitchedCloud::removeOutliers(PointCloudT::Ptr cloud, const int num_neighbours, const int stddev)
 {
     // Start the timer
-    auto start = std::chrono::system_clock::now();
+    auto start = Clock::now();
 
-    pcl::StatisticalOutlierRemoval<PointT> sor;
-    sor.setInputCloud(cloud);
-    sor.setMeanK(num_neighbours);        // The number of neighbours to analyse
-    sor.setStddevMulThresh(stddev);      // Standard deviation multiplier
-    sor.filter(*cloud);
+    // Statistical outlier removal, with the neighbourhoods found in parallel through a single kd-tree
+    // Clouds are preprocessed on several threads at once, so each thread keeps the graph's storage for its next cloud
+    thread_local NeighbourhoodGraph graph;
+    graph.setNumThreads(num_threads);
+    pcl::search::KdTree<PointT> tree;
+    tree.setInputCloud(cloud);
+    graph.build(cloud, tree, num_neighbours + 1);
+    const std::vector<int> kept = statisticalInliers(graph, num_neighbours, stddev);
+    graph.clear();
+    for (size_t j = 0; j < kept.size(); ++j)
+    {
+        cloud->points[j] = cloud->points[kept[j]];
+    }
+    cloud->points.resize(kept.size());
+    cloud->width = kept.size();
+    cloud->height = 1;
 
     // Record the time
-    auto end = std::chrono::system_clock::now();
-    timeBreakdown.sor_time += (end - start) / 1000;
+    recordTime(&StageTimes::sor_time, start);
+}
+
+void StitchedCloud::removeMapOutliers(const std::vector<int>& region, const int num_neighbours, const int stddev)
+{
+    // Statistical outlier removal over part of the stitched cloud, as in pcl::StatisticalOutlierRemoval
+    // Mean neighbour distances are recomputed for the points in 'region' only, and the threshold comes from
+    // running totals over the whole map, so the result approximates a pass over the entire cloud
+
+    // Start the timer
+    auto start = Clock::now();
+
+    // Drop the old totals of every cell being recomputed
+    // 'region' always covers whole cells
+    for (const int i : region)
+    {
+        auto it = cell_distance_stats.find(map_index->cellKey(i));
+        if (it != cell_distance_stats.end())
+        {
+            map_distance_stats.sum -= it->second.sum;
+            map_distance_stats.sq_sum -= it->second.sq_sum;
+            map_distance_stats.count -= it->second.count;
+            cell_distance_stats.erase(it);
+        }
+    }
+
+    // Mean distance from each point to its neighbours, searched in parallel
+    // The neighbourhoods are kept for smoothing the region afterwards
+    region_graph->build(stitched_cloud, *map_index, num_neighbours + 1, region);
+    std::vector<float> mean_distances;
+    std::vector<uint8_t> valid;
+    region_graph->meanDistances(num_neighbours, mean_distances, valid);
+    for (size_t r = 0; r < region.size(); ++r)
+    {
+        if (valid[r])
+        {
+            cell_distance_stats[map_index->cellKey(region[r])].add(mean_distances[r]);
+            map_distance_stats.add(mean_distances[r]);
+        }
+    }
+
+    const DistanceStats& stats = map_distance_stats;
+    if (stats.count > 1)
+    {
+        const double mean = stats.sum / stats.count;
+        const double variance = std::max(0.0, (stats.sq_sum - stats.sum * stats.sum / stats.count) / (stats.count - 1));
+        const double threshold = mean + stddev * std::sqrt(variance);
+        std::vector<int> outliers;
+        for (size_t r = 0; r < region.size(); ++r)
+        {
+            if (valid[r] && mean_distances[r] > threshold)
+            {
+                cell_distance_stats[map_index->cellKey(region[r])].remove(mean_distances[r]);
+                map_distance_stats.remove(mean_distances[r]);
+                outliers.push_back(region[r]);
+            }
+        }
+        eraseMapPoints(outliers);
+    }
+
+    // Record the time
+    recordTime(&StageTimes::sor_time, start);
 }
 
 void StitchedCloud::downSample(PointCloudT::Ptr cloud, const int leaf_size)
 {
     // Start the timer
-    auto start = std::chrono::system_clock::now();
+    auto start = Clock::now();
 
     // Smaller leaf sizes makes the cloud more accurate but also signficantly slower
-    pcl::VoxelGrid<PointT> grid;
-    grid.setLeafSize(leaf_size, leaf_size, leaf_size);
-    grid.setInputCloud(cloud);
+    // Hashing the voxels avoids pcl::VoxelGrid's index overflow on long tunnels
+    VoxelDownsampler grid (leaf_size, VoxelDownsampler::Centroid, num_threads);
     grid.filter(*cloud);
 
     // Record the time
-    auto end = std::chrono::system_clock::now();
-    timeBreakdown.downsample_time += (end - start) / 1000;
+    recordTime(&StageTimes::downsample_time, start);
 }
 
 void StitchedCloud::transform(PointCloudT::Ptr cloud, const TransformData& t)
 {
     // Start the timer
-    auto start = std::chrono::system_clock::now();
+    auto start = Clock::now();
 
-    Eigen::Affine3f transform = Eigen::Affine3f::Identity();
-    transform.translation() << t.dx, t.dy, t.dz;
-    transform.rotate (Eigen::AngleAxisf (-t.rotx, Eigen::Vector3f::UnitX()));
-    transform.rotate (Eigen::AngleAxisf (-t.roty, Eigen::Vector3f::UnitY()));
-    transform.rotate (Eigen::AngleAxisf (-t.rotz, Eigen::Vector3f::UnitZ()));
-    pcl::transformPointCloud(*cloud, *cloud, transform);
+    pcl::transformPointCloud(*cloud, *cloud, t.affine());
 
     // Record the time
-    auto end = std::chrono::system_clock::now();
-    timeBreakdown.transform_time += (end - start) / 1000;
+    recordTime(&StageTimes::transform_time, start);
 }
 
 void StitchedCloud::filterRangeZ(PointCloudT::Ptr cloud, const double minZ, const double maxZ)
 {
     // Start the timer
-    auto start = std::chrono::system_clock::now();
+    auto start = Clock::now();
 
     pcl::PassThrough<PointT> pass;
     pass.setInputCloud(cloud);
@@ -162,18 +923,116 @@ void StitchedCloud::filterRangeZ(PointCloudT::Ptr cloud, const double minZ, cons
     pass.filter(*cloud);
 
     // Record the time
-    auto end = std::chrono::system_clock::now();
-    timeBreakdown.passthrough_time += (end - start) / 1000;
+    recordTime(&StageTimes::passthrough_time, start);
 }
 
-void StitchedCloud::reconstructSurface(pcl::PointCloud<pcl::PointNormal>::Ptr mls_points, const PointCloudT::Ptr cloud, const double radius)
+template <typename Source>
+void StitchedCloud::fusedPreprocess(const Source& source, PointCloudT& output, const Eigen::Affine3f& transformation,
+                                    const double minZ, const double maxZ, const int leaf_size)
 {
-    pcl::search::KdTree<PointT>::Ptr tree (new pcl::search::KdTree<PointT>);
+    // NaN removal, rigid transformation, Z passthrough and voxel-centroid downsampling in a single pass
+    // Points stream through in chunks small enough to stay in cache, and each step runs as its own tight
+    // loop over the chunk so the transformation vectorises and every step can still be timed separately
+    // The voxel grid is aligned with the transformed (map) frame
+    // 'source' is fully read before 'output' is written, so the two may be the same cloud
+    Clock::duration nan_elapsed (0), transform_elapsed (0), passthrough_elapsed (0), downsample_elapsed (0);
+
+    // The buffers and the voxels are kept per thread and reused, so after the first frame nothing here allocates
+    const size_t chunk_size = 4096;
+    thread_local PointCloudT::VectorType chunk (chunk_size);
+    thread_local PointCloudT::VectorType transformed (chunk_size);
+    const Eigen::Matrix4f matrix = transformation.matrix();
+
+    thread_local VoxelDownsampler voxels (leaf_size);
+    if (voxels.leafSize() != leaf_size)
+    {
+        voxels = VoxelDownsampler(leaf_size);
+    }
+    voxels.clear();
+    size_t points_finite = 0, points_in_range = 0;
+
+    for (size_t begin = 0; begin < source.size(); begin += chunk_size)
+    {
+        const size_t end = std::min(begin + chunk_size, source.size());
+        auto t0 = Clock::now();
+
+        // Keep the finite points, without branching on each one
+        size_t n = 0;
+        for (size_t i = begin; i < end; ++i)
+        {
+            const PointT p = source[i];
+            chunk[n] = p;
+            n += std::isfinite(p.x) & std::isfinite(p.y) & std::isfinite(p.z);
+        }
+        auto t1 = Clock::now();
+
+        // With the fourth coordinate set to 1 one 4x4 product applies both the rotation and the translation
+        Eigen::Map<Eigen::Matrix<float, 4, Eigen::Dynamic>, Eigen::Aligned> in (chunk[0].data, 4, n);
+        Eigen::Map<Eigen::Matrix<float, 4, Eigen::Dynamic>, Eigen::Aligned> out (transformed[0].data, 4, n);
+        in.row(3).setOnes();
+        out.noalias() = matrix * in;
+        auto t2 = Clock::now();
+
+        size_t kept = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            const PointT& p = transformed[i];
+            transformed[kept] = p;
+            kept += (p.z >= minZ) & (p.z <= maxZ);
+        }
+        auto t3 = Clock::now();
+
+        voxels.add(transformed.data(), kept);
+        auto t4 = Clock::now();
+        points_finite += n;
+        points_in_range += kept;
+
+        nan_elapsed += t1 - t0;
+        transform_elapsed += t2 - t1;
+        passthrough_elapsed += t3 - t2;
+        downsample_elapsed += t4 - t3;
+    }
+
+    // Every input point has been read, so the centroids can be written over the input storage
+    if (frame_stats)
+    {
+        frame_stats->points_read = source.size();
+        frame_stats->points_finite = points_finite;
+        frame_stats->points_in_range = points_in_range;
+        frame_stats->points_downsampled = voxels.size();
+    }
+    auto t5 = Clock::now();
+    voxels.getCloud(output);
+    downsample_elapsed += Clock::now() - t5;
+
+    // Record the time
+    recordTime(&StageTimes::nan_time, nan_elapsed);
+    recordTime(&StageTimes::transform_time, transform_elapsed);
+    recordTime(&StageTimes::passthrough_time, passthrough_elapsed);
+    recordTime(&StageTimes::downsample_time, downsample_elapsed);
+}
+
+void StitchedCloud::reconstructSurface(pcl::PointCloud<pcl::PointNormal>::Ptr mls_points, const PointCloudT::Ptr cloud, const double radius,
+                                       const pcl::IndicesPtr& indices)
+{
+    // Only the points in 'indices' are projected, but their neighbours are taken from the whole cloud
     pcl::MovingLeastSquares<PointT, pcl::PointNormal> mls;
     mls.setComputeNormals(true);
     mls.setInputCloud(cloud);
+    if (indices)
+    {
+        mls.setIndices(indices);
+    }
     mls.setPolynomialFit(true);
-    mls.setSearchMethod(tree);
+    if (cloud == stitched_cloud && region_graph->cloud())
+    {
+        // Most neighbourhoods were already found by outlier removal
+        mls.setSearchMethod(GraphSearch::Ptr(new GraphSearch(region_graph, map_index)));
+    }
+    else
+    {
+        mls.setSearchMethod(searchFor(cloud));
+    }
     mls.setSearchRadius(radius);
     mls.process(*mls_points);
 }
@@ -181,13 +1040,82 @@ void StitchedCloud::reconstructSurface(pcl::PointCloud<pcl::PointNormal>::Ptr ml
 void StitchedCloud::smoothSurface(PointCloudT::Ptr cloud, const double radius)
 {
     // Start the timer
-    auto start = std::chrono::system_clock::now();
+    auto start = Clock::now();
 
     pcl::PointCloud<pcl::PointNormal>::Ptr mls_points (new pcl::PointCloud<pcl::PointNormal>());
     reconstructSurface(mls_points, cloud, radius);
     pcl::copyPointCloud(*mls_points, *cloud);
+    // Every point may have moved
+    if (cloud == stitched_cloud)
+    {
+        map_index->rebuild();
+        if (map_normals)
+        {
+            map_normals->clear();
+            normals_stale.clear();
+        }
+        if (map_features)
+        {
+            map_features->clear();
+            features_stale.clear();
+        }
+        extendMapFeatures();
+    }
 
     // Record the time
-    auto end = std::chrono::system_clock::now();
-    timeBreakdown.smooth_time += (end - start) / 1000;
+    recordTime(&StageTimes::smooth_time, start);
+}
+
+void StitchedCloud::smoothMapRegion(const std::vector<int>& region, const double radius)
+{
+    // Smooths the points in 'region' of the stitched cloud, using neighbours from the whole map
+    // The smoothed points replace the originals in both the cloud and the map index
+
+    // Start the timer
+    auto start = Clock::now();
+
+    pcl::IndicesPtr indices (new std::vector<int>(region));
+    reconstructSurface(smoothed_points, stitched_cloud, radius, indices);
+    // The smoothed points are about to replace the region, so its neighbourhoods are no use any more
+    region_graph->clear();
+
+    // MLS drops points with too few neighbours, so the output is appended rather than written back in place
+    eraseMapPoints(region);
+    reserveMap(smoothed_points->size());
+    for (const pcl::PointNormal& p : smoothed_points->points)
+    {
+        stitched_cloud->push_back(PointT(p.x, p.y, p.z));
+    }
+    map_index->setInputCloud(stitched_cloud);
+    extendMapFeatures();
+
+    // Record the time
+    recordTime(&StageTimes::smooth_time, start);
+}
+
+void StitchedCloud::addTime(Seconds StageTimes::* stage, const Seconds elapsed, CloudStats* stats)
+{
+    if (stats)
+    {
+        stats->times.*stage += elapsed;
+    }
+    std::lock_guard<std::mutex> lock (time_mutex);
+    timeBreakdown.*stage += elapsed;
+}
+
+void StitchedCloud::recordTime(Seconds StageTimes::* stage, const Clock::time_point& start)
+{
+    recordTime(stage, Clock::now() - start);
+}
+
+void StitchedCloud::recordTime(Seconds StageTimes::* stage, const Clock::duration& elapsed)
+{
+    // Preprocessing can run on several threads at once, so the totals are updated under a lock
+    // The stats of a single cloud are only ever touched by the thread processing it
+    if (frame_stats)
+    {
+        frame_stats->times.*stage += elapsed;
+    }
+    std::lock_guard<std::mutex> lock (time_mutex);
+    timeBreakdown.*stage += elapsed;
 }
@@ -2,6 +2,10 @@
 #define STITCHED_CLOUD_H
 
 #include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <numeric>
 
 #include <boost/progress.hpp>
 
@@ -10,7 +14,6 @@
 #include <pcl/io/pcd_io.h>
 #include <pcl/point_types.h>
 #include <pcl/point_representation.h>
-#include <pcl/filters/statistical_outlier_removal.h>
 #include <pcl/point_cloud.h>
 #include <pcl/filters/passthrough.h>
 #include <pcl/kdtree/kdtree_flann.h>
@@ -24,6 +27,17 @@
 #include <pcl/registration/ndt.h>
 #include <pcl/features/fpfh_omp.h>
 
+#include <cloud_pool.h>
+#include <instrumentation.h>
+#include <lod_octree.h>
+#include <neighbourhood_graph.h>
+#include <pcd_file.h>
+#include <point_to_plane.h>
+#include <tile_store.h>
+#include <voxel_correspondence.h>
+#include <voxel_downsampler.h>
+#include <voxel_hash_index.h>
+
 typedef pcl::PointXYZ PointT;
 typedef pcl::PointCloud<PointT> PointCloudT;
 
@@ -67,64 +81,248 @@ struct TransformData
       t.confidence = this->confidence - other.confidence;
       return t;
     }
+    Eigen::Affine3f affine() const
+    {
+      Eigen::Affine3f transform = Eigen::Affine3f::Identity();
+      transform.translation() << dx, dy, dz;
+      transform.rotate (Eigen::AngleAxisf (-rotx, Eigen::Vector3f::UnitX()));
+      transform.rotate (Eigen::AngleAxisf (-roty, Eigen::Vector3f::UnitY()));
+      transform.rotate (Eigen::AngleAxisf (-rotz, Eigen::Vector3f::UnitZ()));
+      return transform;
+    }
+};
+
+// Which points new clouds are registered against
+enum class RegistrationTarget
+{
+    WholeMap,       // The entire stitched cloud
+    SlidingWindow,  // Only the last N registered clouds
+    SpatialCrop     // The last N registered clouds, cropped around the predicted pose
+};
+
+// What ICP minimises
+enum class RegistrationBackend
+{
+    PointToPoint,   // Distances between matched points
+    PointToPlane    // Distances from each point to the tangent plane at its match, using the target's normals
 };
 
-struct TimeBreakdown
+// How ICP finds the closest target point to each source point
+enum class CorrespondenceSearch
 {
-    // Store the time in seconds to complete various operations
-    std::chrono::duration<double, std::ratio<1, 1000> > read_write_time;
-    std::chrono::duration<double, std::ratio<1, 1000> > downsample_time;
-    std::chrono::duration<double, std::ratio<1, 1000> > sor_time;
-    std::chrono::duration<double, std::ratio<1, 1000> > transform_time;
-    std::chrono::duration<double, std::ratio<1, 1000> > passthrough_time;
-    std::chrono::duration<double, std::ratio<1, 1000> > icp_time;
-    std::chrono::duration<double, std::ratio<1, 1000> > sac_time;
-    std::chrono::duration<double, std::ratio<1, 1000> > smooth_time;
-    std::chrono::duration<double, std::ratio<1, 1000> > total_time;
+    Tree,       // Nearest neighbour search through the target's kd-tree or voxel hash index
+    VoxelHash   // Lookup in the point's own and neighbouring cells of a FlatVoxelGrid; pairs further apart than a cell are ignored
+};
+
+struct TimeBreakdown : public StageTimes
+{
+    // Totals over the whole run of the time spent in each stage
+    // Preprocessing runs on several threads at once, so the stages can add up to more than the total
+    Seconds total_time {0};
 
     void print()
     {
-        read_write_time = total_time - downsample_time - sor_time - transform_time - passthrough_time
-                                     - icp_time - sac_time - smooth_time;
-        const int w = 4;
+        const Seconds other = total_time - sum();
+        auto row = [&](const char* name, const Seconds& time)
+        {
+            std::cout << std::setw(23) << name << std::setw(10) << std::fixed << std::setprecision(3) << time.count() << "s"
+                      << std::setw(6) << std::setprecision(0) << 100 * time.count() / total_time.count() << "%\n";
+        };
+        auto orig_flags = std::cout.flags();
         auto orig_prec = std::cout.precision();
-        std::cout << std::setprecision(2)
-                  << "Processing Time Breakdown\n"
-                  << "_____________________________\n"
-                  << std::setw(23) << "Read/Write\t" << std::setw(w) << round(100*read_write_time.count()/total_time.count()) << "%\n"
-                  << std::setw(23) << "Downsampling\t" << std::setw(w) << round(100*downsample_time.count()/total_time.count()) << "%\n"
-                  << std::setw(23) << "Outlier removal\t" << std::setw(w) << round(100*sor_time.count()/total_time.count()) << "%\n"
-                  << std::setw(23) << "Transformation\t" << std::setw(w) << round(100*transform_time.count()/total_time.count()) << "%\n"
-                  << std::setw(23) << "Passthrough filter\t" << std::setw(w) << round(100*passthrough_time.count()/total_time.count()) << "% \n"
-                  << std::setw(23) << "ICP\t" << std::setw(w) << round(100*icp_time.count()/total_time.count()) << "%\n"
-                  << std::setw(23) << "SAC IA\t" << std::setw(w) << round(100*sac_time.count()/total_time.count()) << "%\n"
-                  << std::setw(23) << "Surface reconstruction\t" << std::setw(w) << round(100*smooth_time.count()/total_time.count()) << "%\n"
-                  << "=============================\n"
-                  << std::setw(23) << "Total time" << std::setprecision(orig_prec) << std::setw(w+10) << total_time.count() << "s\n"
-                  << "_____________________________\n" << std::endl;
+        std::cout << "Processing Time Breakdown\n"
+                  << "________________________________________\n";
+        row("Read", read_time);
+        row("Write", write_time);
+        row("NaN removal", nan_time);
+        row("Downsampling", downsample_time);
+        row("Outlier removal", sor_time);
+        row("Transformation", transform_time);
+        row("Passthrough filter", passthrough_time);
+        row("Normal estimation", normal_time);
+        row("ICP", icp_time);
+        row("SAC IA", sac_time);
+        row("Surface reconstruction", smooth_time);
+        row("Other", other);
+        std::cout << "========================================\n";
+        row("Total time", total_time);
+        std::cout << "________________________________________\n" << std::endl;
+        std::cout.flags(orig_flags);
+        std::cout.precision(orig_prec);
     }
 };
 
+// ICP that stops once the alignment has settled, and reports how many iterations it ran
+class CountingICP : public pcl::IterativeClosestPoint<PointT, PointT>
+{
+public:
+    CountingICP()
+    {
+        // PCL reads the fitness epsilon as the relative change in mean squared error between iterations, which ends
+        // most runs early; the transformation epsilon doubles as 1 - cos(rotation), so it has to stay tiny
+        setEuclideanFitnessEpsilon(1e-4);
+        setTransformationEpsilon(1e-8);
+    }
+
+    int iterations() const { return nr_iterations_; }
+};
+
 // The resultant cloud after multiple point clouds have been registered
 class StitchedCloud
 {
 public:
-    StitchedCloud(PointCloudT::Ptr point_cloud);
-    void addCloud(PointCloudT::Ptr new_cloud, const TransformData& transformation);
+    // Every stage of the map uses up to 'num_threads' threads, so several maps can share a machine without
+    // oversubscribing it
+    StitchedCloud(PointCloudT::Ptr point_cloud, const int num_threads = std::thread::hardware_concurrency());
+    // Each step also records its timings and point counts in 'stats', when given
+    void addCloud(PointCloudT::Ptr new_cloud, const TransformData& transformation, CloudStats* stats = nullptr);
+    // addCloud split into its two halves; preprocessCloud is safe to call from several threads
+    void preprocessCloud(PointCloudT::Ptr new_cloud, const TransformData& transformation, CloudStats* stats = nullptr);
+    void preprocessCloud(const MappedPCD& file, PointCloudT::Ptr new_cloud, const TransformData& transformation,
+                         CloudStats* stats = nullptr);
+    void addPreprocessedCloud(PointCloudT::Ptr new_cloud, const TransformData& transformation, CloudStats* stats = nullptr);
+    void integrateCloud(PointCloudT::Ptr new_cloud, CloudStats* stats = nullptr);
+    void setRegistrationTarget(const RegistrationTarget target, const int window_size = 10, const double crop_radius = 20000);
+    // ICP gets up to 'max_iterations', fewer the more confident the supplied transformation is,
+    // and none at all from 'skip_confidence' upwards
+    void setRegistrationBudget(const int max_iterations = 100, const int min_iterations = 5, const double skip_confidence = 0.95);
+    // Registers against downsampled copies of the target at each of 'leaf_sizes' before the full resolution pass
+    void setRegistrationPyramid(std::vector<double> leaf_sizes);
+    // Point-to-plane keeps normals of the map up to date as clouds are added
+    void setRegistrationBackend(const RegistrationBackend backend);
+    void setCorrespondenceSearch(const CorrespondenceSearch search, const double cell_size = 1000);
+    // Records the ICP fitness of each frame in its CloudStats; off by default, as it costs another search of every point
+    void setFitnessMeasurement(const bool enabled) { measure_fitness = enabled; }
+    // Keeps only the part of the map around the registration window as floats, flushing the rest to 'directory' or,
+    // with quantized storage, to compact tiles in memory
+    void enableTiling(const std::string& directory, const double tile_length, const TileStorage storage = TileStorage::Disk);
+    // Writes the map to 'path', and adds its points to 'octree' too if one is given
+    void writeMap(const std::string& path, const PCDFormat format, LodOctreeWriter* octree = nullptr);
+    // Adds time spent on the map outside its own stages, such as reading and writing files, to timeBreakdown and to
+    // 'stats' if given; safe alongside preprocessing on other threads
+    void addTime(Seconds StageTimes::* stage, const Seconds elapsed, CloudStats* stats = nullptr);
+    // Transformation that registration applied to the last cloud passed to addPreprocessedCloud
+    const Eigen::Matrix4f& lastRegistration() const { return last_registration; }
 
     PointCloudT::Ptr stitched_cloud;    // Avoids using boost shared pointers
 
     TimeBreakdown timeBreakdown;
 private:
+    friend class StitchedCloudBenchmark;
+
     // Helper functions
-    void registerWithICP(PointCloudT::Ptr cloud, const int iters);
-    void registerWithSAC(PointCloudT::Ptr cloud, const int iters);
+    void registerWithICP(PointCloudT::Ptr cloud, PointCloudT::Ptr target, const int iters);
+    void registerWithSAC(PointCloudT::Ptr cloud, PointCloudT::Ptr target, const int iters);
+    PointCloudT::Ptr registrationTarget(const TransformData& prediction);
+    pcl::PointCloud<pcl::Normal>::Ptr normalsFor(const PointCloudT::Ptr target);
+    int registrationBudget(const double confidence) const;
+    struct PyramidLevel;
+    PointCloudT::Ptr pyramidTarget(PyramidLevel& level, const PointCloudT::Ptr target);
+    void extendPyramid(const PointCloudT::Ptr cloud);
+    void updateLocalMap(const PointCloudT::Ptr cloud);
+    void trimLocalMap();
+    size_t flushTiles();
     void removeOutliers(PointCloudT::Ptr cloud, const int num_neighbours, const int stddev);
+    void removeMapOutliers(const std::vector<int>& region, const int num_neighbours, const int stddev);
+    pcl::search::KdTree<PointT>::Ptr searchFor(const PointCloudT::Ptr cloud);
     void downSample(PointCloudT::Ptr cloud, const int leaf_size);
     void transform(PointCloudT::Ptr cloud, const TransformData& t);
     void filterRangeZ(PointCloudT::Ptr cloud, const double minZ, const double maxZ);
-    void reconstructSurface(pcl::PointCloud<pcl::PointNormal>::Ptr mls_points, const PointCloudT::Ptr cloud, const double radius);
+    template <typename Source> void preprocess(const Source& source, PointCloudT::Ptr new_cloud, const TransformData& transformation);
+    template <typename Source> void fusedPreprocess(const Source& source, PointCloudT& output, const Eigen::Affine3f& transformation,
+                                                    const double minZ, const double maxZ, const int leaf_size);
+    void reconstructSurface(pcl::PointCloud<pcl::PointNormal>::Ptr mls_points, const PointCloudT::Ptr cloud, const double radius,
+                            const pcl::IndicesPtr& indices = pcl::IndicesPtr());
     void smoothSurface(PointCloudT::Ptr cloud, const double radius);
+    void smoothMapRegion(const std::vector<int>& region, const double radius);
+    std::vector<int> dirtyRegion(const PointCloudT::Ptr new_cloud, const bool whole_map);
+    void reserveMap(const size_t extra);
+    void eraseMapPoints(const std::vector<int>& indices);
+    void extendMapFeatures();
+    void markFeaturesStale(const std::vector<int>& indices);
+    void updateMapNormals();
+    void updateMapFeatures();
+    void estimateNormals(const PointCloudT::Ptr cloud, const pcl::IndicesPtr& indices, pcl::PointCloud<pcl::Normal>& normals);
+    void recordTime(Seconds StageTimes::* stage, const Clock::time_point& start);
+    void recordTime(Seconds StageTimes::* stage, const Clock::duration& elapsed);
+
+    int num_threads;
+
+    // ICP iterations allowed for each cloud
+    int max_iterations = 100;
+    int min_iterations = 5;
+    double skip_confidence = 0.95;
+    RegistrationBackend backend = RegistrationBackend::PointToPoint;
+    CorrespondenceSearch correspondence_search = CorrespondenceSearch::Tree;
+    double correspondence_cell_size = 1000;
+
+    // Coarse levels of the registration pyramid, each with a downsampled copy of the stitched map
+    struct PyramidLevel
+    {
+        double leaf_size;
+        VoxelDownsampler map_grid;
+        PointCloudT::Ptr map_cloud;
+        bool map_stale = true;      // map_cloud is behind map_grid
+        VoxelDownsampler cloud_grid;    // Downsamples each cloud being registered
+
+        PyramidLevel(const double leaf_size)
+            : leaf_size(leaf_size), map_grid(leaf_size), map_cloud(new PointCloudT()), cloud_grid(leaf_size) {}
+    };
+    std::vector<PyramidLevel> pyramid;
+
+    // Local map used as the registration target in the windowed modes
+    // Holds the concatenation of window_clouds so it never has to be rebuilt
+    RegistrationTarget target_mode = RegistrationTarget::WholeMap;
+    int window_size = 10;
+    double crop_radius = 20000;
+    std::deque<size_t> window_clouds;   // Number of points each windowed cloud contributes to local_map
+    PointCloudT::Ptr local_map;
+    pcl::PointCloud<pcl::Normal>::Ptr local_normals;    // Parallel to local_map, with the point-to-plane backend
+    // Normals of the last spatially cropped target, gathered from local_normals as it is cropped
+    PointCloudT::Ptr cropped_target;
+    pcl::PointCloud<pcl::Normal>::Ptr cropped_normals;
+
+    // Persistent spatial indices, updated as points are added and removed instead of being rebuilt
+    VoxelHashIndex::Ptr map_index;
+    VoxelHashIndex::Ptr local_index;
+
+    // Running totals of the mean neighbour distances used by outlier removal on the stitched cloud
+    // Kept per index cell so that only the cells touched by a new cloud need to be recomputed
+    struct DistanceStats
+    {
+        double sum = 0;
+        double sq_sum = 0;
+        int count = 0;
+
+        void add(const double d) { sum += d; sq_sum += d * d; ++count; }
+        void remove(const double d) { sum -= d; sq_sum -= d * d; --count; }
+    };
+    std::unordered_map<uint64_t, DistanceStats, VoxelHashIndex::KeyHash> cell_distance_stats;
+    bool post_processed = false;    // Whether the whole map has had its first outlier removal and smoothing pass
+    DistanceStats map_distance_stats;
+    // Neighbourhoods of the region filtered by the last removeMapOutliers, kept in step with the stitched cloud
+    // so that smoothing the same region can reuse them; empty (with no cloud) the rest of the time
+    NeighbourhoodGraph::Ptr region_graph;
+
+    // Normals and FPFH signatures of the stitched cloud, kept parallel to its points
+    // Normals are allocated once point-to-plane ICP or SAC-IA needs them, features only for SAC-IA;
+    // after that only stale entries are recomputed
+    pcl::PointCloud<pcl::Normal>::Ptr map_normals;
+    pcl::PointCloud<pcl::FPFHSignature33>::Ptr map_features;
+    std::vector<uint8_t> normals_stale;
+    std::vector<uint8_t> features_stale;
+
+    Eigen::Matrix4f last_registration = Eigen::Matrix4f::Identity();
+
+    // Working storage reused from frame to frame by registration and smoothing
+    CloudPool<PointT> scratch_clouds;
+    bool measure_fitness = false;
+    pcl::PointCloud<pcl::PointNormal>::Ptr smoothed_points;
+
+    // Finished tiles of the stitched cloud that have been moved out to disk
+    TileStore::Ptr tile_store;
+
+    std::mutex time_mutex;
 };
 
 
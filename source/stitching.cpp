@@ -0,0 +1,639 @@
+#include <stitching.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <cloud_stream.h>
+#include <pose_graph.h>
+
+namespace
+{
+    // Ensure only PCD files are read
+    bool filePredicate(const std::string &s)
+    {
+        std::size_t i = s.find(".");
+        return (i == std::string::npos || !s.compare(".") || !s.compare("..") || !s.compare("filtered.pcd") || s.substr(i, 4).compare(".pcd"));
+    }
+
+    int fileNumber(const std::string& s)
+    {
+        size_t idx_start = s.find_last_of("D") + 1;
+        size_t idx_end = s.find(".");
+        return std::stoi(s.substr(idx_start, idx_end - idx_start));
+    }
+
+    void getTransformationData(std::ifstream& infile, std::vector<TransformData>& translation_and_rotation_raw, char delim)
+    {
+        // Read transformation information from a supplied file
+        // Assumes a one-to-one correspondence between data and pcd files
+        // In the order dx, dy, dz, rotx, roty, rotz
+
+        std::string line;
+        const int rows_to_skip = 1;
+        const int cols_to_skip = 1;
+        int row = -1;
+        while (std::getline(infile, line))
+        {
+            // Skip header rows
+            if (rows_to_skip > ++row)
+            {
+                continue;
+            }
+
+            std::vector<double> transformVec;
+            std::istringstream iss (line);
+            std::string val = "0.0";
+            int col = 0;
+            while (std::getline(iss, val, delim))
+            {
+                if (cols_to_skip > col++)
+                {
+                    continue;
+                }
+                transformVec.push_back(stod(val));
+            }
+
+            TransformData t_data;
+            if (transformVec.size() < 6)
+                throw std::domain_error("Input transformations file has fewer than 6 columns.");
+            t_data.rotx = transformVec[0];
+            t_data.roty = transformVec[1];
+            t_data.rotz = transformVec[2];
+            t_data.dx = transformVec[3];
+            t_data.dy = transformVec[4];
+            t_data.dz = transformVec[5];
+            if (transformVec.size() > 6)
+                t_data.confidence = transformVec[6];
+            else
+                std::cout << "WARNING: No confidence value given for transformation data.\n";
+            translation_and_rotation_raw.push_back(t_data);
+        }
+    }
+
+    void averageTransformationData(std::vector<TransformData>& transformations, const int vals_per_cloud)
+    {
+        // Take the average value of each translation and rotation over vals_per_cloud elements
+        // Readings left over after the last complete group are dropped
+        std::vector<TransformData> averaged;
+        for (size_t i = 0; i + vals_per_cloud <= transformations.size(); i += vals_per_cloud)
+        {
+            TransformData t = transformations[i];
+            for (int j = 1; j < vals_per_cloud; ++j)
+            {
+                t = t + transformations[i+j];
+            }
+            t.dx /= vals_per_cloud;
+            t.dy /= vals_per_cloud;
+            t.dz /= vals_per_cloud;
+            t.rotx /= vals_per_cloud;
+            t.roty /= vals_per_cloud;
+            t.rotz /= vals_per_cloud;
+            t.confidence /= vals_per_cloud;
+            averaged.push_back(t);
+        }
+        transformations.swap(averaged);
+    }
+
+    // Applies the registration options to the map, once it has been started with the first cloud
+    void configureMap(StitchedCloud& map, const std::string& directory, const StitchingOptions& options)
+    {
+        const RegistrationTarget target = options.crop_radius > 0 ? RegistrationTarget::SpatialCrop : options.registration_target;
+        map.setRegistrationTarget(target, options.window_size, options.crop_radius);
+        map.setRegistrationPyramid(options.pyramid_leaf_sizes);
+        map.setRegistrationBackend(options.registration_backend);
+        if (options.correspondence_cell_size > 0)
+        {
+            map.setCorrespondenceSearch(CorrespondenceSearch::VoxelHash, options.correspondence_cell_size);
+        }
+        map.setFitnessMeasurement(!options.stats_file.empty());
+        if (options.tile_length > 0)
+        {
+            // Finished parts of the map are kept on disk or quantized, so memory use does not grow with the length of the
+            // tunnel, or grows at a fraction of the rate
+            const std::string tile_directory = directory + "/tiles/";
+            if (options.tile_storage == TileStorage::Disk)
+            {
+                mkdir(tile_directory.c_str(), 0755);
+            }
+            map.enableTiling(tile_directory, options.tile_length, options.tile_storage);
+        }
+    }
+
+    // Writes <directory>/filtered.pcd, and the octree in <directory>/lod from the same pass over the map if asked for
+    void writeOutput(StitchedCloud& map, const std::string& directory, const StitchingOptions& options)
+    {
+        if (options.octree_node_points == 0)
+        {
+            map.writeMap(directory + "/filtered.pcd", options.output_format);
+            return;
+        }
+        LodOctreeWriter octree (directory + "/lod", options.octree_node_points, options.num_threads);
+        map.writeMap(directory + "/filtered.pcd", options.output_format, &octree);
+        octree.close();
+    }
+}
+
+bool parseStitchingOption(const std::string& name, const std::string& value, StitchingOptions& options)
+{
+    if (name == "-t")
+    {
+        options.transform_file = value;
+    }
+    else if (name == "-w")
+    {
+        options.registration_target = RegistrationTarget::SlidingWindow;
+        options.window_size = std::stoi(value);
+    }
+    else if (name == "-c")
+    {
+        options.crop_radius = std::stod(value);
+    }
+    else if (name == "-k")
+    {
+        options.checkpoint_interval = std::stoi(value);
+    }
+    else if (name == "-P")
+    {
+        std::istringstream iss (value);
+        std::string val;
+        while (std::getline(iss, val, ','))
+        {
+            options.pyramid_leaf_sizes.push_back(std::stod(val));
+        }
+    }
+    else if (name == "-b" && value == "plane")
+    {
+        options.registration_backend = RegistrationBackend::PointToPlane;
+    }
+    else if (name == "-b" && value == "point")
+    {
+        options.registration_backend = RegistrationBackend::PointToPoint;
+    }
+    else if (name == "-C")
+    {
+        options.correspondence_cell_size = std::stod(value);
+    }
+    else if (name == "-S")
+    {
+        options.snapshot_interval = std::stod(value);
+    }
+    else if (name == "-i")
+    {
+        options.idle_timeout = std::stod(value);
+    }
+    else if (name == "-B")
+    {
+        options.max_backlog = std::stoul(value);
+    }
+    else if (name == "-s")
+    {
+        options.stats_file = value;
+    }
+    else if (name == "-T")
+    {
+        options.tile_length = std::stod(value);
+    }
+    else if (name == "-Q" && value == "16")
+    {
+        options.tile_storage = TileStorage::Quantized16;
+    }
+    else if (name == "-Q" && value == "32")
+    {
+        options.tile_storage = TileStorage::Quantized32;
+    }
+    else if (name == "-O")
+    {
+        options.octree_node_points = std::stoul(value);
+    }
+    else if (name == "-o" && value == "ascii")
+    {
+        options.output_format = PCDFormat::ASCII;
+    }
+    else if (name == "-o" && value == "binary")
+    {
+        options.output_format = PCDFormat::Binary;
+    }
+    else if (name == "-o" && value == "binary_compressed")
+    {
+        options.output_format = PCDFormat::BinaryCompressed;
+    }
+    else
+    {
+        return false;
+    }
+    return true;
+}
+
+std::vector<std::string> listClouds(const std::string& directory)
+{
+    std::vector<std::string> files;
+    DIR *dp;
+    struct dirent *dirp;
+    if((dp  = opendir(directory.c_str())) == NULL) {
+        std::cout << "Error opening " << directory << std::endl;
+        return files;
+    }
+
+    while ((dirp = readdir(dp)) != NULL) {
+        files.push_back(std::string(dirp->d_name));
+    }
+    closedir(dp);
+
+    // Remove non pcd files and sort the rest into ascending order
+    files.erase(std::remove_if(files.begin(), files.end(), filePredicate), files.end());
+    std::sort(files.begin(), files.end(), [](const std::string& a, const std::string& b)
+    {
+        return fileNumber(a) < fileNumber(b);
+    });
+    return files;
+}
+
+std::vector<TransformData> readTransformations(const std::string& path, const int rows_per_cloud)
+{
+    std::vector<TransformData> transformations;
+    std::ifstream infile (path);
+    char delim = ';';
+    try { getTransformationData(infile, transformations, delim); } catch (std::exception& e) { e.what(); }
+    averageTransformationData(transformations, rows_per_cloud);
+    return transformations;
+}
+
+void loadCloud(StitchedCloud& map, const std::string& path, PointCloudT::Ptr cloud, const TransformData& transformation,
+               CloudStats& stats)
+{
+    // Binary files are preprocessed straight out of the page cache; anything else goes through PCL's reader
+    // NaNs are removed as part of preprocessing
+    // Reading a mapped file happens as it is preprocessed, so only the time to map it counts as reading
+    auto read_start = Clock::now();
+    MappedPCD file (path);
+    if (file.valid())
+    {
+        stats.times.read_time += Clock::now() - read_start;
+        map.preprocessCloud(file, cloud, transformation, &stats);
+    }
+    else
+    {
+        pcl::PCDReader cloud_reader;
+        cloud_reader.read(path, *cloud);
+        stats.times.read_time += Clock::now() - read_start;
+        map.preprocessCloud(cloud, transformation, &stats);
+    }
+}
+
+DatasetJob::DatasetJob(const std::string& directory, const StitchingOptions& options)
+    : DatasetJob(directory, listClouds(directory), options)
+{
+}
+
+DatasetJob::DatasetJob(const std::string& directory, const std::vector<std::string>& files, const StitchingOptions& options)
+    : dataset_directory(directory), options(options), files(files)
+{
+    if (this->files.empty())
+    {
+        throw std::runtime_error("No PCD files found in " + directory + ".");
+    }
+
+    // Known locations and orientations can be used to accelerate cloud processing
+    // Clouds without a reading, including all of them if no file was supplied, are taken to be at the origin
+    transformations.resize(this->files.size());
+    if (!options.transform_file.empty())
+    {
+        // Readings are matched to clouds by number, counting from the first cloud, as they are in the live mode
+        const std::vector<TransformData> readings = readTransformations(options.transform_file, options.rows_per_cloud);
+        const int first_number = fileNumber(this->files[0]);
+        for (size_t i = 0; i < this->files.size(); ++i)
+        {
+            const size_t reading = static_cast<size_t>(fileNumber(this->files[i]) - first_number);
+            if (reading < readings.size())
+            {
+                transformations[i] = readings[reading];
+            }
+        }
+    }
+
+    // Measurements for each input cloud
+    cloud_stats.resize(this->files.size());
+    for (size_t i = 0; i < cloud_stats.size(); ++i)
+    {
+        cloud_stats[i].index = i;
+    }
+}
+
+size_t DatasetJob::inputBytes(size_t* largest) const
+{
+    size_t total = 0;
+    if (largest)
+    {
+        *largest = 0;
+    }
+    for (const std::string& file : files)
+    {
+        struct stat st;
+        if (stat((dataset_directory + "/" + file).c_str(), &st) == 0)
+        {
+            total += st.st_size;
+            if (largest)
+            {
+                *largest = std::max<size_t>(*largest, st.st_size);
+            }
+        }
+    }
+    return total;
+}
+
+TransformData DatasetJob::relativeTransformation(const size_t i)
+{
+    // Transformations are relative to the first cloud, but the confidence is that of the cloud's own reading
+    TransformData t = transformations[i] - transformations[0];
+    t.confidence = transformations[i].confidence;
+    return t;
+}
+
+void DatasetJob::begin()
+{
+    // Start the timer
+    // A scheduler may build the job long before running it, so the time spent queued is not counted
+    start = Clock::now();
+
+    PointCloudT::Ptr first_cloud (new PointCloudT());
+    pcl::PCDReader reader;
+    reader.read(dataset_directory + "/" + files[0], *first_cloud);
+    stitched.reset(new StitchedCloud(first_cloud, options.num_threads));
+    configureMap(*stitched, dataset_directory, options);
+
+    // TODO Set the first point cloud as being centre at the origin (translation by transformations[0])
+    // Not coded yet - just planning
+
+    // Rebuild the map from an earlier run by integrating its logged clouds again, then carry on after the last one
+    std::string checkpoint_file;
+    int checkpoint_interval = options.checkpoint_interval;
+    if (!options.resume_file.empty())
+    {
+        size_t resumed = CheckpointLog::replay(options.resume_file, [&](const CheckpointLog::Entry& entry)
+        {
+            stitched->integrateCloud(entry.cloud, &cloud_stats[entry.index]);
+            first_new = entry.index + 1;
+        });
+        std::cout << "Resumed " << resumed << " clouds from " << options.resume_file << std::endl;
+        checkpoint_file = options.resume_file;
+        checkpoint_interval = checkpoint_interval > 0 ? checkpoint_interval : 5;
+    }
+    else if (checkpoint_interval > 0)
+    {
+        checkpoint_file = dataset_directory + "/checkpoint.bin";
+        std::remove(checkpoint_file.c_str());
+    }
+    if (!checkpoint_file.empty())
+    {
+        checkpoint.reset(new CheckpointLog(checkpoint_file, checkpoint_interval));
+    }
+    first_new = std::min(first_new, files.size());
+}
+
+void DatasetJob::prepareCloud(const size_t i, PointCloudT::Ptr cloud)
+{
+    loadCloud(*stitched, dataset_directory + "/" + files[i], cloud, relativeTransformation(i), cloud_stats[i]);
+}
+
+void DatasetJob::addCloud(const size_t i, PointCloudT::Ptr cloud)
+{
+    CloudStats& stats = cloud_stats[i];
+    auto frame_start = Clock::now();
+    // The cloud's own stats already hold its read time, from prepareCloud
+    stitched->addTime(&StageTimes::read_time, stats.times.read_time);
+
+    stitched->addPreprocessedCloud(cloud, relativeTransformation(i), &stats);
+    if (checkpoint)
+    {
+        auto write_start = Clock::now();
+        checkpoint->append(i, stitched->lastRegistration(), *cloud);
+        stitched->addTime(&StageTimes::write_time, Clock::now() - write_start, &stats);
+    }
+    stats.frame_time = Clock::now() - frame_start;
+    stats.peak_rss_kb = peakRSS();
+}
+
+void DatasetJob::finish()
+{
+    // Reconstruct the surface
+    // pcl::PointCloud<pcl::PointNormal>::Ptr mls_points (new pcl::PointCloud<pcl::PointNormal>());
+    // reconstructSurface(mls_points, stitched->stitched_cloud, 500);
+
+    // Write the resulting point cloud
+    auto write_start = Clock::now();
+    writeOutput(*stitched, dataset_directory, options);
+    stitched->addTime(&StageTimes::write_time, Clock::now() - write_start);
+    // pcl::io::savePCDFile(dataset_directory + "/filtered.pcd", *mls_points);
+
+    // Timing
+    stitched->timeBreakdown.total_time = Clock::now() - start;
+    if (!options.stats_file.empty())
+    {
+        writeCloudStats(options.stats_file, cloud_stats);
+    }
+}
+
+void DatasetJob::run(const int num_workers, const std::string& pairwise_mode)
+{
+    begin();
+
+    // Display a progress bar
+    std::unique_ptr<boost::progress_display> progress_bar;
+    if (options.show_progress)
+    {
+        progress_bar.reset(new boost::progress_display(files.size()-1));
+        *progress_bar += first_new - 1;
+    }
+
+    // Clouds are read and preprocessed on worker threads while earlier clouds are being registered
+    auto prepare = [&](const size_t i, PointCloudT::Ptr cloud)
+    {
+        prepareCloud(i, cloud);
+    };
+    IngestPipeline pipeline (first_new, files.size(), prepare, num_workers, 2 * std::max(num_workers, 1));
+
+    if (pairwise_mode.empty())
+    {
+        // Add each new cloud to the stitched_cloud
+        for (size_t i = first_new; i < files.size(); ++i)
+        {
+            auto wait_start = Clock::now();
+            PointCloudT::Ptr new_cloud = pipeline.next();
+            cloud_stats[i].wait_time = Clock::now() - wait_start;
+            addCloud(i, new_cloud);
+            if (progress_bar)
+            {
+                ++*progress_bar;
+            }
+        }
+    }
+    else
+    {
+        addPairs(pipeline, pairwise_mode, options.num_threads);
+        if (progress_bar)
+        {
+            *progress_bar += files.size() - first_new;
+        }
+    }
+
+    finish();
+}
+
+void DatasetJob::addPairs(IngestPipeline& pipeline, const std::string& pairwise_mode, const int num_threads)
+{
+    // Register each cloud against the one before it, all pairs in parallel, then merge them in one pass
+    // clouds[i] is input cloud first_new + i - 1, with the map so far standing in for the cloud before the first
+    std::vector<PointCloudT::Ptr> clouds;
+    clouds.push_back(PointCloudT::Ptr(new PointCloudT(*stitched->stitched_cloud)));
+    for (PointCloudT::Ptr cloud = pipeline.next(); cloud; cloud = pipeline.next())
+    {
+        clouds.push_back(cloud);
+        stitched->addTime(&StageTimes::read_time, cloud_stats[first_new + clouds.size() - 2].times.read_time);
+    }
+
+    std::vector<std::pair<int, int> > consecutive_pairs;
+    for (int i = 1; i < clouds.size(); ++i)
+    {
+        consecutive_pairs.push_back(std::make_pair(i - 1, i));
+    }
+    auto icp_start = Clock::now();
+    std::vector<PairConstraint> constraints = registerPairs(clouds, consecutive_pairs, 100, num_threads);
+    std::vector<Eigen::Matrix4f> corrections = chainCorrections(constraints, clouds.size());
+    if (pairwise_mode == "graph")
+    {
+        // Constraints that skip a cloud tie the chain together so a single bad pair cannot bend the rest of it
+        std::vector<std::pair<int, int> > skip_pairs;
+        for (int i = 2; i < clouds.size(); ++i)
+        {
+            skip_pairs.push_back(std::make_pair(i - 2, i));
+        }
+        std::vector<PairConstraint> skip_constraints = registerPairs(clouds, skip_pairs, 100, num_threads);
+        constraints.insert(constraints.end(), skip_constraints.begin(), skip_constraints.end());
+
+        std::vector<TransformData> priors;
+        for (int i = 0; i < clouds.size(); ++i)
+        {
+            priors.push_back(transformations[first_new + i - 1]);
+        }
+        optimisePoseGraph(corrections, constraints, priors);
+    }
+    stitched->addTime(&StageTimes::icp_time, Clock::now() - icp_start);
+
+    for (int i = 1; i < clouds.size(); ++i)
+    {
+        // Pairs are registered all at once, so each cloud is only credited with its own pair's result
+        CloudStats& stats = cloud_stats[first_new + i - 1];
+        auto frame_start = Clock::now();
+        stats.icp_iterations = constraints[i - 1].iterations;
+        stats.icp_fitness = constraints[i - 1].fitness;
+        stats.icp_converged = constraints[i - 1].converged;
+
+        pcl::transformPointCloud(*clouds[i], *clouds[i], corrections[i]);
+        stitched->integrateCloud(clouds[i], &stats);
+        if (checkpoint)
+        {
+            auto write_start = Clock::now();
+            checkpoint->append(first_new + i - 1, corrections[i], *clouds[i]);
+            stitched->addTime(&StageTimes::write_time, Clock::now() - write_start, &stats);
+        }
+        stats.frame_time = Clock::now() - frame_start;
+        stats.peak_rss_kb = peakRSS();
+    }
+}
+
+TimeBreakdown streamDataset(const std::string& directory, const StitchingOptions& options)
+{
+    // Start the timer
+    auto start = Clock::now();
+
+    CloudStream stream (directory, options.transform_file, options.rows_per_cloud);
+    const Clock::duration idle = std::chrono::duration_cast<Clock::duration>(Seconds(options.idle_timeout));
+
+    // The first cloud to arrive starts the map, and its pose is the origin of the rest
+    CloudStream::Frame frame;
+    if (!stream.next(frame, idle, options.max_backlog))
+    {
+        throw std::runtime_error("No clouds arrived in " + directory + ".");
+    }
+    PointCloudT::Ptr first_cloud (new PointCloudT());
+    pcl::PCDReader reader;
+    reader.read(frame.path, *first_cloud);
+    StitchedCloud stitchedCloud (first_cloud, options.num_threads);
+    configureMap(stitchedCloud, directory, options);
+    const TransformData origin = frame.transformation;
+    std::cout << "Started the map with cloud " << frame.index << std::endl;
+
+    std::unique_ptr<CheckpointLog> checkpoint;
+    if (options.checkpoint_interval > 0)
+    {
+        const std::string checkpoint_file = directory + "/checkpoint.bin";
+        std::remove(checkpoint_file.c_str());
+        checkpoint.reset(new CheckpointLog(checkpoint_file, options.checkpoint_interval));
+    }
+
+    // With tiling only the part of the map still in memory goes into the snapshots; the rest is in the tiles
+    SnapshotWriter snapshots (directory + "/snapshot.pcd", options.output_format);
+    auto last_snapshot = Clock::now();
+
+    std::vector<CloudStats> cloud_stats;
+    CloudPool<PointT> frame_clouds;
+    auto wait_start = Clock::now();
+    while (stream.next(frame, idle, options.max_backlog))
+    {
+        CloudStats stats;
+        stats.index = frame.index;
+        auto frame_start = Clock::now();
+        stats.wait_time = frame_start - wait_start;
+
+        TransformData t = frame.transformation - origin;
+        t.confidence = frame.transformation.confidence;
+        PointCloudT::Ptr cloud = frame_clouds.acquire();
+        loadCloud(stitchedCloud, frame.path, cloud, t, stats);
+        // loadCloud has already put the read time in the cloud's stats
+        stitchedCloud.addTime(&StageTimes::read_time, stats.times.read_time);
+        stitchedCloud.addPreprocessedCloud(cloud, t, &stats);
+        if (checkpoint)
+        {
+            auto write_start = Clock::now();
+            checkpoint->append(frame.index, stitchedCloud.lastRegistration(), *cloud);
+            stitchedCloud.addTime(&StageTimes::write_time, Clock::now() - write_start, &stats);
+        }
+        stats.frame_time = Clock::now() - frame_start;
+        stats.latency = Clock::now() - frame.arrived;
+        stats.peak_rss_kb = peakRSS();
+        cloud_stats.push_back(stats);
+        std::cout << "Cloud " << frame.index << " stitched in " << std::fixed << std::setprecision(2)
+                  << stats.frame_time.count() << "s, " << stats.latency.count() << "s after it arrived" << std::endl;
+
+        if (options.snapshot_interval > 0 && Seconds(Clock::now() - last_snapshot).count() >= options.snapshot_interval &&
+            snapshots.publish(*stitchedCloud.stitched_cloud))
+        {
+            last_snapshot = Clock::now();
+        }
+        wait_start = Clock::now();
+    }
+    if (stream.skipped() > 0)
+    {
+        std::cout << "Skipped " << stream.skipped() << " clouds that arrived too late or not at all." << std::endl;
+    }
+
+    // Write the resulting point cloud
+    auto write_start = Clock::now();
+    writeOutput(stitchedCloud, directory, options);
+    stitchedCloud.addTime(&StageTimes::write_time, Clock::now() - write_start);
+
+    // Timing
+    stitchedCloud.timeBreakdown.total_time = Clock::now() - start;
+    if (!options.stats_file.empty())
+    {
+        writeCloudStats(options.stats_file, cloud_stats);
+    }
+    return stitchedCloud.timeBreakdown;
+}
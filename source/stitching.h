@@ -0,0 +1,108 @@
+#ifndef STITCHING_H
+#define STITCHING_H
+
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <checkpoint_log.h>
+#include <ingest_pipeline.h>
+#include <stitched_cloud.h>
+
+// How a dataset is stitched; the defaults are those of registerClouds
+struct StitchingOptions
+{
+    std::string transform_file;         // Pose readings, 'rows_per_cloud' rows to each cloud; none if empty
+    int rows_per_cloud = 10;
+    RegistrationTarget registration_target = RegistrationTarget::WholeMap;
+    int window_size = 10;
+    double crop_radius = 0;             // Above zero, registers against the windowed clouds within this radius
+    std::vector<double> pyramid_leaf_sizes;
+    RegistrationBackend registration_backend = RegistrationBackend::PointToPoint;
+    double correspondence_cell_size = 0;    // Above zero, ICP correspondences come from a voxel hash of this cell size
+    double tile_length = 0;             // Above zero, finished tiles of the map are kept in <directory>/tiles
+    TileStorage tile_storage = TileStorage::Disk;
+    int checkpoint_interval = 0;        // Above zero, registered clouds are logged to <directory>/checkpoint.bin
+    std::string resume_file;            // Checkpoint of an earlier run to carry on from
+    std::string stats_file;             // Measurements of every cloud, if not empty
+    PCDFormat output_format = PCDFormat::Binary;
+    size_t octree_node_points = 0;      // Above zero, an octree goes in <directory>/lod; nodes of more points than this are split
+    int num_threads = std::thread::hardware_concurrency();     // Threads each stage of the map may use
+    bool show_progress = true;
+
+    // Only for streamDataset
+    double snapshot_interval = 10;
+    double idle_timeout = 0;
+    size_t max_backlog = 0;
+};
+
+// Applies the registerClouds option 'name' with 'value' to 'options'
+// Returns false if it is not an option of the map; throws std::invalid_argument if the value is not a number
+bool parseStitchingOption(const std::string& name, const std::string& value, StitchingOptions& options);
+
+// Cloud files in 'directory', in order of the number in their name
+// filtered.pcd, the output of an earlier run, is left out
+std::vector<std::string> listClouds(const std::string& directory);
+
+// Readings of the transformations file at 'path', averaged over the 'rows_per_cloud' rows of each cloud
+// Reading n belongs to the cloud numbered n after the first cloud, so clouds missing from the middle of a dataset
+// leave their readings unused, in this and in the live mode alike
+std::vector<TransformData> readTransformations(const std::string& path, const int rows_per_cloud);
+
+// Reads the cloud at 'path' into 'cloud' and preprocesses it for 'map'
+void loadCloud(StitchedCloud& map, const std::string& path, PointCloudT::Ptr cloud, const TransformData& transformation,
+               CloudStats& stats);
+
+// Stitches a directory of clouds into <directory>/filtered.pcd
+// run() does everything; the steps it is made of are public too, so that a scheduler can interleave many datasets
+// on one set of threads
+class DatasetJob
+{
+public:
+    // Every cloud in 'directory', or only 'files' of it; throws std::runtime_error if there are none
+    DatasetJob(const std::string& directory, const StitchingOptions& options);
+    DatasetJob(const std::string& directory, const std::vector<std::string>& files, const StitchingOptions& options);
+
+    // Stitches the dataset on this thread, with 'num_workers' threads preparing clouds ahead of it
+    // A 'pairwise_mode' of chain or graph registers consecutive pairs of clouds in parallel instead
+    void run(const int num_workers, const std::string& pairwise_mode = "");
+
+    // Starts the map with the first cloud and replays the checkpoint being resumed
+    void begin();
+    // Reads and preprocesses cloud 'index' into 'cloud'; once begin() has returned, safe to call from several
+    // threads at once and alongside addCloud()
+    void prepareCloud(const size_t index, PointCloudT::Ptr cloud);
+    // Registers prepared cloud 'index' and adds it to the map; clouds from firstNew() on are added one at a time, in order
+    void addCloud(const size_t index, PointCloudT::Ptr cloud);
+    // Writes the map and the measurements
+    void finish();
+
+    const std::string& directory() const { return dataset_directory; }
+    size_t size() const { return files.size(); }
+    size_t firstNew() const { return first_new; }
+    // Size of the input clouds on disk, and of the largest of them
+    size_t inputBytes(size_t* largest = nullptr) const;
+    StitchedCloud& map() { return *stitched; }
+
+private:
+    void addPairs(IngestPipeline& pipeline, const std::string& pairwise_mode, const int num_threads);
+    TransformData relativeTransformation(const size_t index);
+
+    std::string dataset_directory;
+    StitchingOptions options;
+    std::vector<std::string> files;
+    std::vector<TransformData> transformations;
+    std::vector<CloudStats> cloud_stats;
+    std::unique_ptr<StitchedCloud> stitched;
+    std::unique_ptr<CheckpointLog> checkpoint;
+    size_t first_new = 1;
+    Clock::time_point start;           // Set by begin()
+};
+
+// Stitches clouds as they are written to 'directory', each as soon as it arrives, until the stream ends
+// A copy of the map is published to snapshot.pcd every 'snapshot_interval' seconds along the way
+// Returns the time spent in each stage; throws std::runtime_error if no cloud arrives
+TimeBreakdown streamDataset(const std::string& directory, const StitchingOptions& options);
+
+#endif
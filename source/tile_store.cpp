@@ -0,0 +1,180 @@
+#include <tile_store.h>
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <stdexcept>
+
+TileStore::TileStore(const std::string& directory, const double tile_length, const int axis, const TileStorage storage,
+                     const float resolution)
+    : directory(directory), tile_length(tile_length), tile_axis(std::min(std::max(axis, 0), 2)), storage(storage),
+      resolution(resolution)
+{
+    if (!this->directory.empty() && this->directory.back() != '/')
+    {
+        this->directory += "/";
+    }
+    if (storage != TileStorage::Disk)
+    {
+        return;
+    }
+    // Start a new manifest; anything left over from an earlier run is not part of this map
+    std::ofstream manifest (this->directory + "manifest.txt", std::ios::trunc);
+    if (!manifest)
+    {
+        throw std::runtime_error("Could not create a tile manifest in " + directory + ".");
+    }
+    manifest << "# tile file points\n";
+}
+
+int TileStore::tileOf(const double position) const
+{
+    return static_cast<int>(std::floor(position / tile_length));
+}
+
+int TileStore::tileOf(const PointT& p) const
+{
+    return tileOf(p.data[tile_axis]);
+}
+
+size_t TileStore::bytes() const
+{
+    size_t total = 0;
+    for (const Part& part : parts)
+    {
+        total += part.narrow ? part.narrow->bytes() : part.wide ? part.wide->bytes() : 0;
+    }
+    return total;
+}
+
+void TileStore::flush(const PointCloudT& cloud, const std::vector<int>& indices)
+{
+    // Group the points by tile, then store one new part per tile
+    std::vector<std::pair<int, int> > by_tile;
+    by_tile.reserve(indices.size());
+    for (const int i : indices)
+    {
+        by_tile.push_back(std::make_pair(tileOf(cloud.points[i]), i));
+    }
+    std::sort(by_tile.begin(), by_tile.end());
+
+    std::ofstream manifest;
+    if (storage == TileStorage::Disk)
+    {
+        manifest.open(directory + "manifest.txt", std::ios::app);
+    }
+    PointCloudT::VectorType points;
+    std::vector<int> tile_indices;
+    for (size_t begin = 0; begin < by_tile.size(); )
+    {
+        const int tile = by_tile[begin].first;
+        size_t end = begin;
+        points.clear();
+        tile_indices.clear();
+        while (end < by_tile.size() && by_tile[end].first == tile)
+        {
+            tile_indices.push_back(by_tile[end].second);
+            ++end;
+        }
+
+        Part part;
+        part.tile = tile;
+        part.count = tile_indices.size();
+        if (storage != TileStorage::Disk)
+        {
+            // Encoded straight from the map, with no float copy in between
+            if (storage == TileStorage::Quantized16)
+            {
+                part.narrow.reset(new QuantizedCloud<int16_t>());
+                part.narrow->encode(cloud, tile_indices, resolution);
+            }
+            else
+            {
+                part.wide.reset(new QuantizedCloud<int32_t>());
+                part.wide->encode(cloud, tile_indices, resolution);
+            }
+            parts.push_back(part);
+            num_points += part.count;
+            begin = end;
+            continue;
+        }
+
+        for (const int i : tile_indices)
+        {
+            points.push_back(cloud.points[i]);
+        }
+        part.file = "tile_" + std::to_string(tile) + "_" + std::to_string(tile_parts[tile]++) + ".pcd";
+        PCDStreamWriter writer (directory + part.file, PCDFormat::Binary);
+        writer.write(points.data(), points.size());
+        writer.close();
+
+        // The manifest is only extended once the tile is safely on disk
+        manifest << part.tile << " " << part.file << " " << part.count << "\n";
+        manifest.flush();
+        parts.push_back(part);
+        num_points += part.count;
+        begin = end;
+    }
+}
+
+void TileStore::assemble(const std::string& path, const PointCloudT& resident, const PCDFormat format,
+                         LodOctreeWriter* octree) const
+{
+    // Only one chunk of one tile is held in memory at a time
+    std::vector<const Part*> ordered;
+    for (const Part& part : parts)
+    {
+        ordered.push_back(&part);
+    }
+    std::stable_sort(ordered.begin(), ordered.end(), [](const Part* a, const Part* b) { return a->tile < b->tile; });
+
+    PCDStreamWriter writer (path, format);
+    const size_t chunk_size = 65536;
+    PointCloudT::VectorType chunk;
+    auto write = [&](const PointT* points, const size_t count)
+    {
+        writer.write(points, count);
+        if (octree)
+        {
+            octree->add(points, count);
+        }
+    };
+    for (const Part* part : ordered)
+    {
+        if (part->narrow || part->wide)
+        {
+            for (size_t begin = 0; begin < part->count; begin += chunk_size)
+            {
+                const size_t end = std::min(begin + chunk_size, part->count);
+                chunk.resize(end - begin);
+                if (part->narrow)
+                {
+                    part->narrow->decode(begin, end, chunk.data());
+                }
+                else
+                {
+                    part->wide->decode(begin, end, chunk.data());
+                }
+                write(chunk.data(), chunk.size());
+            }
+            continue;
+        }
+        MappedPCD file (directory + part->file);
+        if (!file.valid())
+        {
+            throw std::runtime_error("Could not read map tile " + directory + part->file + ".");
+        }
+        for (size_t begin = 0; begin < file.size(); begin += chunk_size)
+        {
+            const size_t end = std::min(begin + chunk_size, file.size());
+            chunk.resize(end - begin);
+            for (size_t i = begin; i < end; ++i)
+            {
+                chunk[i - begin] = file[i];
+            }
+            write(chunk.data(), chunk.size());
+        }
+    }
+    write(resident.points.data(), resident.size());
+    writer.close();
+}
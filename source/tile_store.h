@@ -0,0 +1,79 @@
+#ifndef TILE_STORE_H
+#define TILE_STORE_H
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <boost/shared_ptr.hpp>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+#include <lod_octree.h>
+#include <pcd_file.h>
+#include <quantized_cloud.h>
+
+typedef pcl::PointXYZ PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+
+// Where TileStore keeps finished tiles
+enum class TileStorage
+{
+    Disk,           // Binary PCD files in the tile directory
+    Quantized16,    // In memory, as 16-bit offsets within each flushed part of a tile (6 bytes a point)
+    Quantized32     // In memory, as 32-bit offsets within each flushed part of a tile (12 bytes a point)
+};
+
+// Storage for finished parts of the stitched map
+// The map is cut into slabs of fixed length along the tunnel axis, and each flush of a tile is kept as its own part.
+// On disk every part is a binary PCD file recorded in an append-only manifest, so the full map can be put back together
+// by streaming the files one after another without ever holding the whole map in memory
+// Quantized parts stay in memory at a fraction of the size of the floats, and are only decoded to write the map
+class TileStore
+{
+public:
+    typedef boost::shared_ptr<TileStore> Ptr;
+
+    // 'directory' must already exist, unless the tiles are kept in memory; 'axis' is 0, 1 or 2 for x, y or z
+    // Quantized points are rounded to multiples of 'resolution', or coarser if a part is too long for its offsets
+    TileStore(const std::string& directory, const double tile_length, const int axis = 2,
+              const TileStorage storage = TileStorage::Disk, const float resolution = 1);
+
+    int tileOf(const PointT& p) const;
+    int tileOf(const double position) const;
+    int axis() const { return tile_axis; }
+
+    // Writes the given points of 'cloud', which may span several tiles, to disk
+    void flush(const PointCloudT& cloud, const std::vector<int>& indices);
+
+    // Writes every stored tile, in tile order, followed by 'resident' (the points still held in memory) to 'path'
+    // The same points are added to 'octree', if given, as they go past
+    void assemble(const std::string& path, const PointCloudT& resident, const PCDFormat format,
+                  LodOctreeWriter* octree = nullptr) const;
+
+    size_t size() const { return num_points; }     // Points held in tiles
+    size_t bytes() const;                           // Memory held by quantized tiles
+
+private:
+    struct Part
+    {
+        int tile;
+        std::string file;       // Only on disk
+        size_t count;
+        std::shared_ptr<QuantizedCloud<int16_t> > narrow;
+        std::shared_ptr<QuantizedCloud<int32_t> > wide;
+    };
+
+    std::string directory;
+    double tile_length;
+    int tile_axis;
+    TileStorage storage;
+    float resolution;
+    std::vector<Part> parts;
+    std::map<int, int> tile_parts;  // Number of files written for each tile so far
+    size_t num_points = 0;
+};
+
+#endif
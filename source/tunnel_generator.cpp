@@ -0,0 +1,156 @@
+#include <tunnel_generator.h>
+
+#include <cmath>
+#include <fstream>
+#include <random>
+#include <stdexcept>
+
+namespace
+{
+    const double two_pi = 2 * M_PI;
+
+    // Centreline of the tunnel; it starts at the origin heading along z
+    Eigen::Vector3d centreline(const TunnelParameters& params, const double z)
+    {
+        return Eigen::Vector3d(params.bend * (1 - std::cos(two_pi * z / params.bend_length)),
+                               0.5 * params.bend * (1 - std::cos(two_pi * z / (0.7 * params.bend_length))),
+                               z);
+    }
+
+    Eigen::Vector3d centrelineSlope(const TunnelParameters& params, const double z)
+    {
+        return Eigen::Vector3d(params.bend * two_pi / params.bend_length * std::sin(two_pi * z / params.bend_length),
+                               0.5 * params.bend * two_pi / (0.7 * params.bend_length) * std::sin(two_pi * z / (0.7 * params.bend_length)),
+                               1);
+    }
+
+    // Distance from the centreline to the wall; fixed in the world so every sweep sees the same surface
+    double wallRadius(const TunnelParameters& params, const double theta, const double z)
+    {
+        double r = params.radius + params.roughness * std::sin(3 * theta + z / 1700) * std::cos(5 * theta - z / 2300);
+        if (std::fmod(z, params.rib_spacing) < 200)
+        {
+            r -= params.rib_height;
+        }
+        return r;
+    }
+
+    // Each frame, and each reading of a frame, gets its own reproducible stream of random numbers
+    std::mt19937 generatorFor(const TunnelParameters& params, const size_t frame, const size_t sample)
+    {
+        std::seed_seq seq {params.seed, static_cast<uint32_t>(frame), static_cast<uint32_t>(sample)};
+        return std::mt19937(seq);
+    }
+
+    void writePoseRow(std::ofstream& out, const size_t frame, const TransformData& t)
+    {
+        out << frame << ";" << t.rotx << ";" << t.roty << ";" << t.rotz << ";"
+            << t.dx << ";" << t.dy << ";" << t.dz << ";" << t.confidence << "\n";
+    }
+}
+
+TransformData groundTruthPose(const TunnelParameters& params, const size_t frame)
+{
+    // The drone follows the centreline, pointing along it, with a slow roll
+    const double z = frame * params.step;
+    const Eigen::Vector3d position = centreline(params, z);
+    const Eigen::Vector3d slope = centrelineSlope(params, z);
+    TransformData t;
+    t.dx = position.x();
+    t.dy = position.y();
+    t.dz = position.z();
+    t.rotx = std::atan(slope.y());
+    t.roty = -std::atan(slope.x());
+    t.rotz = 0.05 * std::pow(std::sin(M_PI * z / 25000), 2);
+    t.confidence = 1;
+    return t;
+}
+
+TransformData priorPose(const TunnelParameters& params, const size_t frame, const size_t sample)
+{
+    // The first frame defines the map's origin, so its pose is exact
+    TransformData t = groundTruthPose(params, frame);
+    t.confidence = params.prior_confidence;
+    if (frame == 0)
+    {
+        return t;
+    }
+    std::mt19937 rng = generatorFor(params, frame, sample + 1);
+    std::normal_distribution<double> translation_noise (0, params.prior_noise);
+    std::normal_distribution<double> angle_noise (0, params.prior_angle_noise);
+    t.dx += translation_noise(rng);
+    t.dy += translation_noise(rng);
+    t.dz += translation_noise(rng);
+    t.rotx += angle_noise(rng);
+    t.roty += angle_noise(rng);
+    t.rotz += angle_noise(rng);
+    return t;
+}
+
+void generateTunnelSweep(const TunnelParameters& params, const size_t frame, PointCloudT& cloud)
+{
+    // Points are placed on the wall in world coordinates, then moved into the drone's frame
+    const TransformData pose = groundTruthPose(params, frame);
+    const Eigen::Affine3f world_to_sensor = pose.affine().inverse();
+
+    std::mt19937 rng = generatorFor(params, frame, 0);
+    std::uniform_real_distribution<double> angle (0, two_pi);
+    std::uniform_real_distribution<double> range (params.min_range, params.max_range);
+    std::uniform_real_distribution<double> unit (0, 1);
+    std::normal_distribution<float> noise (0, params.sensor_noise);
+
+    cloud.clear();
+    cloud.resize(params.points_per_frame);
+    for (PointT& p : cloud.points)
+    {
+        const double theta = angle(rng);
+        const double z = pose.dz + range(rng);
+        const double r = wallRadius(params, theta, z);
+        const Eigen::Vector3d world = centreline(params, z) + Eigen::Vector3d(r * std::cos(theta), r * std::sin(theta), 0);
+        const Eigen::Vector3f sensor = world_to_sensor * world.cast<float>();
+        p = PointT(sensor.x() + noise(rng), sensor.y() + noise(rng), sensor.z() + noise(rng));
+        if (unit(rng) < params.nan_fraction)
+        {
+            p.x = p.y = p.z = std::numeric_limits<float>::quiet_NaN();
+        }
+    }
+    cloud.width = cloud.points.size();
+    cloud.height = 1;
+    cloud.is_dense = params.nan_fraction <= 0;
+}
+
+void writeTunnelDataset(const TunnelParameters& params, const std::string& directory)
+{
+    std::ofstream transforms (directory + "/transforms.txt");
+    std::ofstream ground_truth (directory + "/ground_truth.txt");
+    if (!transforms || !ground_truth)
+    {
+        throw std::runtime_error("Could not write the dataset to " + directory + ".");
+    }
+    transforms.precision(9);
+    ground_truth.precision(9);
+    transforms << "frame;rotx;roty;rotz;dx;dy;dz;confidence\n";
+    ground_truth << "frame;rotx;roty;rotz;dx;dy;dz;confidence\n";
+
+    PointCloudT cloud;
+    for (size_t frame = 0; frame < params.num_frames; ++frame)
+    {
+        generateTunnelSweep(params, frame, cloud);
+        writePCD(directory + "/PCD" + std::to_string(frame) + ".pcd", cloud, PCDFormat::Binary);
+
+        // registerClouds averages 10 readings per cloud
+        for (size_t sample = 0; sample < 10; ++sample)
+        {
+            writePoseRow(transforms, frame, priorPose(params, frame, sample));
+        }
+        writePoseRow(ground_truth, frame, groundTruthPose(params, frame));
+    }
+}
+
+void poseError(const Eigen::Matrix4f& estimate, const Eigen::Matrix4f& truth, double& translation, double& rotation)
+{
+    const Eigen::Matrix4f difference = truth.inverse() * estimate;
+    translation = difference.block<3, 1>(0, 3).norm();
+    const double cos_angle = (difference.block<3, 3>(0, 0).trace() - 1) / 2;
+    rotation = std::acos(std::min(1.0, std::max(-1.0, cos_angle)));
+}
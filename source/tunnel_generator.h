@@ -0,0 +1,53 @@
+#ifndef TUNNEL_GENERATOR_H
+#define TUNNEL_GENERATOR_H
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <stitched_cloud.h>
+
+// Shape of a synthetic tunnel and of the sweeps taken while flying along it
+// Distances are in the same units as the real data (millimetres), and the drone travels along z
+struct TunnelParameters
+{
+    size_t num_frames = 20;
+    size_t points_per_frame = 50000;
+    uint32_t seed = 1;
+
+    double radius = 3000;           // Mean radius of the tunnel
+    double roughness = 150;         // Amplitude of the bumps on the tunnel wall
+    double rib_spacing = 2000;      // Distance between the support ribs along the tunnel
+    double rib_height = 200;
+    double bend = 1500;             // Sideways amplitude of the tunnel centreline
+    double bend_length = 60000;     // Wavelength of the centreline
+
+    double step = 1000;             // Distance travelled between frames
+    double min_range = 500;         // Points are seen from min_range to max_range ahead of the drone
+    double max_range = 10000;
+    double sensor_noise = 10;       // Standard deviation of the noise on each point
+    double nan_fraction = 0.02;     // Fraction of returns that are missing
+
+    double prior_noise = 100;       // Standard deviation of the error in the supplied translations
+    double prior_angle_noise = 0.01;// Standard deviation of the error in the supplied rotations (radians)
+    double prior_confidence = 0.8;
+};
+
+// Ground-truth pose of the drone at 'frame'; frame 0 is the origin
+TransformData groundTruthPose(const TunnelParameters& params, const size_t frame);
+
+// Noisy estimate of the pose at 'frame', as an onboard sensor would supply it
+// 'sample' picks one of several readings for the same frame
+TransformData priorPose(const TunnelParameters& params, const size_t frame, const size_t sample = 0);
+
+// The sweep taken at 'frame', in the drone's own frame; the same seed always gives the same points
+void generateTunnelSweep(const TunnelParameters& params, const size_t frame, PointCloudT& cloud);
+
+// Writes PCD<i>.pcd for every frame, the transformation file read by registerClouds (10 readings per frame)
+// and ground_truth.txt (one row per frame) to 'directory'
+void writeTunnelDataset(const TunnelParameters& params, const std::string& directory);
+
+// Translation (same units as the cloud) and rotation (radians) between two poses
+void poseError(const Eigen::Matrix4f& estimate, const Eigen::Matrix4f& truth, double& translation, double& rotation);
+
+#endif
@@ -0,0 +1,238 @@
+#include <voxel_correspondence.h>
+
+#include <cmath>
+#include <limits>
+
+#include <voxel_hash_index.h>
+
+namespace
+{
+    // Cell coordinates are packed as in VoxelHashIndex, 21 bits each
+    const int cell_offset = 1 << 20;
+    const uint64_t empty_key = ~0ULL;
+
+    // Points of a cell are measured in chunks of this many at a time
+    const uint32_t chunk_size = 64;
+}
+
+uint64_t FlatVoxelGrid::keyOf(const int x, const int y, const int z) const
+{
+    const uint64_t mask = (1 << 21) - 1;
+    return  (static_cast<uint64_t>(x + cell_offset) & mask)
+         | ((static_cast<uint64_t>(y + cell_offset) & mask) << 21)
+         | ((static_cast<uint64_t>(z + cell_offset) & mask) << 42);
+}
+
+const FlatVoxelGrid::Slot* FlatVoxelGrid::find(const uint64_t key) const
+{
+    // Linear probing; the table is never more than half full, so runs stay short
+    const size_t mask = slots.size() - 1;
+    for (size_t h = VoxelHashIndex::KeyHash()(key) & mask; ; h = (h + 1) & mask)
+    {
+        if (slots[h].key == key)
+        {
+            return &slots[h];
+        }
+        if (slots[h].key == empty_key)
+        {
+            return nullptr;
+        }
+    }
+}
+
+void FlatVoxelGrid::build(const PointCloudT& cloud)
+{
+    // Counting sort by cell: count the points of each cell, turn the counts into offsets, then scatter the points
+    size_t capacity = 16;
+    while (capacity < 2 * cloud.size())
+    {
+        capacity *= 2;
+    }
+    slots.assign(capacity, Slot {empty_key, 0, 0});
+    const size_t mask = capacity - 1;
+
+    const uint32_t no_slot = std::numeric_limits<uint32_t>::max();
+    std::vector<uint32_t> slot_of (cloud.size(), no_slot);
+    for (size_t i = 0; i < cloud.size(); ++i)
+    {
+        const PointT& p = cloud.points[i];
+        if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+        {
+            continue;
+        }
+        const uint64_t key = keyOf(static_cast<int>(std::floor(p.x * inv_cell_size)),
+                                   static_cast<int>(std::floor(p.y * inv_cell_size)),
+                                   static_cast<int>(std::floor(p.z * inv_cell_size)));
+        size_t h = VoxelHashIndex::KeyHash()(key) & mask;
+        while (slots[h].key != empty_key && slots[h].key != key)
+        {
+            h = (h + 1) & mask;
+        }
+        slots[h].key = key;
+        ++slots[h].count;
+        slot_of[i] = h;
+    }
+
+    uint32_t offset = 0;
+    for (Slot& slot : slots)
+    {
+        slot.begin = offset;
+        offset += slot.count;
+        slot.count = 0;
+    }
+
+    xs.resize(offset);
+    ys.resize(offset);
+    zs.resize(offset);
+    indices.resize(offset);
+    for (size_t i = 0; i < cloud.size(); ++i)
+    {
+        if (slot_of[i] == no_slot)
+        {
+            continue;
+        }
+        Slot& slot = slots[slot_of[i]];
+        const uint32_t j = slot.begin + slot.count++;
+        xs[j] = cloud.points[i].x;
+        ys[j] = cloud.points[i].y;
+        zs[j] = cloud.points[i].z;
+        indices[j] = i;
+    }
+}
+
+int FlatVoxelGrid::closest(const PointT& point, const float max_sqr_distance, float& sqr_distance) const
+{
+    int best = -1;
+    sqr_distance = max_sqr_distance;
+    if (indices.empty())
+    {
+        return best;
+    }
+
+    // Distances from the point to the lower and upper faces of its own cell along each axis
+    const float f[3] = {point.x * inv_cell_size, point.y * inv_cell_size, point.z * inv_cell_size};
+    int c[3];
+    float gap[3][3];
+    for (int a = 0; a < 3; ++a)
+    {
+        c[a] = static_cast<int>(std::floor(f[a]));
+        gap[a][0] = (f[a] - c[a]) * cell_size;
+        gap[a][1] = 0;
+        gap[a][2] = cell_size - gap[a][0];
+    }
+
+    float d[chunk_size];
+    for (int dx = 0; dx < 3; ++dx)
+    {
+        for (int dy = 0; dy < 3; ++dy)
+        {
+            for (int dz = 0; dz < 3; ++dz)
+            {
+                // Cells that cannot hold anything closer than the best so far are not looked up
+                // The point's own cell has no gap, so it is always searched first
+                const int ox = (dx + 1) % 3, oy = (dy + 1) % 3, oz = (dz + 1) % 3;
+                const float gx = gap[0][ox], gy = gap[1][oy], gz = gap[2][oz];
+                if (gx*gx + gy*gy + gz*gz >= sqr_distance)
+                {
+                    continue;
+                }
+                const Slot* slot = find(keyOf(c[0] + ox - 1, c[1] + oy - 1, c[2] + oz - 1));
+                if (!slot)
+                {
+                    continue;
+                }
+
+                for (uint32_t begin = slot->begin; begin < slot->begin + slot->count; begin += chunk_size)
+                {
+                    const uint32_t n = std::min(chunk_size, slot->begin + slot->count - begin);
+                    const float* x = &xs[begin];
+                    const float* y = &ys[begin];
+                    const float* z = &zs[begin];
+                    // No dependencies between points and one array per axis, so this loop vectorises at -O3, as in the
+                    // default Release build
+                    for (uint32_t j = 0; j < n; ++j)
+                    {
+                        const float ex = x[j] - point.x, ey = y[j] - point.y, ez = z[j] - point.z;
+                        d[j] = ex*ex + ey*ey + ez*ez;
+                    }
+                    for (uint32_t j = 0; j < n; ++j)
+                    {
+                        if (d[j] < sqr_distance)
+                        {
+                            sqr_distance = d[j];
+                            best = indices[begin + j];
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return best;
+}
+
+bool VoxelHashCorrespondence::prepare()
+{
+    // Stands in for initCompute, which would build the kd-tree this class replaces
+    if (!target_ || !pcl::PCLBase<PointT>::initCompute())
+    {
+        return false;
+    }
+    if (target_cloud_updated_)
+    {
+        target_grid.build(*target_);
+        target_cloud_updated_ = false;
+    }
+    return true;
+}
+
+void VoxelHashCorrespondence::determineCorrespondences(pcl::Correspondences& correspondences, double max_distance)
+{
+    correspondences.clear();
+    if (!prepare())
+    {
+        return;
+    }
+    const float max_sqr_distance = std::min<double>(max_distance * max_distance, std::numeric_limits<float>::max());
+
+    correspondences.resize(indices_->size());
+    size_t found = 0;
+    for (const int i : *indices_)
+    {
+        float sqr_distance;
+        const int match = target_grid.closest(input_->points[i], max_sqr_distance, sqr_distance);
+        if (match >= 0)
+        {
+            correspondences[found++] = pcl::Correspondence(i, match, sqr_distance);
+        }
+    }
+    correspondences.resize(found);
+}
+
+void VoxelHashCorrespondence::determineReciprocalCorrespondences(pcl::Correspondences& correspondences, double max_distance)
+{
+    // Only pairs that are each other's closest point are kept
+    correspondences.clear();
+    if (!prepare())
+    {
+        return;
+    }
+    if (source_cloud_updated_)
+    {
+        source_grid.build(*input_);
+        source_cloud_updated_ = false;
+    }
+    const float max_sqr_distance = std::min<double>(max_distance * max_distance, std::numeric_limits<float>::max());
+
+    correspondences.resize(indices_->size());
+    size_t found = 0;
+    for (const int i : *indices_)
+    {
+        float sqr_distance, back_sqr_distance;
+        const int match = target_grid.closest(input_->points[i], max_sqr_distance, sqr_distance);
+        if (match >= 0 && source_grid.closest(target_->points[match], max_sqr_distance, back_sqr_distance) == i)
+        {
+            correspondences[found++] = pcl::Correspondence(i, match, sqr_distance);
+        }
+    }
+    correspondences.resize(found);
+}
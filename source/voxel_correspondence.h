@@ -0,0 +1,73 @@
+#ifndef VOXEL_CORRESPONDENCE_H
+#define VOXEL_CORRESPONDENCE_H
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl/registration/correspondence_estimation.h>
+
+typedef pcl::PointXYZ PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+
+// Snapshot of a cloud bucketed into cubic cells, laid out for fast closest point queries
+// The coordinates of each cell's points are stored contiguously, one array per axis, and the cells are found through
+// an open addressing hash table, so a query touches a few flat arrays instead of following pointers through buckets
+// Unlike VoxelHashIndex it is not updated in place; it is rebuilt in one pass whenever the cloud changes
+class FlatVoxelGrid
+{
+public:
+    FlatVoxelGrid(const double cell_size) : cell_size(cell_size), inv_cell_size(1.0 / cell_size) {}
+
+    void build(const PointCloudT& cloud);
+
+    // Closest point to 'point' in its own cell and the 26 around it, if any is nearer than 'max_sqr_distance'
+    // Every point within one cell size is in those cells, so out to that distance the result is exact
+    // Returns -1 when there is none
+    int closest(const PointT& point, const float max_sqr_distance, float& sqr_distance) const;
+
+    double cellSize() const { return cell_size; }
+
+private:
+    struct Slot
+    {
+        uint64_t key;
+        uint32_t begin;
+        uint32_t count;
+    };
+
+    uint64_t keyOf(const int x, const int y, const int z) const;
+    const Slot* find(const uint64_t key) const;
+
+    double cell_size;
+    float inv_cell_size;
+    std::vector<Slot> slots;    // Power of two in size, at most half full
+    std::vector<float> xs, ys, zs;
+    std::vector<int> indices;   // Index in the cloud of each point
+};
+
+// Correspondence estimation for ICP that looks up the closest target point in a FlatVoxelGrid
+// Correspondences further apart than the cell size may be missed, so ICP's maximum correspondence distance should be
+// no larger than it; within that distance the correspondences are the same as pcl::CorrespondenceEstimation's
+class VoxelHashCorrespondence : public pcl::registration::CorrespondenceEstimationBase<PointT, PointT>
+{
+public:
+    typedef boost::shared_ptr<VoxelHashCorrespondence> Ptr;
+
+    VoxelHashCorrespondence(const double cell_size) : target_grid(cell_size), source_grid(cell_size) {}
+
+    void determineCorrespondences(pcl::Correspondences& correspondences,
+                                  double max_distance = std::numeric_limits<double>::max());
+    void determineReciprocalCorrespondences(pcl::Correspondences& correspondences,
+                                            double max_distance = std::numeric_limits<double>::max());
+    boost::shared_ptr<pcl::registration::CorrespondenceEstimationBase<PointT, PointT> > clone() const
+    {
+        return Ptr(new VoxelHashCorrespondence(*this));
+    }
+
+private:
+    bool prepare();
+
+    FlatVoxelGrid target_grid;
+    FlatVoxelGrid source_grid;
+};
+
+#endif
@@ -0,0 +1,237 @@
+#include <voxel_downsampler.h>
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <thread>
+
+VoxelDownsampler::VoxelDownsampler(const double leaf_size, const Mode mode, const int num_threads)
+    : leaf_size(leaf_size), inv_leaf_size(1.0 / leaf_size), mode(mode), num_threads(std::max(num_threads, 1))
+{
+}
+
+VoxelDownsampler::Key VoxelDownsampler::keyOf(const PointT& p) const
+{
+    Key k;
+    k.x = static_cast<int>(std::floor(p.x * inv_leaf_size));
+    k.y = static_cast<int>(std::floor(p.y * inv_leaf_size));
+    k.z = static_cast<int>(std::floor(p.z * inv_leaf_size));
+    return k;
+}
+
+int VoxelDownsampler::threadsFor(const size_t count) const
+{
+    // Small inputs are not worth the cost of starting threads
+    const size_t min_per_thread = 16384;
+    return std::max<int>(1, std::min<size_t>(num_threads, count / min_per_thread));
+}
+
+template <typename Function>
+void VoxelDownsampler::parallelFor(const int threads, const size_t count, Function function) const
+{
+    // Splits [0, count) into one contiguous range per thread and calls function(thread, begin, end)
+    std::vector<std::thread> workers;
+    for (int t = 1; t < threads; ++t)
+    {
+        workers.push_back(std::thread(function, t, count * t / threads, count * (t + 1) / threads));
+    }
+    function(0, 0, count / threads);
+    for (std::thread& worker : workers)
+    {
+        worker.join();
+    }
+}
+
+void VoxelDownsampler::filter(PointCloudT& cloud) const
+{
+    const int threads = threadsFor(cloud.size());
+
+    // Each thread sums its share of the points into its own map, and the maps are merged afterwards
+    std::vector<VoxelMap> partial (threads);
+    parallelFor(threads, cloud.size(), [&](const int t, const size_t begin, const size_t end)
+    {
+        VoxelMap& map = partial[t];
+        map.reserve((end - begin) / 8);
+        for (size_t i = begin; i < end; ++i)
+        {
+            const PointT& p = cloud.points[i];
+            if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+            {
+                continue;
+            }
+            Voxel& v = map[keyOf(p)];
+            v.x += p.x;
+            v.y += p.y;
+            v.z += p.z;
+            ++v.count;
+        }
+    });
+    VoxelMap& merged = partial[0];
+    for (int t = 1; t < threads; ++t)
+    {
+        for (const auto& entry : partial[t])
+        {
+            merged[entry.first].merge(entry.second);
+        }
+        VoxelMap().swap(partial[t]);
+    }
+
+    // Order the voxels so the output does not depend on how the points were split
+    std::vector<std::pair<Key, const Voxel*> > sorted;
+    sorted.reserve(merged.size());
+    for (const auto& entry : merged)
+    {
+        sorted.push_back(std::make_pair(entry.first, &entry.second));
+    }
+    std::sort(sorted.begin(), sorted.end(),
+              [](const std::pair<Key, const Voxel*>& a, const std::pair<Key, const Voxel*>& b) { return a.first < b.first; });
+
+    std::vector<PointT, Eigen::aligned_allocator<PointT> > output (sorted.size());
+    if (mode == Centroid)
+    {
+        for (size_t i = 0; i < sorted.size(); ++i)
+        {
+            output[i] = sorted[i].second->centroid();
+        }
+    }
+    else
+    {
+        // Second pass: each thread finds the point closest to the centroid of every voxel it touches
+        std::unordered_map<Key, int, KeyHash> slot_of;
+        slot_of.reserve(sorted.size());
+        std::vector<PointT, Eigen::aligned_allocator<PointT> > centroids (sorted.size());
+        for (size_t i = 0; i < sorted.size(); ++i)
+        {
+            slot_of[sorted[i].first] = i;
+            centroids[i] = sorted[i].second->centroid();
+        }
+        const std::pair<float, int> unset (std::numeric_limits<float>::max(), -1);
+        std::vector<std::vector<std::pair<float, int> > > best (threads, std::vector<std::pair<float, int> >(sorted.size(), unset));
+        parallelFor(threads, cloud.size(), [&](const int t, const size_t begin, const size_t end)
+        {
+            for (size_t i = begin; i < end; ++i)
+            {
+                const PointT& p = cloud.points[i];
+                if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+                {
+                    continue;
+                }
+                const int slot = slot_of.find(keyOf(p))->second;
+                const PointT& c = centroids[slot];
+                const float d = (p.x - c.x) * (p.x - c.x) + (p.y - c.y) * (p.y - c.y) + (p.z - c.z) * (p.z - c.z);
+                // Ties go to the earliest point, whichever thread found it
+                if (d < best[t][slot].first)
+                {
+                    best[t][slot] = std::make_pair(d, static_cast<int>(i));
+                }
+            }
+        });
+        for (size_t i = 0; i < sorted.size(); ++i)
+        {
+            std::pair<float, int> b = best[0][i];
+            for (int t = 1; t < threads; ++t)
+            {
+                if (best[t][i].first < b.first)
+                {
+                    b = best[t][i];
+                }
+            }
+            output[i] = cloud.points[b.second];
+        }
+    }
+
+    cloud.points.swap(output);
+    cloud.width = cloud.points.size();
+    cloud.height = 1;
+    cloud.is_dense = true;
+}
+
+void VoxelDownsampler::add(const PointT* points, const size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+    {
+        const PointT& p = points[i];
+        if (!std::isfinite(p.x) || !std::isfinite(p.y) || !std::isfinite(p.z))
+        {
+            continue;
+        }
+        if (2 * (voxels.size() + 1) > slots.size())
+        {
+            growSlots();
+        }
+        const Key key = keyOf(p);
+        const size_t mask = slots.size() - 1;
+        size_t h = KeyHash()(key) & mask;
+        while (slots[h].voxel >= 0 && !(slots[h].key == key))
+        {
+            h = (h + 1) & mask;
+        }
+        if (slots[h].voxel < 0)
+        {
+            slots[h].key = key;
+            slots[h].voxel = voxels.size();
+            voxels.push_back(Voxel());
+            std::copy(p.data, p.data + 3, voxels.back().nearest);
+        }
+        Voxel& v = voxels[slots[h].voxel];
+        v.x += p.x;
+        v.y += p.y;
+        v.z += p.z;
+        ++v.count;
+
+        if (mode == NearestToCentroid && v.count > 1)
+        {
+            const PointT c = v.centroid();
+            const float* n = v.nearest;
+            const float d_new = (p.x - c.x) * (p.x - c.x) + (p.y - c.y) * (p.y - c.y) + (p.z - c.z) * (p.z - c.z);
+            const float d_old = (n[0] - c.x) * (n[0] - c.x) + (n[1] - c.y) * (n[1] - c.y) + (n[2] - c.z) * (n[2] - c.z);
+            if (d_new < d_old)
+            {
+                std::copy(p.data, p.data + 3, v.nearest);
+            }
+        }
+    }
+}
+
+void VoxelDownsampler::getCloud(PointCloudT& output) const
+{
+    output.points.resize(voxels.size());
+    for (size_t i = 0; i < voxels.size(); ++i)
+    {
+        const Voxel& v = voxels[i];
+        output.points[i] = (mode == Centroid) ? v.centroid() : PointT(v.nearest[0], v.nearest[1], v.nearest[2]);
+    }
+    output.width = output.points.size();
+    output.height = 1;
+    output.is_dense = true;
+}
+
+void VoxelDownsampler::growSlots()
+{
+    // Doubles the table and re-inserts the occupied slots; linear probing, as the table is never more than half full
+    std::vector<Slot> old (std::max<size_t>(1024, 2 * slots.size()), Slot {Key(), -1});
+    old.swap(slots);
+    const size_t mask = slots.size() - 1;
+    for (const Slot& slot : old)
+    {
+        if (slot.voxel < 0)
+        {
+            continue;
+        }
+        size_t h = KeyHash()(slot.key) & mask;
+        while (slots[h].voxel >= 0)
+        {
+            h = (h + 1) & mask;
+        }
+        slots[h] = slot;
+    }
+}
+
+void VoxelDownsampler::clear()
+{
+    for (Slot& slot : slots)
+    {
+        slot.voxel = -1;
+    }
+    voxels.clear();
+}
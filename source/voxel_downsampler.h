@@ -0,0 +1,95 @@
+#ifndef VOXEL_DOWNSAMPLER_H
+#define VOXEL_DOWNSAMPLER_H
+
+#include <unordered_map>
+#include <vector>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+typedef pcl::PointXYZ PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+
+// Voxel grid downsampling backed by a hash map of occupied voxels
+// Unlike pcl::VoxelGrid there is no dense index over the bounding box, so any extent can be downsampled
+// (voxel coordinates are ints, so each axis reaches 2^31 voxels either side of zero), and the points can be split
+// across threads
+class VoxelDownsampler
+{
+public:
+    enum Mode
+    {
+        Centroid,           // Each voxel becomes the mean of its points
+        NearestToCentroid   // Each voxel becomes the input point closest to that mean
+    };
+
+    VoxelDownsampler(const double leaf_size, const Mode mode = Centroid, const int num_threads = 1);
+
+    // Replaces 'cloud' with one point per occupied voxel, ordered by voxel so the result does not
+    // depend on the number of threads; non-finite points are dropped
+    void filter(PointCloudT& cloud) const;
+
+    // Incremental use: voxels persist between calls, so new points merge into the voxels already seen
+    // In NearestToCentroid mode each voxel keeps whichever point was closest to its mean when that point arrived
+    // Non-finite points are skipped, as in filter()
+    void add(const PointT* points, const size_t count);
+    void add(const PointCloudT& cloud) { add(cloud.points.data(), cloud.size()); }
+    void getCloud(PointCloudT& output) const;      // One point per voxel, in the order the voxels were first seen
+    void clear();                                   // Forgets the voxels but keeps the storage for the next use
+    size_t size() const { return voxels.size(); }
+    double leafSize() const { return leaf_size; }
+
+private:
+    struct Key
+    {
+        int x, y, z;
+        bool operator==(const Key& other) const { return x == other.x && y == other.y && z == other.z; }
+        bool operator<(const Key& other) const
+        {
+            return z != other.z ? z < other.z : (y != other.y ? y < other.y : x < other.x);
+        }
+    };
+    struct KeyHash
+    {
+        size_t operator()(const Key& k) const
+        {
+            uint64_t h = static_cast<uint32_t>(k.x);
+            h = h * 0x9E3779B97F4A7C15ULL + static_cast<uint32_t>(k.y);
+            h = h * 0x9E3779B97F4A7C15ULL + static_cast<uint32_t>(k.z);
+            return h ^ (h >> 29);
+        }
+    };
+    struct Voxel
+    {
+        double x = 0, y = 0, z = 0;
+        int count = 0;
+        float nearest[3];   // Plain floats rather than a PointT, which needs aligned storage
+
+        void merge(const Voxel& other) { x += other.x; y += other.y; z += other.z; count += other.count; }
+        PointT centroid() const { return PointT(x / count, y / count, z / count); }
+    };
+    typedef std::unordered_map<Key, Voxel, KeyHash> VoxelMap;
+
+    Key keyOf(const PointT& p) const;
+    int threadsFor(const size_t count) const;
+    template <typename Function> void parallelFor(const int threads, const size_t count, Function function) const;
+
+    double leaf_size;
+    float inv_leaf_size;
+    Mode mode;
+    int num_threads;
+
+    struct Slot
+    {
+        Key key;
+        int voxel;      // Index into voxels, or -1 when the slot is empty
+    };
+    void growSlots();
+
+    // Persistent voxels for incremental use, found through an open addressing table
+    // Clearing keeps the storage of both, so a downsampler reused frame after frame stops allocating
+    std::vector<Slot> slots;    // Power of two in size, at most half full
+    std::vector<Voxel> voxels;
+};
+
+#endif
@@ -0,0 +1,376 @@
+#include <voxel_hash_index.h>
+
+#include <limits>
+
+// Cell coordinates are packed into 21 bits each, which covers +/- 2^20 cells along every axis
+static const int cell_offset = 1 << 20;
+
+VoxelHashIndex::VoxelHashIndex(const double cell_size)
+    : pcl::search::KdTree<PointT>(true), cell_size(cell_size), inv_cell_size(1.0 / cell_size)
+{
+    min_cell = {0, 0, 0};
+    max_cell = {-1, -1, -1};
+}
+
+void VoxelHashIndex::setInputCloud(const PointCloudConstPtr& cloud, const IndicesConstPtr& indices)
+{
+    if (cloud == input_ && !indices && cloud->size() >= cell_keys.size())
+    {
+        // Already indexed; only pick up points that have been appended since
+        insert(cell_keys.size());
+        return;
+    }
+    input_ = cloud;
+    indices_ = indices;
+    rebuild();
+}
+
+void VoxelHashIndex::rebuild()
+{
+    cells.clear();
+    cell_keys.clear();
+    min_cell = {0, 0, 0};
+    max_cell = {-1, -1, -1};
+    if (input_)
+    {
+        insert(0);
+    }
+}
+
+VoxelHashIndex::Cell VoxelHashIndex::cellOf(const PointT& p) const
+{
+    Cell c;
+    c.x = static_cast<int>(std::floor(p.x * inv_cell_size));
+    c.y = static_cast<int>(std::floor(p.y * inv_cell_size));
+    c.z = static_cast<int>(std::floor(p.z * inv_cell_size));
+    return c;
+}
+
+uint64_t VoxelHashIndex::keyOf(const Cell& c)
+{
+    const uint64_t mask = (1 << 21) - 1;
+    return  (static_cast<uint64_t>(c.x + cell_offset) & mask)
+         | ((static_cast<uint64_t>(c.y + cell_offset) & mask) << 21)
+         | ((static_cast<uint64_t>(c.z + cell_offset) & mask) << 42);
+}
+
+VoxelHashIndex::Cell VoxelHashIndex::cellOfKey(const uint64_t key)
+{
+    const uint64_t mask = (1 << 21) - 1;
+    Cell c;
+    c.x = static_cast<int>(key & mask) - cell_offset;
+    c.y = static_cast<int>((key >> 21) & mask) - cell_offset;
+    c.z = static_cast<int>((key >> 42) & mask) - cell_offset;
+    return c;
+}
+
+void VoxelHashIndex::insert(const size_t first)
+{
+    for (size_t i = first; i < input_->size(); ++i)
+    {
+        insertPoint(i);
+    }
+}
+
+void VoxelHashIndex::insertPoint(const int index)
+{
+    const PointT& p = input_->points[index];
+    const Cell c = cellOf(p);
+    const uint64_t key = keyOf(c);
+    cells[key].push_back({p.x, p.y, p.z, index});
+
+    if (static_cast<size_t>(index) >= cell_keys.size())
+    {
+        cell_keys.resize(index + 1);
+    }
+    cell_keys[index] = key;
+
+    if (max_cell.x < min_cell.x)
+    {
+        min_cell = c;
+        max_cell = c;
+    }
+    else
+    {
+        min_cell = {std::min(min_cell.x, c.x), std::min(min_cell.y, c.y), std::min(min_cell.z, c.z)};
+        max_cell = {std::max(max_cell.x, c.x), std::max(max_cell.y, c.y), std::max(max_cell.z, c.z)};
+    }
+}
+
+void VoxelHashIndex::removeEntry(const uint64_t key, const int index)
+{
+    auto it = cells.find(key);
+    if (it == cells.end())
+    {
+        return;
+    }
+    Bucket& bucket = it->second;
+    for (size_t i = 0; i < bucket.size(); ++i)
+    {
+        if (bucket[i].index == index)
+        {
+            bucket[i] = bucket.back();
+            bucket.pop_back();
+            break;
+        }
+    }
+    if (bucket.empty())
+    {
+        cells.erase(it);
+    }
+}
+
+void VoxelHashIndex::renumberEntry(const uint64_t key, const int from, const int to)
+{
+    for (Entry& e : cells[key])
+    {
+        if (e.index == from)
+        {
+            e.index = to;
+            return;
+        }
+    }
+}
+
+void VoxelHashIndex::erase(std::vector<int> indices, PointCloudT& cloud)
+{
+    // Erasing from the highest index down means the point moved into a gap is never itself due for removal
+    std::sort(indices.begin(), indices.end(), std::greater<int>());
+    indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+    for (const int i : indices)
+    {
+        const int last = cloud.points.size() - 1;
+        removeEntry(cell_keys[i], i);
+        if (i != last)
+        {
+            renumberEntry(cell_keys[last], last, i);
+            cloud.points[i] = cloud.points[last];
+            cell_keys[i] = cell_keys[last];
+        }
+        cloud.points.pop_back();
+        cell_keys.pop_back();
+    }
+    cloud.width = cloud.points.size();
+    cloud.height = 1;
+}
+
+void VoxelHashIndex::eraseFront(const size_t count, PointCloudT& cloud)
+{
+    if (count == 0)
+    {
+        return;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        removeEntry(cell_keys[i], i);
+    }
+    for (auto& cell : cells)
+    {
+        for (Entry& e : cell.second)
+        {
+            e.index -= count;
+        }
+    }
+    cell_keys.erase(cell_keys.begin(), cell_keys.begin() + count);
+    cloud.points.erase(cloud.points.begin(), cloud.points.begin() + count);
+    cloud.width = cloud.points.size();
+    cloud.height = 1;
+}
+
+void VoxelHashIndex::update(const std::vector<int>& indices)
+{
+    for (const int i : indices)
+    {
+        removeEntry(cell_keys[i], i);
+        insertPoint(i);
+    }
+}
+
+std::vector<int> VoxelHashIndex::pointsNear(const PointCloudT& cloud, const double margin) const
+{
+    std::unordered_set<uint64_t, KeyHash> touched;
+    for (const PointT& p : cloud.points)
+    {
+        touched.insert(keyOf(cellOf(p)));
+    }
+
+    // Grow the touched cells by the margin
+    const int reach = static_cast<int>(std::ceil(margin * inv_cell_size));
+    std::unordered_set<uint64_t, KeyHash> region;
+    for (const uint64_t key : touched)
+    {
+        const Cell c = cellOfKey(key);
+        for (int x = c.x - reach; x <= c.x + reach; ++x)
+            for (int y = c.y - reach; y <= c.y + reach; ++y)
+                for (int z = c.z - reach; z <= c.z + reach; ++z)
+                    region.insert(keyOf({x, y, z}));
+    }
+
+    std::vector<int> indices;
+    for (const uint64_t key : region)
+    {
+        auto it = cells.find(key);
+        if (it == cells.end())
+        {
+            continue;
+        }
+        for (const Entry& e : it->second)
+        {
+            indices.push_back(e.index);
+        }
+    }
+    std::sort(indices.begin(), indices.end());
+    return indices;
+}
+
+int VoxelHashIndex::maxRing(const Cell& centre) const
+{
+    // Beyond this ring every occupied cell has been visited
+    int ring = 0;
+    ring = std::max(ring, std::max(std::abs(centre.x - min_cell.x), std::abs(centre.x - max_cell.x)));
+    ring = std::max(ring, std::max(std::abs(centre.y - min_cell.y), std::abs(centre.y - max_cell.y)));
+    ring = std::max(ring, std::max(std::abs(centre.z - min_cell.z), std::abs(centre.z - max_cell.z)));
+    return ring;
+}
+
+template <typename Visitor>
+void VoxelHashIndex::visitRing(const Cell& centre, const int ring, Visitor visit) const
+{
+    // Visits the occupied cells whose Chebyshev distance from 'centre' is exactly 'ring'
+    // Cells outside the occupied bounds are skipped without a lookup
+    const int x_lo = std::max(centre.x - ring, min_cell.x), x_hi = std::min(centre.x + ring, max_cell.x);
+    const int y_lo = std::max(centre.y - ring, min_cell.y), y_hi = std::min(centre.y + ring, max_cell.y);
+    const int z_lo = std::max(centre.z - ring, min_cell.z), z_hi = std::min(centre.z + ring, max_cell.z);
+    for (int x = x_lo; x <= x_hi; ++x)
+    {
+        const bool x_face = std::abs(x - centre.x) == ring;
+        for (int y = y_lo; y <= y_hi; ++y)
+        {
+            const bool xy_face = x_face || std::abs(y - centre.y) == ring;
+            // Inside the faces only the two z caps belong to this ring
+            const int z_step = (xy_face || ring == 0) ? 1 : 2 * ring;
+            for (int z = centre.z - ring; z <= centre.z + ring; z += z_step)
+            {
+                if (z < z_lo || z > z_hi)
+                {
+                    continue;
+                }
+                auto it = cells.find(keyOf({x, y, z}));
+                if (it != cells.end())
+                {
+                    visit(it->second);
+                }
+            }
+        }
+    }
+}
+
+int VoxelHashIndex::nearestKSearch(const PointT& point, int k, std::vector<int>& k_indices, std::vector<float>& k_sqr_distances) const
+{
+    k_indices.clear();
+    k_sqr_distances.clear();
+    if (k <= 0 || cells.empty())
+    {
+        return 0;
+    }
+
+    // Max-heap of the best candidates found so far
+    // Kept per thread between queries, so a search allocates nothing once it has grown
+    thread_local std::vector<std::pair<float, int> > heap;
+    heap.clear();
+    heap.reserve(k + 1);
+    auto consider = [&](const Bucket& bucket)
+    {
+        for (const Entry& e : bucket)
+        {
+            const float dx = e.x - point.x, dy = e.y - point.y, dz = e.z - point.z;
+            const float d = dx*dx + dy*dy + dz*dz;
+            if (heap.size() < static_cast<size_t>(k))
+            {
+                heap.push_back(std::make_pair(d, e.index));
+                std::push_heap(heap.begin(), heap.end());
+            }
+            else if (d < heap.front().first)
+            {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = std::make_pair(d, e.index);
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+    };
+
+    // Expand outwards one ring of cells at a time
+    // Anything outside ring r is at least r cells away, so the search can stop once the kth best is closer than that
+    const Cell centre = cellOf(point);
+    const int last_ring = maxRing(centre);
+    for (int r = 0; r <= last_ring; ++r)
+    {
+        visitRing(centre, r, consider);
+        const float reach = r * cell_size;
+        if (heap.size() == static_cast<size_t>(k) && heap.front().first <= reach * reach)
+        {
+            break;
+        }
+    }
+
+    std::sort_heap(heap.begin(), heap.end());
+    k_indices.reserve(heap.size());
+    k_sqr_distances.reserve(heap.size());
+    for (const auto& h : heap)
+    {
+        k_sqr_distances.push_back(h.first);
+        k_indices.push_back(h.second);
+    }
+    return k_indices.size();
+}
+
+int VoxelHashIndex::radiusSearch(const PointT& point, double radius, std::vector<int>& k_indices,
+                                 std::vector<float>& k_sqr_distances, unsigned int max_nn) const
+{
+    k_indices.clear();
+    k_sqr_distances.clear();
+    if (cells.empty())
+    {
+        return 0;
+    }
+
+    const float sqr_radius = radius * radius;
+    std::vector<std::pair<float, int> > found;
+    auto consider = [&](const Bucket& bucket)
+    {
+        for (const Entry& e : bucket)
+        {
+            const float dx = e.x - point.x, dy = e.y - point.y, dz = e.z - point.z;
+            const float d = dx*dx + dy*dy + dz*dz;
+            if (d <= sqr_radius)
+            {
+                found.push_back(std::make_pair(d, e.index));
+            }
+        }
+    };
+
+    const Cell centre = cellOf(point);
+    const int last_ring = std::min(static_cast<int>(std::ceil(radius * inv_cell_size)), maxRing(centre));
+    for (int r = 0; r <= last_ring; ++r)
+    {
+        visitRing(centre, r, consider);
+    }
+
+    // Keep the closest max_nn points, as the kd-tree does
+    if (sorted_results_ || (max_nn > 0 && found.size() > max_nn))
+    {
+        std::sort(found.begin(), found.end());
+    }
+    if (max_nn > 0 && found.size() > max_nn)
+    {
+        found.resize(max_nn);
+    }
+    k_indices.reserve(found.size());
+    k_sqr_distances.reserve(found.size());
+    for (const auto& f : found)
+    {
+        k_sqr_distances.push_back(f.first);
+        k_indices.push_back(f.second);
+    }
+    return k_indices.size();
+}
@@ -0,0 +1,102 @@
+#ifndef VOXEL_HASH_INDEX_H
+#define VOXEL_HASH_INDEX_H
+
+#include <unordered_map>
+#include <unordered_set>
+
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+#include <pcl/search/kdtree.h>
+
+typedef pcl::PointXYZ PointT;
+typedef pcl::PointCloud<PointT> PointCloudT;
+
+// Spatial index over a growing point cloud that is updated in place rather than rebuilt
+// Points are bucketed into a hash map of cubic cells, so inserting or erasing a point only touches its own cell
+// Derives from the PCL kd-tree so it can be handed to any PCL class that accepts a search method
+class VoxelHashIndex : public pcl::search::KdTree<PointT>
+{
+public:
+    typedef boost::shared_ptr<VoxelHashIndex> Ptr;
+
+    VoxelHashIndex(const double cell_size = 1000);
+
+    // Indexing the cloud that is already indexed only picks up newly appended points
+    // Any other cloud is indexed from scratch
+    void setInputCloud(const PointCloudConstPtr& cloud, const IndicesConstPtr& indices = IndicesConstPtr());
+
+    using pcl::search::KdTree<PointT>::nearestKSearch;
+    using pcl::search::KdTree<PointT>::radiusSearch;
+    int nearestKSearch(const PointT& point, int k, std::vector<int>& k_indices, std::vector<float>& k_sqr_distances) const;
+    int radiusSearch(const PointT& point, double radius, std::vector<int>& k_indices,
+                     std::vector<float>& k_sqr_distances, unsigned int max_nn = 0) const;
+
+    // Incremental updates; 'cloud' must be the indexed cloud
+    void insert(const size_t first);                                // Index the points from 'first' to the end of the cloud
+    void erase(std::vector<int> indices, PointCloudT& cloud);       // Remove points, filling the gaps from the back of the cloud
+    // Remove the first 'count' points, keeping the order of the rest; every remaining entry is renumbered
+    void eraseFront(const size_t count, PointCloudT& cloud);
+    void update(const std::vector<int>& indices);                   // Re-bucket points that have been moved
+    void rebuild();
+
+    // Applies the same removal as erase() to a container that runs parallel to the indexed cloud
+    template <typename Container>
+    static void swapRemove(std::vector<int> indices, Container& values)
+    {
+        std::sort(indices.begin(), indices.end(), std::greater<int>());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+        for (const int i : indices)
+        {
+            values[i] = values.back();
+            values.pop_back();
+        }
+    }
+
+    // Indices of every point in the cells within 'margin' of a cell touched by 'cloud', in ascending order
+    std::vector<int> pointsNear(const PointCloudT& cloud, const double margin) const;
+
+    size_t size() const { return cell_keys.size(); }
+    double cellSize() const { return cell_size; }
+    uint64_t cellKey(const int index) const { return cell_keys[index]; }
+
+    struct KeyHash
+    {
+        size_t operator()(const uint64_t key) const
+        {
+            // Packed keys differ mostly in the low bits of each field, so mix them before bucketing
+            uint64_t h = key * 0x9E3779B97F4A7C15ULL;
+            return h ^ (h >> 32);
+        }
+    };
+
+private:
+    struct Entry
+    {
+        float x, y, z;
+        int index;
+    };
+    typedef std::vector<Entry> Bucket;
+
+    struct Cell
+    {
+        int x, y, z;
+    };
+
+    Cell cellOf(const PointT& p) const;
+    static uint64_t keyOf(const Cell& c);
+    static Cell cellOfKey(const uint64_t key);
+    void insertPoint(const int index);
+    void removeEntry(const uint64_t key, const int index);
+    void renumberEntry(const uint64_t key, const int from, const int to);
+    template <typename Visitor> void visitRing(const Cell& centre, const int ring, Visitor visit) const;
+    int maxRing(const Cell& centre) const;
+
+    double cell_size;
+    float inv_cell_size;
+    std::unordered_map<uint64_t, Bucket, KeyHash> cells;
+    std::vector<uint64_t> cell_keys;    // Cell of each indexed point, by point index
+    Cell min_cell;                      // Bounds of the occupied cells, used to stop searches early
+    Cell max_cell;
+};
+
+#endif